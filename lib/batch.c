@@ -0,0 +1,219 @@
+#include "csv.h"
+#include "internal.h"
+#include "util/vec.h"
+#include "util/stringy.h"
+#include "util/util.h"
+
+/**
+ * Add columns up to `columns'. Rows already in
+ * the batch get empty fields for the new columns.
+ */
+void _batch_add_columns(struct csv_batch*, unsigned columns);
+
+/**
+ * Point the public arrays at the column vectors
+ */
+void _batch_publish(struct csv_batch*);
+
+/**
+ * Convert `field' into row `row' of a typed column
+ */
+void _batch_convert(struct csv_batch_column*, unsigned row, const struct csv_field*);
+
+struct csv_batch* csv_batch_new(unsigned capacity)
+{
+	struct csv_batch* batch = malloc_(sizeof(*batch));
+	return csv_batch_construct(batch, capacity);
+}
+
+struct csv_batch* csv_batch_construct(struct csv_batch* self, unsigned capacity)
+{
+	*self = (struct csv_batch) {
+	        .capacity = capacity,
+	};
+
+	self->_in = malloc_(sizeof(*self->_in));
+	*self->_in = (struct csv_batch_internal) {
+	        .record = csv_record_new(),
+	};
+
+	string_construct(&self->_in->arena);
+	vec_construct_(&self->_in->columns, struct csv_batch_column);
+	vec_construct_(&self->_in->offset_ptrs, size_t*);
+	vec_construct_(&self->_in->length_ptrs, unsigned*);
+	vec_construct_(&self->_in->value_ptrs, void*);
+	vec_construct_(&self->_in->status_ptrs, unsigned char*);
+
+	return self;
+}
+
+void csv_batch_free(struct csv_batch* self)
+{
+	csv_batch_destroy(self);
+	free_(self);
+}
+
+void csv_batch_destroy(struct csv_batch* self)
+{
+	struct csv_batch_column* it = vec_begin(&self->_in->columns);
+	for (; it != vec_end(&self->_in->columns); ++it) {
+		vec_destroy(&it->offsets);
+		vec_destroy(&it->lengths);
+		vec_destroy(&it->values);
+		vec_destroy(&it->status);
+	}
+	vec_destroy(&self->_in->columns);
+	vec_destroy(&self->_in->offset_ptrs);
+	vec_destroy(&self->_in->length_ptrs);
+	vec_destroy(&self->_in->value_ptrs);
+	vec_destroy(&self->_in->status_ptrs);
+	string_destroy(&self->_in->arena);
+	csv_record_free(self->_in->record);
+	free_(self->_in);
+}
+
+void _batch_add_columns(struct csv_batch* self, unsigned columns)
+{
+	for (; self->columns < columns; ++self->columns) {
+		struct csv_batch_column* col = vec_add_one(&self->_in->columns);
+		vec_construct_(&col->offsets, size_t);
+		vec_construct_(&col->lengths, unsigned);
+		vec_resize_and_zero(&col->offsets, self->capacity);
+		vec_resize_and_zero(&col->lengths, self->capacity);
+		vec_construct_(&col->values, char);
+		vec_construct_(&col->status, unsigned char);
+		col->type = CSV_TEXT;
+	}
+}
+
+void csv_batch_set_type(struct csv_batch* self, unsigned col, enum csv_type type)
+{
+	if (col >= self->columns) {
+		_batch_add_columns(self, col + 1);
+	}
+
+	struct csv_batch_column* column = vec_at(&self->_in->columns, col);
+	column->type = type;
+	vec_destroy(&column->values);
+	vec_clear(&column->status);
+
+	switch (type) {
+	case CSV_INT64:
+		vec_construct_(&column->values, int64_t);
+		break;
+	case CSV_DOUBLE:
+		vec_construct_(&column->values, double);
+		break;
+	case CSV_BOOL:
+		vec_construct_(&column->values, bool);
+		break;
+	default:
+		vec_construct_(&column->values, char);
+		_batch_publish(self);
+		return;
+	}
+
+	vec_resize_and_zero(&column->values, self->capacity);
+	vec_resize_and_zero(&column->status, self->capacity);
+	_batch_publish(self);
+}
+
+void _batch_convert(struct csv_batch_column* col, unsigned row, const struct csv_field* field)
+{
+	unsigned char* status = col->status.data;
+	switch (col->type) {
+	case CSV_INT64:
+		status[row] = csv_field_int64(field, (int64_t*)col->values.data + row);
+		break;
+	case CSV_DOUBLE:
+		status[row] = csv_field_double(field, (double*)col->values.data + row);
+		break;
+	case CSV_BOOL:
+		status[row] = csv_field_bool(field, (bool*)col->values.data + row);
+		break;
+	default:
+		break;
+	}
+}
+
+void _batch_publish(struct csv_batch* self)
+{
+	vec_clear(&self->_in->offset_ptrs);
+	vec_clear(&self->_in->length_ptrs);
+	vec_clear(&self->_in->value_ptrs);
+	vec_clear(&self->_in->status_ptrs);
+
+	struct csv_batch_column* it = vec_begin(&self->_in->columns);
+	for (; it != vec_end(&self->_in->columns); ++it) {
+		vec_push_back(&self->_in->offset_ptrs, &it->offsets.data);
+		vec_push_back(&self->_in->length_ptrs, &it->lengths.data);
+
+		void* values = NULL;
+		unsigned char* status = NULL;
+		if (it->type != CSV_TEXT) {
+			values = it->values.data;
+			status = it->status.data;
+		}
+		vec_push_back(&self->_in->value_ptrs, &values);
+		vec_push_back(&self->_in->status_ptrs, &status);
+	}
+
+	self->data = self->_in->arena.data;
+	self->offsets = vec_begin(&self->_in->offset_ptrs);
+	self->lengths = vec_begin(&self->_in->length_ptrs);
+	self->values = vec_begin(&self->_in->value_ptrs);
+	self->status = vec_begin(&self->_in->status_ptrs);
+}
+
+int csv_get_batch(struct csv_reader* reader, struct csv_batch* self)
+{
+	struct csv_record* rec = self->_in->record;
+	string* arena = &self->_in->arena;
+
+	string_clear(arena);
+	self->rows = 0;
+
+	int ret = CSV_GOOD;
+	while (self->rows < self->capacity
+	       && (ret = csv_get_record(reader, rec)) == CSV_GOOD) {
+		if ((unsigned)rec->size > self->columns) {
+			_batch_add_columns(self, rec->size);
+		}
+
+		struct csv_batch_column* col = vec_begin(&self->_in->columns);
+		unsigned i = 0;
+		for (; i < self->columns; ++i, ++col) {
+			size_t* offsets = col->offsets.data;
+			unsigned* lengths = col->lengths.data;
+			offsets[self->rows] = arena->size;
+			lengths[self->rows] = 0;
+
+			static const struct csv_field missing = {"", 0};
+			const struct csv_field* field = &missing;
+			if (i < (unsigned)rec->size) {
+				field = &rec->fields[i];
+			}
+			if (col->type != CSV_TEXT) {
+				_batch_convert(col, self->rows, field);
+			}
+			if (field->len) {
+				lengths[self->rows] = field->len;
+				vec_append(arena, field->data, field->len);
+			}
+		}
+		++self->rows;
+	}
+
+	_batch_publish(self);
+
+	if (ret == CSV_RESET || ret == CSV_FAIL) {
+		self->rows = 0;
+		return ret;
+	}
+
+	if (self->rows == 0) {
+		return EOF;
+	}
+
+	return self->rows;
+}
@@ -0,0 +1,387 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "compress.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "csverror.h"
+#include "internal.h"
+#include "util/util.h"
+
+/* Workers used unless the writer was given a thread count */
+#define COMPRESS_WORKERS 4
+
+/* Fixed header, XLEN and the size subfield */
+#define GZIP_HEADER_SIZE 20
+
+/* CRC-32 and size of the input after the deflate data */
+#define GZIP_TRAILER_SIZE 8
+
+/* One block on its way through a worker */
+struct job {
+	char* in;
+	size_t in_len;
+	char* out;
+	size_t out_size; /* allocated */
+	size_t out_len;
+	int error; /* errno if the block could not be compressed */
+	_Bool done;
+};
+
+struct csv_compress {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t* workers;
+	struct job* jobs; /* ring of job_count, indexed by sequence */
+	char* block;      /* input the writer is filling */
+	size_t block_len;
+	size_t submitted; /* jobs handed to the workers */
+	size_t taken;     /* jobs a worker has started on */
+	size_t written;   /* jobs written to the file */
+	unsigned worker_count;
+	unsigned job_count;
+	enum csv_compression type;
+	int level;
+	int fd;
+	int error; /* errno of the first failure */
+	_Bool shutdown;
+};
+
+/* Make room for `size' bytes of output */
+void _job_reserve(struct job*, size_t size);
+
+/**
+ * Compress a job into a complete gzip member or zstd frame.
+ * Returns 0 or an errno.
+ */
+int _compress_gzip(const struct csv_compress*, struct job*);
+int _compress_zstd(const struct csv_compress*, struct job*);
+
+/**
+ * Wait for the oldest job that is not written
+ * yet and write it. Returns -1 with errno set if
+ * the job or the write failed.
+ */
+int _compress_retire(struct csv_compress*);
+
+/**
+ * Hand the block to the workers, after writing the
+ * oldest job if every job is in use.
+ */
+int _compress_submit(struct csv_compress*);
+
+/* fopencookie(3) functions */
+ssize_t _compress_cookie_write(void* cookie, const char* buf, size_t len);
+int _compress_cookie_close(void* cookie);
+
+/* Shut the workers down, join them and free everything */
+void _compress_free(struct csv_compress*);
+
+void _job_reserve(struct job* job, size_t size)
+{
+	if (job->out_size < size) {
+		realloc_(job->out, size);
+		job->out_size = size;
+	}
+}
+
+#ifdef HAVE_ZLIB
+static void _put32(unsigned char* p, uint32_t n)
+{
+	p[0] = n;
+	p[1] = n >> 8;
+	p[2] = n >> 16;
+	p[3] = n >> 24;
+}
+
+int _compress_gzip(const struct csv_compress* self, struct job* job)
+{
+	int level = (self->level) ? self->level : Z_DEFAULT_COMPRESSION;
+	z_stream z = {0};
+	if (deflateInit2(&z, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return ENOMEM;
+	}
+
+	size_t bound = deflateBound(&z, job->in_len);
+	_job_reserve(job, GZIP_HEADER_SIZE + bound + GZIP_TRAILER_SIZE);
+	unsigned char* out = (unsigned char*)job->out;
+
+	/* FEXTRA, no name or time, Unix */
+	static const unsigned char header[] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3, 8, 0,
+	                                       CSV_GZIP_SI1, CSV_GZIP_SI2, 4, 0};
+	memcpy(out, header, sizeof(header));
+
+	z.next_in = (Bytef*)job->in;
+	z.avail_in = job->in_len;
+	z.next_out = out + GZIP_HEADER_SIZE;
+	z.avail_out = bound;
+	int ret = deflate(&z, Z_FINISH);
+	size_t len = GZIP_HEADER_SIZE + z.total_out;
+	deflateEnd(&z);
+	if (ret != Z_STREAM_END) {
+		return EIO;
+	}
+
+	_put32(out + len, crc32(0, (Bytef*)job->in, job->in_len));
+	_put32(out + len + 4, job->in_len);
+	len += GZIP_TRAILER_SIZE;
+	_put32(out + GZIP_HEADER_SIZE - 4, len);
+	job->out_len = len;
+	return 0;
+}
+#else
+int _compress_gzip(const struct csv_compress* self, struct job* job)
+{
+	(void)self;
+	(void)job;
+	return ENOTSUP;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+int _compress_zstd(const struct csv_compress* self, struct job* job)
+{
+	size_t bound = ZSTD_compressBound(job->in_len);
+	_job_reserve(job, bound);
+	size_t len = ZSTD_compress(job->out, bound, job->in, job->in_len, self->level);
+	if (ZSTD_isError(len)) {
+		return EIO;
+	}
+	job->out_len = len;
+	return 0;
+}
+#else
+int _compress_zstd(const struct csv_compress* self, struct job* job)
+{
+	(void)self;
+	(void)job;
+	return ENOTSUP;
+}
+#endif
+
+static void* _compress_main(void* arg)
+{
+	struct csv_compress* self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		while (!self->shutdown && self->taken == self->submitted) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if (self->taken == self->submitted) {
+			break;
+		}
+		struct job* job = &self->jobs[self->taken++ % self->job_count];
+		pthread_mutex_unlock(&self->lock);
+
+		job->error = (self->type == CSV_COMPRESS_GZIP) ? _compress_gzip(self, job)
+		                                               : _compress_zstd(self, job);
+
+		pthread_mutex_lock(&self->lock);
+		job->done = true;
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+int _compress_retire(struct csv_compress* self)
+{
+	struct job* job = &self->jobs[self->written % self->job_count];
+
+	pthread_mutex_lock(&self->lock);
+	while (!job->done) {
+		pthread_cond_wait(&self->cond, &self->lock);
+	}
+	pthread_mutex_unlock(&self->lock);
+	++self->written;
+
+	if (job->error) {
+		errno = job->error;
+		return -1;
+	}
+	return write_all(self->fd, job->out, job->out_len);
+}
+
+int _compress_submit(struct csv_compress* self)
+{
+	if (self->submitted - self->written == self->job_count
+	    && _compress_retire(self) == -1) {
+		return -1;
+	}
+
+	/* Trade the block for the job's old input */
+	struct job* job = &self->jobs[self->submitted % self->job_count];
+	char* in = job->in;
+	job->in = self->block;
+	job->in_len = self->block_len;
+	job->done = false;
+	self->block = in;
+	self->block_len = 0;
+
+	pthread_mutex_lock(&self->lock);
+	++self->submitted;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	return 0;
+}
+
+ssize_t _compress_cookie_write(void* cookie, const char* buf, size_t len)
+{
+	struct csv_compress* self = cookie;
+	if (self->error) {
+		errno = self->error;
+		return -1;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		if (self->block == NULL) {
+			self->block = malloc_(CSV_COMPRESS_BLOCK);
+		}
+		size_t n = CSV_COMPRESS_BLOCK - self->block_len;
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(self->block + self->block_len, buf + done, n);
+		self->block_len += n;
+		done += n;
+
+		if (self->block_len == CSV_COMPRESS_BLOCK && _compress_submit(self) == -1) {
+			self->error = errno;
+			return -1;
+		}
+	}
+	return len;
+}
+
+int _compress_cookie_close(void* cookie)
+{
+	struct csv_compress* self = cookie;
+
+	/* An empty file is still one empty member or frame */
+	if (!self->error && (self->block_len > 0 || self->submitted == 0)
+	    && _compress_submit(self) == -1) {
+		self->error = errno;
+	}
+	while (self->written < self->submitted) {
+		if (_compress_retire(self) == -1 && !self->error) {
+			self->error = errno;
+		}
+	}
+	if (close(self->fd) == -1 && !self->error) {
+		self->error = errno;
+	}
+
+	int error = self->error;
+	_compress_free(self);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void _compress_free(struct csv_compress* self)
+{
+	pthread_mutex_lock(&self->lock);
+	self->shutdown = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	unsigned i = 0;
+	for (; i < self->worker_count; ++i) {
+		pthread_join(self->workers[i], NULL);
+	}
+	for (i = 0; i < self->job_count; ++i) {
+		free_if_exists_(self->jobs[i].in);
+		free_if_exists_(self->jobs[i].out);
+	}
+	free_if_exists_(self->block);
+	free_(self->jobs);
+	free_(self->workers);
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free_(self);
+}
+
+_Bool csv_compress_supported(enum csv_compression type)
+{
+	switch (type) {
+	case CSV_COMPRESS_NONE:
+		return true;
+#ifdef HAVE_ZLIB
+	case CSV_COMPRESS_GZIP:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case CSV_COMPRESS_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+int csv_compress_open(struct csv_writer* writer, int fd)
+{
+	struct csv_compress* self = malloc_(sizeof(*self));
+	*self = (struct csv_compress) {
+	        .type = writer->_in->compression,
+	        .level = writer->_in->level,
+	        .fd = fd,
+	};
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > COMPRESS_WORKERS) {
+		cpus = COMPRESS_WORKERS;
+	}
+	unsigned workers = (writer->_in->threads) ? writer->_in->threads : cpus;
+	if (workers == 0) {
+		workers = 1;
+	}
+
+	/* Enough jobs that every worker has one while
+	 * the writer fills or writes out the others
+	 */
+	self->job_count = 2 * workers;
+	self->jobs = malloc_(self->job_count * sizeof(*self->jobs));
+	memset(self->jobs, 0, self->job_count * sizeof(*self->jobs));
+	self->workers = malloc_(workers * sizeof(*self->workers));
+	for (; self->worker_count < workers; ++self->worker_count) {
+		if (pthread_create(&self->workers[self->worker_count],
+		                   NULL,
+		                   _compress_main,
+		                   self)) {
+			break;
+		}
+	}
+
+	cookie_io_functions_t io = {
+	        .write = _compress_cookie_write,
+	        .close = _compress_cookie_close,
+	};
+	FILE* file = (self->worker_count) ? fopencookie(self, "w", io) : NULL;
+	if (file == NULL) {
+		_compress_free(self);
+	}
+	csvfail_if_(file == NULL, "compress");
+
+	writer->_in->file = file;
+	return CSV_GOOD;
+}
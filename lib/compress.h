@@ -0,0 +1,30 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "csv.h"
+
+/* Output written as one gzip member or zstd frame */
+#define CSV_COMPRESS_BLOCK (1 << 20)
+
+/* gzip extra subfield holding the total size of a member,
+ * like BSIZE of BGZF but 32 bit, so that a reader can hand
+ * the members of the file to several workers.
+ */
+#define CSV_GZIP_SI1 'C'
+#define CSV_GZIP_SI2 'S'
+
+struct csv_compress;
+
+/* Whether this build can write the format */
+_Bool csv_compress_supported(enum csv_compression);
+
+/**
+ * Point the writer's file at a stream that compresses into
+ * `fd' with the writer's compression. Blocks are compressed
+ * as independent members or frames by worker threads and
+ * written in order. Closing the stream finishes the last
+ * block, joins the workers and closes `fd'.
+ */
+int csv_compress_open(struct csv_writer*, int fd);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,286 @@
+#include "csv.h"
+#include "util/util.h"
+
+#include <stdint.h>
+#include <strings.h>
+
+/* Longest field converted on the stack when strtod is needed */
+#define CONVERT_STACK_SIZE 64
+
+/* The most decimal digits that always fit in a uint64_t */
+#define CONVERT_MAX_DIGITS 19
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CONVERT_SWAR
+#endif
+
+/**
+ * Read a run of digits into `value'. Eight are checked and
+ * combined at a time as a single 64 bit word where the byte
+ * order allows it. At most CONVERT_MAX_DIGITS digits may be
+ * read unless `value' is NULL.
+ *
+ * Returns the number of digits read.
+ */
+unsigned _convert_digits(const char* s, unsigned len, uint64_t* value);
+
+/**
+ * Clinger's fast path: a decimal with no more than 19
+ * significant digits and a small exponent is exact with a
+ * single multiplication or division of doubles. Anything
+ * else is left to _convert_strtod.
+ */
+int _convert_fast_double(const char* s, unsigned len, double* value);
+
+/**
+ * strtod on a NUL-terminated copy of the field
+ */
+enum csv_conv _convert_strtod(const char* s, unsigned len, double* value);
+
+static const double _pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#ifdef CONVERT_SWAR
+/* All eight bytes are '0' through '9' */
+static int _swar_is_digits8(uint64_t v)
+{
+	return (((v & 0xF0F0F0F0F0F0F0F0)
+	         | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+	        == 0x3333333333333333);
+}
+
+/* Value of eight digits, the first in the lowest byte */
+static uint32_t _swar_parse8(uint64_t v)
+{
+	const uint64_t mask = 0x000000FF000000FF;
+	const uint64_t mul1 = 100 + (1000000ULL << 32);
+	const uint64_t mul2 = 1 + (10000ULL << 32);
+	v -= 0x3030303030303030;
+	v = (v * 10) + (v >> 8);
+	v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+	return (uint32_t)v;
+}
+#endif
+
+unsigned _convert_digits(const char* s, unsigned len, uint64_t* value)
+{
+	uint64_t n = (value) ? *value : 0;
+	unsigned i = 0;
+#ifdef CONVERT_SWAR
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v = 0;
+		memcpy(&v, &s[i], 8);
+		if (!_swar_is_digits8(v)) {
+			break;
+		}
+		if (value) {
+			n = n * 100000000 + _swar_parse8(v);
+		}
+	}
+#endif
+	for (; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+		n = n * 10 + (s[i] - '0');
+	}
+	if (value) {
+		*value = n;
+	}
+	return i;
+}
+
+enum csv_conv csv_field_int64(const struct csv_field* field, int64_t* value)
+{
+	const char* s = field->data;
+	unsigned len = field->len;
+	*value = 0;
+	if (len == 0) {
+		return CSV_CONV_EMPTY;
+	}
+
+	_Bool negative = (s[0] == '-');
+	unsigned i = (s[0] == '-' || s[0] == '+');
+	if (i == len) {
+		return CSV_CONV_INVALID;
+	}
+
+	/* Leading zeros do not count toward the limit */
+	while (i + 1 < len && s[i] == '0') {
+		++i;
+	}
+
+	if (len - i > CONVERT_MAX_DIGITS) {
+		if (i + _convert_digits(&s[i], len - i, NULL) != len) {
+			return CSV_CONV_INVALID;
+		}
+		*value = (negative) ? INT64_MIN : INT64_MAX;
+		return CSV_CONV_RANGE;
+	}
+
+	uint64_t n = 0;
+	if (i + _convert_digits(&s[i], len - i, &n) != len) {
+		return CSV_CONV_INVALID;
+	}
+
+	if (negative) {
+		if (n > (uint64_t)INT64_MAX + 1) {
+			*value = INT64_MIN;
+			return CSV_CONV_RANGE;
+		}
+		*value = (int64_t)(0 - n);
+	} else {
+		if (n > (uint64_t)INT64_MAX) {
+			*value = INT64_MAX;
+			return CSV_CONV_RANGE;
+		}
+		*value = (int64_t)n;
+	}
+
+	return CSV_CONV_GOOD;
+}
+
+int _convert_fast_double(const char* s, unsigned len, double* value)
+{
+	_Bool negative = (s[0] == '-');
+	unsigned i = (s[0] == '-' || s[0] == '+');
+
+	/* Leading zeros are not significant */
+	unsigned start = i;
+	while (i < len && s[i] == '0') {
+		++i;
+	}
+
+	uint64_t mantissa = 0;
+	unsigned int_digits = _convert_digits(&s[i], len - i, NULL);
+	if (int_digits > CONVERT_MAX_DIGITS) {
+		return CSV_FAIL;
+	}
+	_convert_digits(&s[i], int_digits, &mantissa);
+	unsigned digits = int_digits;
+	i += int_digits;
+
+	int exponent = 0;
+	_Bool any = (i > start);
+	if (i < len && s[i] == '.') {
+		++i;
+		unsigned frac = _convert_digits(&s[i], len - i, NULL);
+		any = any || frac;
+		if (digits == 0) {
+			/* 0.000123: the zeros only move the point */
+			unsigned zeros = 0;
+			while (zeros < frac && s[i + zeros] == '0') {
+				++zeros;
+			}
+			exponent -= zeros;
+			i += zeros;
+			frac -= zeros;
+		}
+		if (digits + frac > CONVERT_MAX_DIGITS) {
+			return CSV_FAIL;
+		}
+		_convert_digits(&s[i], frac, &mantissa);
+		digits += frac;
+		exponent -= frac;
+		i += frac;
+	}
+	if (!any) {
+		return CSV_FAIL;
+	}
+
+	if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+		++i;
+		_Bool negative_exp = (i < len && s[i] == '-');
+		i += (i < len && (s[i] == '-' || s[i] == '+'));
+		unsigned exp_digits = _convert_digits(&s[i], len - i, NULL);
+		if (exp_digits == 0 || exp_digits > 4) {
+			return CSV_FAIL;
+		}
+		uint64_t e = 0;
+		_convert_digits(&s[i], exp_digits, &e);
+		exponent += (negative_exp) ? -(int)e : (int)e;
+		i += exp_digits;
+	}
+	if (i != len) {
+		return CSV_FAIL;
+	}
+
+	double d = 0;
+	if (mantissa != 0) {
+		if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) {
+			return CSV_FAIL;
+		}
+		d = (double)mantissa;
+		d = (exponent < 0) ? d / _pow10[-exponent] : d * _pow10[exponent];
+	}
+	*value = (negative) ? -d : d;
+
+	return CSV_GOOD;
+}
+
+enum csv_conv _convert_strtod(const char* s, unsigned len, double* value)
+{
+	char stack_buf[CONVERT_STACK_SIZE];
+	char* buf = stack_buf;
+	if (len >= CONVERT_STACK_SIZE) {
+		buf = malloc_(len + 1);
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	char* end = NULL;
+	int saved_errno = errno;
+	errno = 0;
+	*value = strtod(buf, &end);
+
+	enum csv_conv ret = CSV_CONV_GOOD;
+	if (end != buf + len || isspace((unsigned char)buf[0])) {
+		*value = 0;
+		ret = CSV_CONV_INVALID;
+	} else if (errno == ERANGE) {
+		ret = CSV_CONV_RANGE;
+	}
+	errno = saved_errno;
+
+	if (buf != stack_buf) {
+		free_(buf);
+	}
+	return ret;
+}
+
+enum csv_conv csv_field_double(const struct csv_field* field, double* value)
+{
+	*value = 0;
+	if (field->len == 0) {
+		return CSV_CONV_EMPTY;
+	}
+	if (_convert_fast_double(field->data, field->len, value) == CSV_GOOD) {
+		return CSV_CONV_GOOD;
+	}
+	return _convert_strtod(field->data, field->len, value);
+}
+
+enum csv_conv csv_field_bool(const struct csv_field* field, bool* value)
+{
+	static const char* const truths[] = {"true", "t", "yes", "y", "1"};
+	static const char* const lies[] = {"false", "f", "no", "n", "0"};
+
+	*value = false;
+	if (field->len == 0) {
+		return CSV_CONV_EMPTY;
+	}
+
+	unsigned i = 0;
+	for (; i < sizeof(truths) / sizeof(truths[0]); ++i) {
+		if (field->len == strlen(truths[i])
+		    && !strncasecmp(field->data, truths[i], field->len)) {
+			*value = true;
+			return CSV_CONV_GOOD;
+		}
+		if (field->len == strlen(lies[i])
+		    && !strncasecmp(field->data, lies[i], field->len)) {
+			return CSV_CONV_GOOD;
+		}
+	}
+
+	return CSV_CONV_INVALID;
+}
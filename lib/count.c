@@ -0,0 +1,350 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <unistd.h>
+#include "csv.h"
+#include "csverror.h"
+#include "internal.h"
+#include "parallel.h"
+#include "simd.h"
+#include "util/stringy.h"
+#include "util/util.h"
+
+/* pread size when counting a file that is not mmapped */
+#define COUNT_BLOCK_SIZE (1 << 20)
+
+struct count_chunk {
+	const char* data;
+	size_t len;
+	uint64_t quotes;
+	struct simd_scan scan;
+	unsigned max_breaks;
+	char delim;
+	_Bool use_quotes;
+	pthread_t thread;
+};
+
+/**
+ * Whether the reader's settings allow counting without
+ * parsing. Weak quoting and multi-byte delimiters are
+ * left to the parsers.
+ */
+_Bool _count_can_scan(struct csv_reader*);
+
+/**
+ * Count by parsing every record. This is what the scans
+ * fall back to when they bail.
+ */
+int _count_parsed(struct csv_reader*, size_t* count);
+
+/**
+ * Scan the mmapped file from the current offset, with
+ * one chunk per worker thread.
+ */
+int _count_mmap(struct csv_reader*, size_t* count);
+
+/**
+ * Scan an open regular file from the current offset
+ * in COUNT_BLOCK_SIZE pieces.
+ */
+int _count_file(struct csv_reader*, size_t* count);
+
+/**
+ * Turn line endings into records. `end' points past the
+ * last scanned byte and `len' is how many were scanned.
+ * Apply the rules of sgetline (`cr_breaks') or of
+ * sgetline_mmap for the last line: it is a record if it
+ * is not terminated, and a blank line at the end of the
+ * file is not.
+ */
+size_t _count_last_line(const struct simd_scan*,
+                        const char* end,
+                        size_t len,
+                        _Bool cr_breaks);
+
+_Bool _count_can_scan(struct csv_reader* self)
+{
+	if (self->quotes == QUOTE_WEAK || self->_in->delim.size != 1) {
+		return false;
+	}
+	return (string_c_str(&self->_in->delim)[0] != '"');
+}
+
+int _count_parsed(struct csv_reader* self, size_t* count)
+{
+	struct csv_record* rec = csv_record_new();
+	int ret = 0;
+	*count = 0;
+	for (;;) {
+		ret = csv_get_record(self, rec);
+		if (ret == CSV_GOOD) {
+			++*count;
+			continue;
+		}
+
+		/* Failsafe mode started the file over */
+		if (ret == CSV_RESET) {
+			*count = 0;
+			continue;
+		}
+
+		break;
+	}
+	csv_record_free(rec);
+
+	return (ret == CSV_FAIL) ? CSV_FAIL : CSV_GOOD;
+}
+
+size_t _count_last_line(const struct simd_scan* scan,
+                        const char* end,
+                        size_t len,
+                        _Bool cr_breaks)
+{
+	size_t records = scan->records;
+	if (len == 0) {
+		return records;
+	}
+
+	char last = end[-1];
+	if (last != '\n' && (!cr_breaks || last != '\r')) {
+		return records + 1;
+	}
+
+	size_t term = 1;
+	if (cr_breaks && last == '\n' && len > 1 && end[-2] == '\r') {
+		term = 2;
+	}
+
+	_Bool blank = (len == term);
+	if (!blank) {
+		char before = end[-1 - term];
+		blank = (before == '\n' || (cr_breaks && before == '\r'));
+	}
+
+	return records - blank;
+}
+
+static void* _count_quotes_main(void* arg)
+{
+	struct count_chunk* c = arg;
+	c->quotes = simd_count_quotes(c->data, c->len);
+	return NULL;
+}
+
+static void* _count_scan_main(void* arg)
+{
+	struct count_chunk* c = arg;
+	simd_scan_records(c->data,
+	                  c->len,
+	                  c->delim,
+	                  c->use_quotes,
+	                  false,
+	                  c->max_breaks,
+	                  &c->scan);
+	return NULL;
+}
+
+/* Run `fn' on every chunk, the first on this thread */
+static void _count_run(struct count_chunk* chunks, unsigned n, void* (*fn)(void*))
+{
+	unsigned i = 1;
+	for (; i < n; ++i) {
+		if (pthread_create(&chunks[i].thread, NULL, fn, &chunks[i])) {
+			chunks[i].thread = pthread_self();
+		}
+	}
+	fn(&chunks[0]);
+	for (i = 1; i < n; ++i) {
+		if (pthread_equal(chunks[i].thread, pthread_self())) {
+			fn(&chunks[i]);
+		} else {
+			pthread_join(chunks[i].thread, NULL);
+		}
+	}
+}
+
+int _count_mmap(struct csv_reader* self, size_t* count)
+{
+	const char* mmap = self->_in->mmap_ptr;
+	size_t size = self->_in->file_size;
+	size_t begin = self->_in->offset;
+
+	/* sgetline_mmap steps over the line ending
+	 * that the offset is left on.
+	 */
+	if (begin < size && mmap[begin] == '\r') {
+		begin += 2;
+	} else if (begin < size && mmap[begin] == '\n') {
+		begin += 1;
+	}
+	if (begin >= size) {
+		return csv_reader_seek(self, size);
+	}
+
+	if (string_empty(&self->_in->delim)) {
+		const char* eol = memchr(&mmap[begin], '\n', size - begin);
+		size_t len = (eol) ? (size_t)(eol - &mmap[begin]) : size - begin;
+		csv_determine_delimiter(self, &mmap[begin], len);
+	}
+	if (!_count_can_scan(self)) {
+		return _count_parsed(self, count);
+	}
+
+	size_t remaining = size - begin;
+	unsigned n = self->_in->threads;
+	if (n == 0 || remaining / n < CSV_CHUNK_SIZE_MIN) {
+		n = 1;
+	}
+
+	struct count_chunk* chunks = malloc_(n * sizeof(*chunks));
+	size_t chunk_size = remaining / n;
+	unsigned i = 0;
+	for (; i < n; ++i) {
+		chunks[i] = (struct count_chunk) {
+		        .data = &mmap[begin + i * chunk_size],
+		        .len = (i + 1 == n) ? remaining - i * chunk_size : chunk_size,
+		        .max_breaks = self->_in->max_newlines,
+		        .delim = string_c_str(&self->_in->delim)[0],
+		        .use_quotes = (self->quotes != QUOTE_NONE),
+		};
+	}
+
+	/* Whether a chunk begins inside of quotes follows from
+	 * the number of quotes before it. A quote that does not
+	 * toggle makes some scan bail, so the guess is not used.
+	 */
+	if (n > 1 && chunks[0].use_quotes) {
+		_count_run(chunks, n, _count_quotes_main);
+	}
+
+	uint64_t quotes = 0;
+	for (i = 0; i < n; ++i) {
+		struct simd_scan* scan = &chunks[i].scan;
+		scan->inside = (quotes & 1);
+		if (i == 0) {
+			scan->field_start = true;
+		} else if (!scan->inside) {
+			char prev = chunks[i].data[-1];
+			scan->field_start = (prev == chunks[i].delim || prev == '\n');
+		}
+		scan->quoted_field = scan->inside;
+		quotes += chunks[i].quotes;
+	}
+
+	_count_run(chunks, n, _count_scan_main);
+
+	/* Carry the state of the current field across chunks */
+	struct simd_scan total = chunks[0].scan;
+	for (i = 1; i < n && !total.bail; ++i) {
+		const struct simd_scan* scan = &chunks[i].scan;
+		total.bail = (scan->bail || (scan->head_reopen && !total.quoted_field)
+		              || total.field_breaks + scan->head_breaks
+		                         > self->_in->max_newlines);
+		total.records += scan->records;
+		total.breaks += scan->breaks;
+		total.field_breaks += scan->head_breaks;
+		if (scan->field_known) {
+			total.quoted_field = scan->quoted_field;
+			total.field_breaks = scan->field_breaks;
+		}
+		total.inside = scan->inside;
+	}
+	free_(chunks);
+
+	/* Ends in a quoted field. Let the parser complain. */
+	if (total.bail || total.inside) {
+		return _count_parsed(self, count);
+	}
+
+	*count = _count_last_line(&total, &mmap[size], remaining, false);
+	self->_in->rows += *count;
+	self->_in->embedded_breaks += total.breaks;
+
+	return csv_reader_seek(self, size);
+}
+
+int _count_file(struct csv_reader* self, size_t* count)
+{
+	size_t begin = blockbuf_offset(&self->_in->block);
+	size_t offset = begin;
+	char* buf = malloc_(COUNT_BLOCK_SIZE);
+	char tail[3] = "";
+	size_t tail_len = 0;
+
+	struct simd_scan scan = {.field_start = true};
+	int ret = CSV_GOOD;
+	for (;;) {
+		ssize_t n = pread(self->_in->fd, buf, COUNT_BLOCK_SIZE, offset);
+		if (n <= 0) {
+			ret = (n == -1) ? CSV_FAIL : CSV_GOOD;
+			break;
+		}
+
+		if (string_empty(&self->_in->delim)) {
+			size_t len = 0;
+			while (len < (size_t)n && buf[len] != '\n' && buf[len] != '\r') {
+				++len;
+			}
+			csv_determine_delimiter(self, buf, len);
+		}
+		if (!_count_can_scan(self)) {
+			scan.bail = true;
+			break;
+		}
+
+		simd_scan_records(buf,
+		                  n,
+		                  string_c_str(&self->_in->delim)[0],
+		                  self->quotes != QUOTE_NONE,
+		                  true,
+		                  self->_in->max_newlines,
+		                  &scan);
+		if (scan.bail) {
+			break;
+		}
+
+		/* Last bytes for _count_last_line */
+		size_t keep = (n < 3) ? n : 3;
+		if (tail_len + keep > 3) {
+			size_t drop = tail_len + keep - 3;
+			memmove(tail, tail + drop, tail_len - drop);
+			tail_len -= drop;
+		}
+		memcpy(tail + tail_len, buf + n - keep, keep);
+		tail_len += keep;
+		offset += n;
+	}
+	free_(buf);
+	csvfail_if_(ret == CSV_FAIL, "pread");
+
+	if (scan.bail || scan.inside) {
+		return _count_parsed(self, count);
+	}
+
+	*count = _count_last_line(&scan, tail + tail_len, offset - begin, true);
+	self->_in->rows += *count;
+	self->_in->embedded_breaks += scan.breaks;
+
+	if (offset > self->_in->file_size) {
+		self->_in->file_size = offset;
+	}
+	return csv_reader_seek(self, offset);
+}
+
+int csv_count_records(struct csv_reader* self, size_t* count)
+{
+	*count = 0;
+	if (self->_in->is_mmap) {
+		/* The offset is kept at the last record handed out */
+		csv_parallel_stop(self);
+		return _count_mmap(self, count);
+	}
+
+	if (self->_in->file == NULL || self->_in->file == stdin
+	    || self->_in->block.fd == -1 || self->_in->decompress) {
+		return _count_parsed(self, count);
+	}
+	return _count_file(self, count);
+}
@@ -35,11 +35,12 @@ struct csv_record* csv_record_construct(struct csv_record* self)
 
 	self->_in = malloc_(sizeof(*self->_in));
 	*self->_in = (struct csv_record_internal) {
-	        .field_data = new_t_(vec, string),
 	        ._fields = new_t_(vec, struct csv_field),
 	        .rec_alloc = 0,
 	        .field_alloc = 0,
 	};
+	string_construct(&self->_in->arena);
+	vec_construct_(&self->_in->owned, struct csv_owned_field);
 
 	return self;
 }
@@ -53,11 +54,8 @@ void csv_record_free(struct csv_record* self)
 void csv_record_destroy(struct csv_record* self)
 {
 	delete_(vec, self->_in->_fields);
-	string* it = vec_begin(self->_in->field_data);
-	for (; it != vec_end(self->_in->field_data); ++it) {
-		string_destroy(it);
-	}
-	delete_(vec, self->_in->field_data);
+	string_destroy(&self->_in->arena);
+	vec_destroy(&self->_in->owned);
 	if (self->_in->rec_alloc > 0) {
 		free_(self->rec);
 	}
@@ -66,45 +64,101 @@ void csv_record_destroy(struct csv_record* self)
 
 struct csv_field* csv_record_release_data(struct csv_record* self)
 {
+	/* Fields share the arena and the record. Give
+	 * each one its own copy to be freed on its own.
+	 */
+	struct csv_field* fields = self->fields;
+	int i = 0;
+	for (; i < self->size; ++i) {
+		char* data = malloc_(fields[i].len + 1);
+		memcpy(data, fields[i].data, fields[i].len);
+		data[fields[i].len] = '\0';
+		fields[i].data = data;
+	}
+
 	free_(self->_in->_fields);
-	delete_(vec, self->_in->field_data);
+	string_destroy(&self->_in->arena);
+	vec_destroy(&self->_in->owned);
+	if (self->_in->rec_alloc > 0) {
+		free_(self->rec);
+	}
 	free_(self->_in);
 	free_(self);
 
-	return self->fields;
+	return fields;
 }
 
 struct csv_record* csv_record_clone(const struct csv_record* src)
 {
-	struct csv_record* dest = NULL;
-	dest = malloc_(sizeof(*dest));
-
-	*dest = (struct csv_record) {
-	        ._in = NULL,
-	        .fields = NULL,
-	        .rec = src->rec,
-	        .reclen = src->reclen,
-	        .size = src->size,
-	};
-
-	dest->_in = malloc_(sizeof(*dest->_in));
-	*dest->_in = (struct csv_record_internal) {
-	        .field_data = new_t_(vec, string),
-	        ._fields = new_t_(vec, struct csv_field),
-	        .rec_alloc = 0,
-	        .field_alloc = src->size,
-	};
+	struct csv_record* dest = csv_record_new();
+
+	/* Nothing may point back into `src'. Its record,
+	 * its arena and the mmap can all be reused.
+	 */
+	if (src->rec) {
+		dest->rec = malloc_(src->reclen + 1);
+		memcpy(dest->rec, src->rec, src->reclen);
+		dest->rec[src->reclen] = '\0';
+		dest->reclen = src->reclen;
+		dest->_in->rec_alloc = src->reclen + 1;
+	}
 
-	vec_resize(dest->_in->_fields, src->size);
+	size_t total = 0;
 	int i = 0;
 	for (; i < src->size; ++i) {
-		string* s_src = vec_at(src->_in->field_data, i);
-		string* s_dest = vec_at(dest->_in->field_data, i);
-		string_construct_from_string(s_dest, s_src);
+		total += src->fields[i].len;
 	}
 
-	vec_extend(dest->_in->_fields, src->_in->_fields);
-	dest->fields = vec_begin(dest->_in->_fields);
+	/* Reserved up front so the arena does not move */
+	string* arena = &dest->_in->arena;
+	vec_reserve(arena, total);
+	csv_record_reserve(dest, src->size);
+	for (i = 0; i < src->size; ++i) {
+		const struct csv_field* field = &src->fields[i];
+		dest->fields[i].data = (const char*)arena->data + arena->size;
+		dest->fields[i].len = field->len;
+		vec_append(arena, field->data, field->len);
+	}
+	dest->size = src->size;
 
 	return dest;
 }
+
+struct csv_frozen* csv_record_freeze(const struct csv_record* self)
+{
+	size_t bytes = sizeof(struct csv_frozen);
+	bytes += self->size * sizeof(struct csv_frozen_field);
+	int i = 0;
+	for (; i < self->size; ++i) {
+		bytes += self->fields[i].len + 1;
+	}
+	if (bytes > UINT_MAX) {
+		return NULL;
+	}
+
+	struct csv_frozen* frozen = malloc_(bytes);
+	frozen->bytes = bytes;
+	frozen->size = self->size;
+
+	struct csv_frozen_field* fields = (struct csv_frozen_field*)(frozen + 1);
+	char* data = (char*)(fields + self->size);
+	for (i = 0; i < self->size; ++i) {
+		fields[i].offset = data - (char*)frozen;
+		fields[i].len = self->fields[i].len;
+		memcpy(data, self->fields[i].data, fields[i].len);
+		data[fields[i].len] = '\0';
+		data += fields[i].len + 1;
+	}
+
+	return frozen;
+}
+
+struct csv_field csv_frozen_get(const struct csv_frozen* self, unsigned idx)
+{
+	const struct csv_frozen_field* fields = (const struct csv_frozen_field*)(self + 1);
+	struct csv_field field = {
+	        (const char*)self + fields[idx].offset,
+	        fields[idx].len,
+	};
+	return field;
+}
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include "misc.h"
 #include "csverror.h"
 #include "util.h"
@@ -8,21 +9,31 @@
 
 static node* _err_str_head = NULL;
 
+/* Readers on different threads share the queue */
+static pthread_mutex_t _err_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void err_remove(node* node)
 {
+	pthread_mutex_lock(&_err_lock);
 	node_remove(&_err_str_head, node);
+	pthread_mutex_unlock(&_err_lock);
 }
 
 node* err_push(const char* err)
 {
-	return node_enqueue(&_err_str_head, (void*)err);
+	pthread_mutex_lock(&_err_lock);
+	node* n = node_enqueue(&_err_str_head, (void*)err);
+	pthread_mutex_unlock(&_err_lock);
+	return n;
 }
 
 void err_printall()
 {
+	pthread_mutex_lock(&_err_lock);
 	while (_err_str_head) {
 		const char* data = node_dequeue(&_err_str_head);
 		fprintf(stderr, "%s\n", data);
 		free_(data);
 	}
+	pthread_mutex_unlock(&_err_lock);
 }
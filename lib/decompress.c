@@ -0,0 +1,603 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "decompress.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "csverror.h"
+#include "internal.h"
+#include "util/util.h"
+#include "util/vec.h"
+
+/* Pieces of output one unit may have waiting for the reader */
+#define DECOMPRESS_QUEUE 4
+
+/* Workers used unless the reader was given a thread count */
+#define DECOMPRESS_WORKERS 4
+
+/* Most input given to zlib at once. Its counts are 32 bit. */
+#define DECOMPRESS_MAX_INPUT (1 << 30)
+
+/* Members or frames decompressed in order by one worker */
+struct unit {
+	size_t begin;
+	size_t end;
+};
+
+/* Output of the unit a worker is on, in order */
+struct slot {
+	char* pieces[DECOMPRESS_QUEUE];
+	size_t lens[DECOMPRESS_QUEUE];
+	size_t unit;       /* SIZE_MAX while no unit is assigned */
+	const char* error; /* why the unit could not be finished */
+	unsigned head;     /* next piece for the reader */
+	unsigned tail;     /* next piece for the worker */
+	_Bool done;
+};
+
+struct csv_decompress {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t* workers;
+	struct slot* slots;
+	const unsigned char* data; /* the mmapped file */
+	size_t size;
+	vec units; /* vec<struct unit> */
+	size_t next_unit; /* first unit not taken by a worker */
+	size_t read_unit; /* unit the reader is on */
+	size_t read_pos;  /* bytes of the head piece already read */
+	unsigned worker_count;
+	unsigned slot_count;
+	enum csv_compression type;
+	const char* error; /* why the last read failed */
+	_Bool shutdown;
+};
+
+/**
+ * Which compression the bytes at the beginning
+ * of a file were written with.
+ */
+enum csv_compression _decompress_detect(const unsigned char* magic, size_t len);
+
+/* _decompress_detect on a regular file */
+enum csv_compression _decompress_detect_fd(int fd);
+
+/**
+ * Split the file into units. BGZF blocks and members from
+ * csv_writer know their size and zstd frames can be measured
+ * without decompressing, so those are grouped into
+ * CSV_DECOMPRESS_UNIT pieces.
+ * Whatever follows the last such member or frame is one
+ * unit for a single worker.
+ */
+void _decompress_split(struct csv_decompress*);
+
+/**
+ * Total size of the gzip member at `p' from its BGZF or
+ * csv_writer subfield, 0 if it has neither.
+ */
+size_t _decompress_member_size(const unsigned char* p, size_t len);
+
+/**
+ * Wait for room in the slot. Returns the memory for the
+ * next piece, or NULL if the workers are shutting down.
+ */
+char* _slot_reserve(struct csv_decompress*, struct slot*);
+
+/* Hand the reader `len' bytes written to the reserved piece */
+void _slot_commit(struct csv_decompress*, struct slot*, size_t len);
+
+/**
+ * Decompress one unit into its slot. Returns NULL on
+ * success or a description of what was wrong with it.
+ */
+const char* _decompress_gzip(struct csv_decompress*, struct slot*, const struct unit*);
+const char* _decompress_zstd(struct csv_decompress*, struct slot*, const struct unit*);
+
+/* Replaces read(2) for the block reader */
+ssize_t _decompress_read(void* data, char* buf, size_t len);
+
+/* Create the workers from the first unit. */
+int _decompress_spawn(struct csv_decompress*);
+
+/* Shut the workers down and join them */
+void _decompress_join(struct csv_decompress*);
+
+static const char* _type_name[] = {"", "gzip", "zstd"};
+
+enum csv_compression _decompress_detect(const unsigned char* magic, size_t len)
+{
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		return CSV_COMPRESS_GZIP;
+	}
+	if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f
+	    && magic[3] == 0xfd) {
+		return CSV_COMPRESS_ZSTD;
+	}
+	return CSV_COMPRESS_NONE;
+}
+
+enum csv_compression _decompress_detect_fd(int fd)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		return CSV_COMPRESS_NONE;
+	}
+
+	unsigned char magic[4];
+	ssize_t n = pread(fd, magic, sizeof(magic), 0);
+	return _decompress_detect(magic, (n > 0) ? n : 0);
+}
+
+_Bool csv_decompress_detect(int fd)
+{
+	return (_decompress_detect_fd(fd) != CSV_COMPRESS_NONE);
+}
+
+size_t _decompress_member_size(const unsigned char* p, size_t len)
+{
+	/* FEXTRA must be set, and XLEN follows the fixed header */
+	if (len < 18 || _decompress_detect(p, len) != CSV_COMPRESS_GZIP || !(p[3] & 4)) {
+		return 0;
+	}
+
+	size_t xlen = p[10] | (p[11] << 8);
+	size_t i = 12;
+	while (i + 4 <= 12 + xlen && i + 4 <= len) {
+		size_t slen = p[i + 2] | (p[i + 3] << 8);
+		if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= len) {
+			return (p[i + 4] | (p[i + 5] << 8)) + 1;
+		}
+		if (p[i] == CSV_GZIP_SI1 && p[i + 1] == CSV_GZIP_SI2 && slen == 4
+		    && i + 8 <= len) {
+			return p[i + 4] | (p[i + 5] << 8) | (p[i + 6] << 16)
+			       | ((size_t)p[i + 7] << 24);
+		}
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+void _decompress_split(struct csv_decompress* self)
+{
+	size_t begin = 0;
+	size_t pos = 0;
+	while (pos < self->size) {
+		size_t n = 0;
+		if (self->type == CSV_COMPRESS_GZIP) {
+			n = _decompress_member_size(self->data + pos, self->size - pos);
+		}
+#ifdef HAVE_ZSTD
+		if (self->type == CSV_COMPRESS_ZSTD) {
+			n = ZSTD_findFrameCompressedSize(self->data + pos, self->size - pos);
+			if (ZSTD_isError(n)) {
+				n = 0;
+			}
+		}
+#endif
+		if (n == 0 || n > self->size - pos) {
+			break;
+		}
+
+		pos += n;
+		if (pos - begin >= CSV_DECOMPRESS_UNIT) {
+			struct unit u = {begin, pos};
+			vec_push_back(&self->units, &u);
+			begin = pos;
+		}
+	}
+
+	if (begin < self->size) {
+		struct unit u = {begin, self->size};
+		vec_push_back(&self->units, &u);
+	}
+}
+
+char* _slot_reserve(struct csv_decompress* self, struct slot* slot)
+{
+	pthread_mutex_lock(&self->lock);
+	while (!self->shutdown && slot->tail - slot->head == DECOMPRESS_QUEUE) {
+		pthread_cond_wait(&self->cond, &self->lock);
+	}
+	char* piece = NULL;
+	if (!self->shutdown) {
+		char** p = &slot->pieces[slot->tail % DECOMPRESS_QUEUE];
+		if (*p == NULL) {
+			*p = malloc_(CSV_DECOMPRESS_CHUNK);
+		}
+		piece = *p;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return piece;
+}
+
+void _slot_commit(struct csv_decompress* self, struct slot* slot, size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+	pthread_mutex_lock(&self->lock);
+	slot->lens[slot->tail % DECOMPRESS_QUEUE] = len;
+	++slot->tail;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+}
+
+#ifdef HAVE_ZLIB
+const char* _decompress_gzip(struct csv_decompress* self,
+                             struct slot* slot,
+                             const struct unit* unit)
+{
+	z_stream z = {0};
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		return "out of memory";
+	}
+
+	const char* error = NULL;
+	size_t pos = unit->begin; /* first byte not given to zlib */
+	char* out = NULL;
+	for (;;) {
+		if (z.avail_in == 0 && pos < unit->end) {
+			size_t n = unit->end - pos;
+			if (n > DECOMPRESS_MAX_INPUT) {
+				n = DECOMPRESS_MAX_INPUT;
+			}
+			z.next_in = (Bytef*)self->data + pos;
+			z.avail_in = n;
+			pos += n;
+		}
+		if (out == NULL) {
+			out = _slot_reserve(self, slot);
+			if (out == NULL) {
+				break;
+			}
+			z.next_out = (Bytef*)out;
+			z.avail_out = CSV_DECOMPRESS_CHUNK;
+		}
+
+		int ret = inflate(&z, Z_NO_FLUSH);
+		if (ret == Z_BUF_ERROR) {
+			error = "unexpected end of file";
+		} else if (ret != Z_OK && ret != Z_STREAM_END) {
+			error = "invalid compressed data";
+		}
+
+		/* Like gzip, ignore anything after the last member */
+		_Bool last = (error != NULL);
+		if (ret == Z_STREAM_END) {
+			size_t next = pos - z.avail_in;
+			last = (_decompress_detect(self->data + next, unit->end - next)
+			        != CSV_COMPRESS_GZIP);
+			if (!last) {
+				inflateReset(&z);
+			}
+		}
+
+		if (z.avail_out == 0 || last) {
+			_slot_commit(self, slot, CSV_DECOMPRESS_CHUNK - z.avail_out);
+			out = NULL;
+		}
+		if (last) {
+			break;
+		}
+	}
+
+	inflateEnd(&z);
+	return error;
+}
+#else
+const char* _decompress_gzip(struct csv_decompress* self,
+                             struct slot* slot,
+                             const struct unit* unit)
+{
+	(void)self;
+	(void)slot;
+	(void)unit;
+	return "not supported by this build";
+}
+#endif
+
+#ifdef HAVE_ZSTD
+const char* _decompress_zstd(struct csv_decompress* self,
+                             struct slot* slot,
+                             const struct unit* unit)
+{
+	ZSTD_DCtx* dctx = ZSTD_createDCtx();
+	if (dctx == NULL) {
+		return "out of memory";
+	}
+
+	const char* error = NULL;
+	ZSTD_inBuffer in = {self->data + unit->begin, unit->end - unit->begin, 0};
+	ZSTD_outBuffer out = {NULL, 0, 0};
+	for (;;) {
+		if (out.dst == NULL) {
+			out.dst = _slot_reserve(self, slot);
+			if (out.dst == NULL) {
+				break;
+			}
+			out.size = CSV_DECOMPRESS_CHUNK;
+			out.pos = 0;
+		}
+
+		size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			error = ZSTD_getErrorName(ret);
+		} else if (ret != 0 && in.pos == in.size && out.pos < out.size) {
+			error = "unexpected end of file";
+		}
+
+		_Bool last = (error != NULL || (ret == 0 && in.pos == in.size));
+		if (out.pos == out.size || last) {
+			_slot_commit(self, slot, out.pos);
+			out.dst = NULL;
+		}
+		if (last) {
+			break;
+		}
+	}
+
+	ZSTD_freeDCtx(dctx);
+	return error;
+}
+#else
+const char* _decompress_zstd(struct csv_decompress* self,
+                             struct slot* slot,
+                             const struct unit* unit)
+{
+	(void)self;
+	(void)slot;
+	(void)unit;
+	return "not supported by this build";
+}
+#endif
+
+static void* _decompress_main(void* arg)
+{
+	struct csv_decompress* self = arg;
+	for (;;) {
+		pthread_mutex_lock(&self->lock);
+		while (!self->shutdown && self->next_unit < self->units.size
+		       && self->next_unit >= self->read_unit + self->slot_count) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if (self->shutdown || self->next_unit == self->units.size) {
+			pthread_mutex_unlock(&self->lock);
+			break;
+		}
+
+		size_t idx = self->next_unit++;
+		struct slot* slot = &self->slots[idx % self->slot_count];
+		slot->unit = idx;
+		slot->head = 0;
+		slot->tail = 0;
+		slot->error = NULL;
+		slot->done = false;
+		pthread_mutex_unlock(&self->lock);
+
+		const struct unit* unit = vec_at(&self->units, idx);
+		const char* error = (self->type == CSV_COMPRESS_GZIP)
+		                            ? _decompress_gzip(self, slot, unit)
+		                            : _decompress_zstd(self, slot, unit);
+
+		pthread_mutex_lock(&self->lock);
+		slot->error = error;
+		slot->done = true;
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+	return NULL;
+}
+
+ssize_t _decompress_read(void* data, char* buf, size_t len)
+{
+	struct csv_decompress* self = data;
+	struct slot* slot = NULL;
+	if (self->worker_count == 0) {
+		self->error = "no worker threads";
+		errno = ECHILD;
+		return -1;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		if (self->read_unit == self->units.size) {
+			pthread_mutex_unlock(&self->lock);
+			return 0;
+		}
+		slot = &self->slots[self->read_unit % self->slot_count];
+		if (slot->unit == self->read_unit && slot->head != slot->tail) {
+			break;
+		}
+		if (slot->unit == self->read_unit && slot->done) {
+			if (slot->error) {
+				pthread_mutex_unlock(&self->lock);
+				self->error = slot->error;
+				errno = EIO;
+				return -1;
+			}
+			++self->read_unit;
+			pthread_cond_broadcast(&self->cond);
+			continue;
+		}
+		pthread_cond_wait(&self->cond, &self->lock);
+	}
+	unsigned head = slot->head % DECOMPRESS_QUEUE;
+	pthread_mutex_unlock(&self->lock);
+
+	/* The worker does not touch pieces before the tail */
+	size_t n = slot->lens[head] - self->read_pos;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, slot->pieces[head] + self->read_pos, n);
+	self->read_pos += n;
+
+	if (self->read_pos == slot->lens[head]) {
+		self->read_pos = 0;
+		pthread_mutex_lock(&self->lock);
+		++slot->head;
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+	return n;
+}
+
+int _decompress_spawn(struct csv_decompress* self)
+{
+	self->next_unit = 0;
+	self->read_unit = 0;
+	self->read_pos = 0;
+	self->shutdown = false;
+
+	unsigned i = 0;
+	for (; i < self->slot_count; ++i) {
+		self->slots[i].unit = SIZE_MAX;
+	}
+
+	for (i = 0; i < self->worker_count; ++i) {
+		if (pthread_create(&self->workers[i], NULL, _decompress_main, self)) {
+			break;
+		}
+	}
+	self->worker_count = i;
+	csvfail_if_(self->worker_count == 0, "pthread_create");
+
+	return CSV_GOOD;
+}
+
+void _decompress_join(struct csv_decompress* self)
+{
+	pthread_mutex_lock(&self->lock);
+	self->shutdown = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	unsigned i = 0;
+	for (; i < self->worker_count; ++i) {
+		pthread_join(self->workers[i], NULL);
+	}
+}
+
+int csv_decompress_start(struct csv_reader* reader)
+{
+	enum csv_compression type = _decompress_detect_fd(reader->_in->fd);
+	if (type == CSV_COMPRESS_NONE) {
+		return CSV_GOOD;
+	}
+#ifndef HAVE_ZLIB
+	csvfail_if_(type == CSV_COMPRESS_GZIP, "gzip input not supported by this build");
+#endif
+#ifndef HAVE_ZSTD
+	csvfail_if_(type == CSV_COMPRESS_ZSTD, "zstd input not supported by this build");
+#endif
+
+	struct stat sb;
+	csvfail_if_(fstat(reader->_in->fd, &sb) == -1, "fstat");
+	void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, reader->_in->fd, 0);
+	csvfail_if_(data == MAP_FAILED, "mmap");
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+	struct csv_decompress* self = malloc_(sizeof(*self));
+	*self = (struct csv_decompress) {
+	        .data = data,
+	        .size = sb.st_size,
+	        .type = type,
+	};
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	vec_construct_(&self->units, struct unit);
+	_decompress_split(self);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > DECOMPRESS_WORKERS) {
+		cpus = DECOMPRESS_WORKERS;
+	}
+	self->worker_count = (reader->_in->threads) ? reader->_in->threads : cpus;
+	if (self->worker_count > self->units.size) {
+		self->worker_count = self->units.size;
+	}
+	if (self->worker_count == 0) {
+		self->worker_count = 1;
+	}
+	self->slot_count = 2 * self->worker_count;
+	self->workers = malloc_(self->worker_count * sizeof(*self->workers));
+	self->slots = malloc_(self->slot_count * sizeof(*self->slots));
+	memset(self->slots, 0, self->slot_count * sizeof(*self->slots));
+
+	/* The size of the output is not known */
+	reader->_in->decompress = self;
+	reader->_in->file_size = 0;
+	reader->_in->block.source = _decompress_read;
+	reader->_in->block.source_data = self;
+
+	if (_decompress_spawn(self) == CSV_FAIL) {
+		csv_decompress_stop(reader);
+		return CSV_FAIL;
+	}
+	return CSV_GOOD;
+}
+
+void csv_decompress_stop(struct csv_reader* reader)
+{
+	struct csv_decompress* self = reader->_in->decompress;
+	if (self == NULL) {
+		return;
+	}
+	reader->_in->decompress = NULL;
+	reader->_in->block.source = NULL;
+	reader->_in->block.source_data = NULL;
+
+	_decompress_join(self);
+
+	unsigned i = 0;
+	for (; i < self->slot_count; ++i) {
+		unsigned j = 0;
+		for (; j < DECOMPRESS_QUEUE; ++j) {
+			free_if_exists_(self->slots[i].pieces[j]);
+		}
+	}
+	free_(self->slots);
+	free_(self->workers);
+	vec_destroy(&self->units);
+	munmap((void*)self->data, self->size);
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free_(self);
+}
+
+int csv_decompress_error(struct csv_reader* reader)
+{
+	struct csv_decompress* self = reader->_in->decompress;
+	if (self == NULL || self->error == NULL) {
+		return CSV_GOOD;
+	}
+
+	/* Bad input, so no strerror(EIO) after it */
+	char msg[256];
+	snprintf(msg, sizeof(msg), "%s: %s", _type_name[self->type], self->error);
+	self->error = NULL;
+	errno = 0;
+	csvfail_if_(true, msg);
+	return CSV_FAIL;
+}
+
+int csv_decompress_rewind(struct csv_reader* reader)
+{
+	struct csv_decompress* self = reader->_in->decompress;
+	_decompress_join(self);
+	return _decompress_spawn(self);
+}
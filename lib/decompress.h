@@ -0,0 +1,45 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include "csv.h"
+
+/* Size of each piece of output handed to the reader */
+#define CSV_DECOMPRESS_CHUNK (1 << 20)
+
+/* Compressed bytes of gzip members or zstd frames
+ * grouped into one job for a worker.
+ */
+#define CSV_DECOMPRESS_UNIT (1 << 21)
+
+struct csv_decompress;
+
+/* Whether the file at `fd' begins with gzip or zstd magic */
+_Bool csv_decompress_detect(int fd);
+
+/**
+ * If the open file begins with gzip or zstd magic, read it
+ * through worker threads that decompress it ahead of the
+ * parser. BGZF blocks and zstd frames are decompressed in
+ * parallel. Anything else is decompressed in order by one
+ * worker. The file is left alone if it is not compressed.
+ *
+ * Returns CSV_FAIL if this build cannot read the format.
+ */
+int csv_decompress_start(struct csv_reader*);
+
+/**
+ * Join the workers and unmap the compressed file.
+ * Safe to call if decompression was never started.
+ */
+void csv_decompress_stop(struct csv_reader*);
+
+/**
+ * If the last read failed because the input could not be
+ * decompressed, report why and return CSV_FAIL.
+ */
+int csv_decompress_error(struct csv_reader*);
+
+/* Start decompressing from the beginning again */
+int csv_decompress_rewind(struct csv_reader*);
+
+#endif /* DECOMPRESS_H */
@@ -22,6 +22,7 @@ extern "C" {
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
 
 enum quote_style {
 	QUOTE_NONE = 0,
@@ -30,6 +31,38 @@ enum quote_style {
 	QUOTE_ALL,
 };
 
+/* What a batch column is converted to. CSV_TEXT
+ * columns are only kept as text.
+ */
+enum csv_type {
+	CSV_TEXT = 0,
+	CSV_INT64,
+	CSV_DOUBLE,
+	CSV_BOOL,
+};
+
+/* What csv_writer compresses its output with */
+enum csv_compression {
+	CSV_COMPRESS_NONE = 0,
+	CSV_COMPRESS_GZIP,
+	CSV_COMPRESS_ZSTD,
+};
+
+/* When csv_writer_close makes a file durable */
+enum csv_sync {
+	CSV_SYNC_NONE = 0, /* left to the kernel */
+	CSV_SYNC_CLOSE,    /* before csv_writer_close returns */
+	CSV_SYNC_BATCH,    /* at csv_writer_sync */
+};
+
+/* Result of converting a single field */
+enum csv_conv {
+	CSV_CONV_GOOD = 0,
+	CSV_CONV_EMPTY,   /* no data, the value is 0 */
+	CSV_CONV_INVALID, /* not of the type, the value is 0 */
+	CSV_CONV_RANGE,   /* too large or too small for the type */
+};
+
 /**
  * CSV Structures
  */
@@ -37,6 +70,7 @@ enum quote_style {
 struct csv_record_internal;
 struct csv_read_internal;
 struct csv_write_internal;
+struct csv_batch_internal;
 
 struct csv_field {
 	const char* data;
@@ -52,6 +86,44 @@ struct csv_record {
 	int size;
 };
 
+/* A record packed by csv_record_freeze into a single
+ * allocation of `bytes' bytes: this header, then `size'
+ * struct csv_frozen_field, then the data of each field
+ * followed by a '\0'. Offsets are from the start of the
+ * allocation, so it can be moved or copied with memcpy.
+ */
+struct csv_frozen {
+	unsigned bytes;
+	unsigned size;
+};
+
+struct csv_frozen_field {
+	unsigned offset;
+	unsigned len;
+};
+
+/* Up to `capacity' records stored column by column.
+ * Field `row' of column `col' is lengths[col][row]
+ * bytes long and begins at data + offsets[col][row].
+ * Fields missing from a record have a length of 0.
+ *
+ * Columns given a type with csv_batch_set_type are also
+ * converted: values[col] is then an array of int64_t,
+ * double or bool, and status[col][row] is the enum
+ * csv_conv of each field. Both are NULL for CSV_TEXT.
+ */
+struct csv_batch {
+	struct csv_batch_internal* _in;
+	const char* data;
+	size_t* const* offsets;
+	unsigned* const* lengths;
+	void* const* values;
+	const unsigned char* const* status;
+	unsigned rows;
+	unsigned columns;
+	unsigned capacity;
+};
+
 /**
  * These structs are meant to function more like
  * classes. All the available members are used to
@@ -71,6 +143,22 @@ struct csv_writer {
 	enum quote_style quotes;
 };
 
+/* What csv_reader_sniff makes of a file. `confidence'
+ * is from 0 to 1: how many sampled lines had the same
+ * number of fields times how many quoted fields fit the
+ * quote style, lowered further for very short samples.
+ */
+struct csv_dialect {
+	enum quote_style quotes;
+	unsigned field_count;
+	double confidence;
+	char delim[2];
+	char line_ending[3];
+};
+
+/* Called by csv_feed for each complete record */
+typedef void (*csv_record_fn)(struct csv_record*, void* data);
+
 /**
  * CSV Global
  */
@@ -106,10 +194,24 @@ void csv_record_destroy(struct csv_record* self);
 struct csv_field* csv_record_release_data(struct csv_record* rec);
 
 /**
- * Clone the record and its data
+ * Clone the record and its data. The clone shares
+ * nothing with the original or the reader.
  */
 struct csv_record* csv_record_clone(const struct csv_record*);
 
+/**
+ * Pack the fields of a record into one allocation that
+ * is valid until it is passed to free(). Much smaller
+ * than a clone for keeping many records in memory.
+ * Returns NULL if it would not fit in 4 GiB.
+ */
+struct csv_frozen* csv_record_freeze(const struct csv_record*);
+
+/**
+ * Field `idx' of a frozen record. Not bounds checked.
+ */
+struct csv_field csv_frozen_get(const struct csv_frozen*, unsigned idx);
+
 /**
  * CSV Reader
  */
@@ -121,6 +223,12 @@ struct csv_record* csv_record_clone(const struct csv_record*);
 struct csv_reader* csv_reader_new();
 struct csv_reader* csv_reader_construct(struct csv_reader*);
 
+/**
+ * A new reader with the settings of another but none of
+ * its input, such as one for each of several threads.
+ */
+struct csv_reader* csv_reader_new_like(const struct csv_reader*);
+
 void csv_reader_free(struct csv_reader*);
 void csv_reader_destroy(struct csv_reader* self);
 
@@ -134,12 +242,205 @@ size_t csv_reader_get_file_size(struct csv_reader*);
 void csv_reader_set_delim(struct csv_reader*, const char*);
 void csv_reader_set_embedded_break(struct csv_reader*, const char*);
 
+/**
+ * For mmap only: parse with this many worker threads.
+ * The file is split into chunks that are parsed
+ * concurrently, and records are still returned
+ * in file order. 0 or 1 parses on the calling thread.
+ */
+void csv_reader_set_threads(struct csv_reader*, unsigned);
+
+/**
+ * For mmap only: keep about `bytes' of the file ahead of
+ * the current record resident and release the pages behind
+ * it as reading moves on, so the map takes roughly twice
+ * `bytes' of memory however large the file is. With worker
+ * threads, the chunks they are parsing stay resident too.
+ * Released pages are read back from the file if they are
+ * touched again. 0, the default, leaves paging to the kernel.
+ */
+void csv_reader_set_mmap_window(struct csv_reader*, size_t bytes);
+
+/**
+ * Only return the `n' columns listed in `idx', in that
+ * order. Columns that are not listed are skipped over
+ * without being copied or unescaped. A column the record
+ * does not have comes back empty. Pass NULL to return
+ * every column again.
+ */
+void csv_reader_set_columns(struct csv_reader*, const unsigned* idx, unsigned n);
+
+/**
+ * In failsafe mode, lower the quote style for only the
+ * record that broke it, instead of starting the file over.
+ * Records already returned stay as they are, and the next
+ * record is parsed with the original quote style again.
+ * This also works when reading stdin.
+ */
+void csv_reader_set_failsafe_incremental(struct csv_reader*, bool);
+
+/**
+ * Most line breaks a quoted field may hold before the
+ * quoting is taken to be broken, CSV_MAX_NEWLINES by
+ * default. 0 means there is no limit.
+ */
+void csv_reader_set_max_newlines(struct csv_reader*, unsigned);
+
 /**
  * Main accessing function for reading data.
  */
 int csv_get_record(struct csv_reader*, struct csv_record*);
 int csv_get_record_to(struct csv_reader*, struct csv_record*, unsigned field_limit);
 
+/**
+ * Read up to batch->capacity records into the batch,
+ * replacing whatever it held. The data stays valid
+ * until the next call with the same batch.
+ *
+ * Returns:
+ *      - the number of records read
+ *      - EOF if there were no more records
+ *      - CSV_RESET or CSV_FAIL as csv_get_record. The
+ *        batch is emptied in either case.
+ */
+int csv_get_batch(struct csv_reader*, struct csv_batch*);
+
+struct csv_batch* csv_batch_new(unsigned capacity);
+struct csv_batch* csv_batch_construct(struct csv_batch*, unsigned capacity);
+void csv_batch_free(struct csv_batch*);
+void csv_batch_destroy(struct csv_batch*);
+
+/**
+ * Convert column `col' to `type' in every following
+ * csv_get_batch. The column is added to the batch if
+ * there are not that many yet.
+ */
+void csv_batch_set_type(struct csv_batch*, unsigned col, enum csv_type type);
+
+/**
+ * Typed access to a field without copying it. The whole
+ * field must be the value: no spaces around it.
+ *
+ * int64: optional sign and decimal digits
+ * double: what strtod accepts
+ * bool: true/false, t/f, yes/no, y/n or 1/0,
+ *       in any case
+ *
+ * On CSV_CONV_RANGE, int64 is clamped to INT64_MIN or
+ * INT64_MAX and double is what strtod returns.
+ */
+enum csv_conv csv_field_int64(const struct csv_field*, int64_t*);
+enum csv_conv csv_field_double(const struct csv_field*, double*);
+enum csv_conv csv_field_bool(const struct csv_field*, bool*);
+
+/**
+ * Push parsing: instead of reading a file, hand the reader
+ * input in chunks of any size with csv_feed. Each record is
+ * passed to `fn' as soon as it is complete, and is only
+ * valid until `fn' returns. Records, including quoted
+ * fields and line endings, may be split across chunks.
+ * A chunk is read in place and may be reused once csv_feed
+ * returns. Only a record left unfinished at the end of a
+ * chunk is copied.
+ *
+ * csv_feed_end marks the end of the input and hands over
+ * the last record if it was not terminated.
+ *
+ * Returns:
+ *      - CSV_GOOD
+ *      - CSV_RESET or CSV_FAIL as csv_get_record
+ */
+void csv_reader_set_callback(struct csv_reader*, csv_record_fn fn, void* data);
+int csv_feed(struct csv_reader*, const char* buf, size_t len);
+int csv_feed_end(struct csv_reader*);
+
+/**
+ * Row index for jumping to a record by number. Building it
+ * reads the whole file once, remembering where every
+ * `stride'th record begins and how many embedded breaks
+ * came before it. The reader is then reset to the start.
+ * csv_reader_seek_row moves to the beginning of a row by
+ * seeking to the nearest mark and parsing at most `stride'
+ * records. Row 0 is the first record, header included.
+ *
+ * The index can be saved next to the file and loaded later.
+ * Loading fails if the file's size, modification time or
+ * a hash of its beginning and end changed, or if the quote
+ * style or delimiter differ from when it was built.
+ *
+ * Not for stdin. All return CSV_GOOD or CSV_FAIL.
+ */
+int csv_reader_build_index(struct csv_reader*, unsigned stride);
+int csv_reader_save_index(struct csv_reader*, const char* index_file);
+int csv_reader_load_index(struct csv_reader*, const char* index_file);
+int csv_reader_seek_row(struct csv_reader*, size_t row);
+
+/**
+ * Count the records from the current position to the end
+ * of the input without parsing fields. The input is scanned
+ * for line endings that are not inside of quotes, with the
+ * mmap split between the reader's worker threads. Counts
+ * always match what csv_get_record would return: if the
+ * scan finds something only the parsers can settle (a quote
+ * in the middle of a field, too many embedded breaks or
+ * failsafe mode lowering the standard), or the quoting is
+ * WEAK, the remaining records are parsed instead. stdin is
+ * always parsed.
+ *
+ * The reader is left at the end of the input with its
+ * statistics updated.
+ *
+ * Returns:
+ *      - CSV_GOOD
+ *      - CSV_FAIL
+ */
+int csv_count_records(struct csv_reader*, size_t* count);
+
+/**
+ * Copy the rest of the input to the writer, the same as
+ *
+ *     while ((ret = csv_get_record(reader, rec)) == CSV_GOOD)
+ *             csv_write_record(writer, rec);
+ *
+ * but pipelined: one thread reads the input in blocks that
+ * end after a record, `threads' workers parse and re-encode
+ * whole blocks with their own reader and writer, and the
+ * calling thread writes the blocks out in order. A block
+ * is cut where a scan like csv_count_records finds the
+ * end of a record. Where a worker cannot parse a record or
+ * the scan cannot find one, the records are parsed here
+ * instead until the block is behind, so the output and
+ * any errors are those of the loop above.
+ *
+ * With fewer than 2 threads, WEAK quotes, a delimiter of
+ * more than one byte, a fed reader or an mmap window, the
+ * loop above is all that runs.
+ *
+ * Experimental: so far it has only been measured slower
+ * than the loop above.
+ *
+ * Returns what the loop would: EOF, CSV_RESET or CSV_FAIL.
+ */
+int csv_pipeline(struct csv_reader*, struct csv_writer*, unsigned threads);
+
+/**
+ * Guess the dialect of the open file from samples of its
+ * beginning, middle and end, without moving the reader.
+ * The delimiter is the one of comma, pipe, tab, semi-colon
+ * or colon that gives the most lines the same number of
+ * fields. Fields that begin with a quote decide the quote
+ * style: RFC4180 if they close before a delimiter, WEAK if
+ * they only make sense with weak quoting and NONE if they
+ * do not make sense quoted at all. Starting failsafe mode
+ * from the right quote style avoids most CSV_RESET.
+ *
+ * csv_reader_set_dialect sets the delimiter and quotes.
+ *
+ * Not for stdin. Returns CSV_GOOD or CSV_FAIL.
+ */
+int csv_reader_sniff(struct csv_reader*, struct csv_dialect*);
+void csv_reader_set_dialect(struct csv_reader*, const struct csv_dialect*);
+
 /**
  * Reset statistics. If their is an associated file
  * to the reader, seek to the beginning of it.
@@ -157,6 +458,17 @@ int csv_reader_open(struct csv_reader*, const char* file_name);
  */
 int csv_reader_open_mmap(struct csv_reader*, const char* file_name);
 
+/**
+ * Open a copy of a stream such as stdin or a pipe, so it can
+ * be read like a file: failsafe resets, seeking, sniffing and
+ * mmap all work. Everything left in `fd' is copied before the
+ * first record is read. The copy is a memfd unless `dir' names
+ * a directory for an O_TMPFILE, which keeps a large stream out
+ * of memory. A regular file is read directly.
+ */
+int csv_reader_spool(struct csv_reader*, int fd, const char* dir);
+int csv_reader_spool_mmap(struct csv_reader*, int fd, const char* dir);
+
 /**
  *  For mmap only: pass through to madvise on whole file
  *  returns CSV_FAIL if out of range
@@ -206,6 +518,14 @@ int csv_nparse_to(struct csv_reader*,
 struct csv_writer* csv_writer_new();
 struct csv_writer* csv_writer_construct(struct csv_writer*);
 
+/**
+ * A new writer that formats records like another: the
+ * same delimiter, line ending and quotes. It has none of
+ * the other's buffering, compression or sync policy, and
+ * writes to stdout until it is opened or given a file.
+ */
+struct csv_writer* csv_writer_new_like(const struct csv_writer*);
+
 /**
  * Relese allocated heap resources
  */
@@ -262,6 +582,60 @@ void csv_writer_set_delim(struct csv_writer*, const char*);
  */
 void csv_writer_set_line_ending(struct csv_writer*, const char*);
 
+/**
+ * Compress files opened after this call as gzip or zstd
+ * at `level', 0 for the library's default. The output is
+ * split into blocks that worker threads compress as
+ * independent gzip members or zstd frames, so it reads
+ * back with any gzip or zstd and in parallel with
+ * csv_reader_open. Output for stdout is compressed
+ * if it goes through csv_writer_mktmp. Fails if this
+ * build cannot write the format.
+ */
+int csv_writer_set_compression(struct csv_writer*, enum csv_compression, int level);
+
+/**
+ * Compress with this many worker threads. 0, the
+ * default, uses one per processor up to 4.
+ */
+void csv_writer_set_threads(struct csv_writer*, unsigned);
+
+/**
+ * Format records into a buffer owned by the writer and
+ * write it out once it holds `threshold' bytes, with
+ * write(2) if the FILE has a descriptor and fwrite if
+ * not. Fields at least that large are written with
+ * writev(2) instead of being copied. 0, the default,
+ * writes each record to the FILE with one fwrite.
+ *
+ * Until csv_writer_flush, the FILE does not have what
+ * is buffered. Getting or setting the file, closing
+ * and freeing the writer flush first.
+ */
+void csv_writer_set_buffer(struct csv_writer*, size_t threshold);
+
+/* Write out what the writer has buffered */
+int csv_writer_flush(struct csv_writer*);
+
+/**
+ * How csv_writer_close makes a file durable. With
+ * CSV_SYNC_CLOSE, the temp file is fsync'd before it is
+ * renamed and its directory after. CSV_SYNC_BATCH also
+ * fsyncs the temp file before the rename, but leaves the
+ * directories to csv_writer_sync, which does them all at
+ * once. Until then, a crash can lose a rename but never
+ * leave a file renamed without its data. The default is
+ * CSV_SYNC_NONE. Output for stdout is never synced.
+ */
+void csv_writer_set_sync(struct csv_writer*, enum csv_sync);
+
+/**
+ * fsync the directories left by CSV_SYNC_BATCH.
+ * Also done every so many files and when the writer is
+ * freed.
+ */
+int csv_writer_sync(struct csv_writer*);
+
 /**
  * Open a file for writing csv conents
  */
@@ -298,16 +672,24 @@ char* csv_writer_export_tmp(struct csv_writer*);
 
 /**
  * If we are writing to a file, close and re-open
- * the file for writing.
+ * the file for writing. Anything written after the
+ * last csv_writer_mark is dropped.
  */
 int csv_writer_reset(struct csv_writer*);
 
+/**
+ * Remember how much has been written so far, so that
+ * csv_writer_reset keeps it. Not for compressed output.
+ */
+int csv_writer_mark(struct csv_writer*);
+
 /**
  * csv_writer is always writing to a temp file
  * if we are not writing to stdout. Here we
  * close and rename the temp file to the desired
  * file name. If there is no output file, dump
- * the temp file to stdout
+ * the temp file to stdout, copying in the kernel
+ * where it can.
  */
 int csv_writer_close(struct csv_writer*);
 
@@ -0,0 +1,268 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csv.h"
+#include "csverror.h"
+#include "internal.h"
+#include "util/vec.h"
+#include "util/stringy.h"
+#include "util/util.h"
+
+#define INDEX_MAGIC      "CSVIDX1"
+#define INDEX_HASH_BYTES (1 << 16)
+
+/* Sidecar layout: this header, the delimiter
+ * and then `marks' struct csv_row_mark. Native
+ * byte order. It is a cache, not an exchange format.
+ */
+struct index_header {
+	char magic[8];
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint64_t rows;
+	uint64_t marks;
+	uint32_t stride;
+	uint32_t quotes;
+	uint32_t delimlen;
+	uint32_t reserved;
+};
+
+/**
+ * Describe the reader's open file: size, mtime and a
+ * hash of its first and last INDEX_HASH_BYTES.
+ */
+int _index_fingerprint(struct csv_reader*, struct index_header*);
+
+/**
+ * Where the next record begins. self->offset is not
+ * moved past lines appended for embedded breaks.
+ */
+size_t _next_record_offset(struct csv_reader*);
+
+uint64_t _hash_bytes(uint64_t hash, const char* data, size_t len)
+{
+	size_t i = 0;
+	for (; i < len; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+int _index_fingerprint(struct csv_reader* self, struct index_header* header)
+{
+	struct stat sb;
+	csvfail_if_(self->_in->fd == -1, "no file to index");
+	csvfail_if_(self->_in->decompress, "cannot index compressed input");
+	csvfail_if_(fstat(self->_in->fd, &sb) == -1, "fstat");
+
+	*header = (struct index_header) {
+	        .magic = INDEX_MAGIC,
+	        .file_size = sb.st_size,
+	        .mtime_sec = sb.st_mtim.tv_sec,
+	        .mtime_nsec = sb.st_mtim.tv_nsec,
+	        .hash = UINT64_C(0xcbf29ce484222325),
+	};
+
+	char* buf = malloc_(INDEX_HASH_BYTES);
+	off_t tail = sb.st_size - INDEX_HASH_BYTES;
+	off_t offsets[] = {0, (tail > INDEX_HASH_BYTES) ? tail : INDEX_HASH_BYTES};
+	unsigned i = 0;
+	for (; i < 2 && offsets[i] < sb.st_size; ++i) {
+		ssize_t n = pread(self->_in->fd, buf, INDEX_HASH_BYTES, offsets[i]);
+		if (n == -1) {
+			free_(buf);
+			csvfail_if_(true, "pread");
+		}
+		header->hash = _hash_bytes(header->hash, buf, n);
+	}
+	free_(buf);
+
+	return CSV_GOOD;
+}
+
+size_t _next_record_offset(struct csv_reader* self)
+{
+	if (self->_in->is_mmap) {
+		return self->_in->offset;
+	}
+	return blockbuf_offset(&self->_in->block);
+}
+
+int csv_reader_build_index(struct csv_reader* self, unsigned stride)
+{
+	csvfail_if_(stride == 0, "index stride must be positive");
+	csvfail_if_(!self->_in->is_mmap && self->_in->file == stdin, "cannot index stdin");
+	csvfail_if_(self->_in->decompress, "cannot index compressed input");
+
+	int ret = csv_reader_reset(self);
+	if (ret == CSV_FAIL) {
+		return ret;
+	}
+
+	vec_clear(&self->_in->row_marks);
+	self->_in->row_stride = stride;
+	self->_in->row_total = 0;
+
+	struct csv_record* rec = csv_record_new();
+	for (;;) {
+		struct csv_row_mark mark = {
+		        .offset = _next_record_offset(self),
+		        .embedded_breaks = self->_in->embedded_breaks,
+		};
+
+		ret = csv_get_record(self, rec);
+		if (ret == CSV_GOOD) {
+			if (self->_in->row_total % stride == 0) {
+				vec_push_back(&self->_in->row_marks, &mark);
+			}
+			++self->_in->row_total;
+			continue;
+		}
+
+		/* Failsafe mode started the file over */
+		if (ret == CSV_RESET) {
+			vec_clear(&self->_in->row_marks);
+			self->_in->row_total = 0;
+			continue;
+		}
+
+		break;
+	}
+	csv_record_free(rec);
+
+	if (ret == CSV_FAIL) {
+		self->_in->row_stride = 0;
+		return ret;
+	}
+
+	return csv_reader_reset(self);
+}
+
+int csv_reader_save_index(struct csv_reader* self, const char* index_file)
+{
+	csvfail_if_(self->_in->row_stride == 0, "no row index to save");
+
+	struct index_header header;
+	int ret = _index_fingerprint(self, &header);
+	if (ret == CSV_FAIL) {
+		return ret;
+	}
+	header.rows = self->_in->row_total;
+	header.marks = self->_in->row_marks.size;
+	header.stride = self->_in->row_stride;
+	header.quotes = self->quotes;
+	header.delimlen = self->_in->delim.size;
+
+	FILE* f = fopen(index_file, "w");
+	csvfail_if_(!f, index_file);
+
+	_Bool ok = (fwrite(&header, sizeof(header), 1, f) == 1
+	            && fwrite(self->_in->delim.data, 1, header.delimlen, f)
+	                       == header.delimlen
+	            && fwrite(self->_in->row_marks.data,
+	                      sizeof(struct csv_row_mark),
+	                      header.marks,
+	                      f) == header.marks);
+	ok = (fclose(f) == 0) && ok;
+	csvfail_if_(!ok, index_file);
+
+	return CSV_GOOD;
+}
+
+int csv_reader_load_index(struct csv_reader* self, const char* index_file)
+{
+	struct index_header current;
+	int ret = _index_fingerprint(self, &current);
+	if (ret == CSV_FAIL) {
+		return ret;
+	}
+
+	FILE* f = fopen(index_file, "r");
+	csvfail_if_(!f, index_file);
+
+	struct index_header header;
+	char delim[32] = "";
+	_Bool ok = (fread(&header, sizeof(header), 1, f) == 1
+	            && !memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic))
+	            && header.delimlen < sizeof(delim)
+	            && fread(delim, 1, header.delimlen, f) == header.delimlen);
+	if (ok) {
+		vec_resize(&self->_in->row_marks, header.marks);
+		ok = (fread(self->_in->row_marks.data,
+		            sizeof(struct csv_row_mark),
+		            header.marks,
+		            f) == header.marks);
+	}
+	fclose(f);
+
+	if (!ok) {
+		vec_clear(&self->_in->row_marks);
+		csvfail_if_(true, "invalid row index");
+	}
+
+	_Bool stale = (header.file_size != current.file_size
+	               || header.mtime_sec != current.mtime_sec
+	               || header.mtime_nsec != current.mtime_nsec
+	               || header.hash != current.hash);
+	_Bool mismatch = (header.quotes != (uint32_t)self->quotes
+	                  || (!string_empty(&self->_in->delim)
+	                      && strcmp(delim, string_c_str(&self->_in->delim))));
+	if (stale || mismatch) {
+		vec_clear(&self->_in->row_marks);
+		csvfail_if_(stale, "row index is stale");
+		csvfail_if_(mismatch, "row index was built with other settings");
+	}
+
+	if (string_empty(&self->_in->delim)) {
+		csv_reader_set_delim(self, delim);
+	}
+	self->_in->row_stride = header.stride;
+	self->_in->row_total = header.rows;
+
+	return CSV_GOOD;
+}
+
+int csv_reader_seek_row(struct csv_reader* self, size_t row)
+{
+	csvfail_if_(self->_in->row_stride == 0, "no row index");
+	csvfail_if_(row > self->_in->row_total, "row out of range");
+
+	/* The last mark may be before `row_total' */
+	struct csv_row_mark mark = {0, 0};
+	size_t idx = row / self->_in->row_stride;
+	if (idx >= self->_in->row_marks.size) {
+		idx = (idx > 0) ? idx - 1 : 0;
+	}
+	if (!vec_empty(&self->_in->row_marks)) {
+		mark = *(struct csv_row_mark*)vec_at(&self->_in->row_marks, idx);
+	}
+
+	int ret = csv_reader_seek(self, mark.offset);
+	if (ret == CSV_FAIL) {
+		return ret;
+	}
+	self->_in->rows = idx * self->_in->row_stride;
+	self->_in->embedded_breaks = mark.embedded_breaks;
+
+	/* Parse the rest of the way. Every field must be parsed
+	 * to find where multi-line records end.
+	 */
+	struct csv_record* rec = csv_record_new();
+	while (self->_in->rows < row) {
+		ret = csv_get_record(self, rec);
+		if (ret != CSV_GOOD) {
+			break;
+		}
+	}
+	csv_record_free(rec);
+	csvfail_if_(ret != CSV_GOOD, "row index does not match the file");
+
+	return CSV_GOOD;
+}
@@ -1,36 +1,88 @@
 #ifndef INTERNAL_H
 #define INTERNAL_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "util/node.h"
 #include "util/vec.h"
 #include "util/stringy.h"
+#include "safegetline.h"
+#include "csv.h"
+
+struct csv_reader;
+struct csv_record;
+struct csv_parallel;
+struct csv_decompress;
 
 /**
  * Internal Structures
  */
 
+/* A field copied into the arena, by offset so that
+ * it can follow the arena when it grows.
+ */
+struct csv_owned_field {
+	unsigned index;
+	size_t offset;
+};
+
 /* [csv_record].fields always points to the data
  * owned by [csv_record]._in->_fields. This way
  * we do not expose our internal vector type.
+ *
+ * Fields point into the record, the mmap or, if
+ * they had to be copied, into `arena'. The arena
+ * holds the copies for one record at a time.
  */
 struct csv_record_internal {
-	vec* field_data; /* vec<string> */
-	vec* _fields;    /* vec<struct csv_field> */
+	string arena;
+	vec owned;    /* vec<struct csv_owned_field> */
+	vec* _fields; /* vec<struct csv_field> */
 	size_t rec_alloc;
 	unsigned field_alloc;
 };
 
+/* Where row number `n * stride' of the file begins */
+struct csv_row_mark {
+	uint64_t offset;
+	uint64_t embedded_breaks;
+};
+
+/* Parses one record. See _bind_parser in reader.c */
+typedef int (*csv_parse_fn)(struct csv_reader*,
+                            struct csv_record*,
+                            const char* line,
+                            unsigned byte_limit,
+                            unsigned field_limit);
+
 struct csv_read_internal {
 	FILE* file;
 	string delim;
 	string weak_delim;
 	string embedded_break;
+	vec field_ends; /* vec<unsigned> */
+	vec columns;    /* vec<unsigned> */
+	vec selected;   /* vec<_Bool> */
+	vec projected;  /* vec<struct csv_field> */
+	vec row_marks;  /* vec<struct csv_row_mark> */
+	struct blockbuf block;
+	struct csv_record* feed_record;
+	csv_parse_fn parse;
+	csv_record_fn record_fn;
+	void* record_data;
 	char* mmap_ptr;
+	struct csv_parallel* parallel;
+	struct csv_decompress* decompress;
 	size_t offset;
 	size_t file_size;
+	size_t window;   /* see csv_reader_set_mmap_window */
+	size_t released; /* mmap before this offset was released */
+	size_t row_total;
 	int fd;
+	unsigned threads;
+	unsigned row_stride;   /* 0 if there is no row index */
+	unsigned max_newlines; /* in one field, UINT_MAX for no limit */
 
 	/* Statistics */
 	unsigned rows;
@@ -39,6 +91,10 @@ struct csv_read_internal {
 	/* Properties */
 	int normorg;
 	_Bool is_mmap;
+	_Bool quiet;
+	_Bool skip_field;
+	_Bool failsafe_incremental;
+	_Bool starved;
 };
 
 struct csv_write_internal {
@@ -50,7 +106,75 @@ struct csv_write_internal {
 	string delim;
 	string rec_terminator;
 	int reclen;
+	enum csv_compression compression;
+	int level;
+	size_t threshold; /* buffered bytes that are written out */
+	enum csv_sync sync;
+	vec synced; /* vec<int> descriptors left to csv_writer_sync */
+	off_t mark; /* csv_writer_reset rolls back to here */
+	unsigned threads;
 	_Bool is_detached;
 };
 
+struct csv_batch_column {
+	vec offsets; /* vec<size_t> */
+	vec lengths; /* vec<unsigned> */
+	vec values;  /* vec<int64_t|double|bool>, empty for CSV_TEXT */
+	vec status;  /* vec<unsigned char>, empty for CSV_TEXT */
+	enum csv_type type;
+};
+
+struct csv_batch_internal {
+	string arena;
+	vec columns;     /* vec<struct csv_batch_column> */
+	vec offset_ptrs; /* vec<size_t*> */
+	vec length_ptrs; /* vec<unsigned*> */
+	vec value_ptrs;  /* vec<void*> */
+	vec status_ptrs; /* vec<unsigned char*> */
+	struct csv_record* record;
+};
+
+/**
+ * Internal functions shared between reader.c, parallel.c
+ * and count.c
+ */
+
+/**
+ * csv_determine_delimiter chooses between comma, pipe, semi-colon,
+ * colon or tab depending on which  one is found most. If none of
+ * these delimiters are found, use comma. If self->delimiter was set
+ * externally, simply update self->_in->delimlen and return.
+ */
+void csv_determine_delimiter(struct csv_reader*, const char* header, unsigned byte_limit);
+
+/* csv_get_record_to without handing off to worker threads */
+int csv_get_record_serial(struct csv_reader*, struct csv_record*, unsigned field_limit);
+
+/* Add one zero length field to the record */
+void csv_append_empty_field(struct csv_record*);
+
+/* Make room for `n' fields in the record at once */
+void csv_record_reserve(struct csv_record*, unsigned n);
+
+/* Fields pointing into [begin, end] were moved to `to' */
+void csv_record_rebase(struct csv_record*,
+                       const char* begin,
+                       const char* end,
+                       const char* to);
+
+/* Normalize field count and update statistics
+ * after a record has been parsed.
+ */
+void csv_finish_record(struct csv_reader*, struct csv_record*);
+
+/* Read an open descriptor like csv_reader_open and
+ * csv_reader_open_mmap. The reader owns `fd' even when
+ * these fail. `name' is for error messages.
+ */
+int csv_reader_open_fd(struct csv_reader*, int fd, const char* name);
+int csv_reader_map_fd(struct csv_reader*, int fd, const char* name);
+
+/* Write bytes that are already csv out through the writer */
+int csv_writer_write(struct csv_writer*, const char* data, size_t len);
+
 #endif
@@ -3,10 +3,14 @@
 
 void increase_buffer(char** buf, size_t* buflen)
 {
-	*buflen += BUFFER_FACTOR;
-	if (*buflen == BUFFER_FACTOR) {
+	/* Doubling keeps a long line from being copied once
+	 * per BUFFER_FACTOR bytes.
+	 */
+	if (*buflen == 0) {
+		*buflen = BUFFER_FACTOR;
 		*buf = malloc_(*buflen);
 	} else {
+		*buflen *= 2;
 		realloc_(*buf, *buflen);
 	}
 }
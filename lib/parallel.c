@@ -0,0 +1,474 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include "csverror.h"
+#include "internal.h"
+#include "misc.h"
+#include "util/stringy.h"
+#include "util/stringview.h"
+#include "util/util.h"
+#include "util/vec.h"
+
+enum chunk_state {
+	CHUNK_EMPTY,
+	CHUNK_PARSING,
+	CHUNK_READY,
+};
+
+struct chunk_record {
+	size_t rec_offset;
+	size_t reclen;
+	size_t end_offset;
+	unsigned field_idx;
+	unsigned size;
+	unsigned embedded_breaks;
+};
+
+/* Unqualified fields point into the mmap. Fields
+ * that were copied (unescaped) live in the arena.
+ */
+struct chunk_field {
+	size_t offset;
+	unsigned len;
+	_Bool owned;
+};
+
+struct chunk {
+	vec records; /* vec<struct chunk_record> */
+	vec fields;  /* vec<struct chunk_field> */
+	string arena;
+	size_t begin;
+	size_t parsed_end;
+	unsigned idx;
+	enum chunk_state state;
+};
+
+struct worker {
+	struct csv_parallel* pool;
+	struct csv_reader reader;
+	struct csv_record record;
+	pthread_t thread;
+};
+
+struct csv_parallel {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct worker* workers;
+	struct chunk* slots;
+	const char* mmap_ptr;
+	size_t file_size;
+	size_t start;
+	size_t chunk_size;
+	unsigned field_limit;
+	unsigned worker_count;
+	unsigned slot_count;
+	unsigned chunk_count;
+	unsigned next_chunk;
+	unsigned current;
+	unsigned record_idx;
+	enum quote_style quotes;
+	char delim;
+	_Bool in_chunk;
+	_Bool shutdown;
+};
+
+static size_t _min(size_t a, size_t b)
+{
+	return (a < b) ? a : b;
+}
+
+/* Where the line ending at `offset' has its '\n' */
+static size_t _newline_pos(const struct csv_parallel* p, size_t offset)
+{
+	if (offset >= p->file_size) {
+		return p->file_size;
+	}
+	return (p->mmap_ptr[offset] == '\r') ? offset + 1 : offset;
+}
+
+static _Bool _is_field_edge(const struct csv_parallel* p, const char* c)
+{
+	if (c < p->mmap_ptr || c >= p->mmap_ptr + p->file_size) {
+		return true;
+	}
+	return (*c == p->delim || *c == '\n' || *c == '\r');
+}
+
+/* Guess the first record boundary at or after `nominal'.
+ * Assume we are not qualified unless the first quote we
+ * find looks like it is closing a field. A wrong guess is
+ * caught when the previous chunk is validated.
+ */
+static size_t _speculate_begin(const struct csv_parallel* p,
+                               size_t nominal,
+                               size_t nominal_end)
+{
+	const char* ptr = &p->mmap_ptr[nominal];
+	const char* end = &p->mmap_ptr[nominal_end];
+	_Bool qualified = false;
+
+	if (p->quotes != QUOTE_NONE) {
+		size_t window = _min(CSV_SPECULATE_WINDOW, p->file_size - nominal);
+		const char* quote = memchr(ptr, '"', window);
+		if (quote && _is_field_edge(p, quote + 1) && !_is_field_edge(p, quote - 1)) {
+			ptr = quote + 1;
+		}
+	}
+
+	while (ptr < end) {
+		const char* eol = memchr(ptr, '\n', end - ptr);
+		if (eol == NULL) {
+			break;
+		}
+
+		if (p->quotes != QUOTE_NONE) {
+			const char* quote = ptr;
+			while ((quote = memchr(quote, '"', eol - quote))) {
+				qualified = !qualified;
+				++quote;
+			}
+		}
+
+		if (!qualified) {
+			size_t offset = eol - p->mmap_ptr;
+			if (p->mmap_ptr[offset - 1] == '\r') {
+				--offset;
+			}
+			return offset;
+		}
+		ptr = eol + 1;
+	}
+
+	/* No record starts in this chunk as far as we can tell */
+	return nominal_end;
+}
+
+static void _store_record(struct csv_parallel* p,
+                          struct chunk* c,
+                          struct csv_reader* reader,
+                          struct csv_record* rec,
+                          unsigned embedded_breaks)
+{
+	struct chunk_record* cr = vec_add_one(&c->records);
+	*cr = (struct chunk_record) {
+	        .rec_offset = rec->rec - p->mmap_ptr,
+	        .reclen = rec->reclen,
+	        .end_offset = reader->_in->offset,
+	        .field_idx = c->fields.size,
+	        .size = rec->size,
+	        .embedded_breaks = embedded_breaks,
+	};
+
+	const char* map_end = p->mmap_ptr + p->file_size;
+	int i = 0;
+	for (; i < rec->size; ++i) {
+		const struct csv_field* field = &rec->fields[i];
+		struct chunk_field* cf = vec_add_one(&c->fields);
+		cf->len = field->len;
+
+		if (field->data >= p->mmap_ptr && field->data <= map_end) {
+			cf->offset = field->data - p->mmap_ptr;
+			cf->owned = false;
+			continue;
+		}
+
+		cf->offset = c->arena.size;
+		cf->owned = true;
+		if (c->arena.size + field->len >= c->arena._alloc) {
+			vec_reserve(&c->arena, 2 * (c->arena.size + field->len));
+		}
+		struct stringview sv = {field->data, field->len};
+		string_append_stringview(&c->arena, &sv);
+	}
+}
+
+static void _parse_chunk(struct worker* w, struct chunk* c)
+{
+	struct csv_parallel* p = w->pool;
+	struct csv_reader* reader = &w->reader;
+	struct csv_record* rec = &w->record;
+
+	vec_clear(&c->records);
+	vec_clear(&c->fields);
+	string_clear(&c->arena);
+
+	size_t nominal = p->start + (size_t)c->idx * p->chunk_size;
+	size_t nominal_end = _min(nominal + p->chunk_size, p->file_size);
+
+	c->begin = p->start;
+	if (c->idx > 0) {
+		c->begin = _speculate_begin(p, nominal, nominal_end);
+	}
+	c->parsed_end = c->begin;
+
+	reader->_in->offset = c->begin;
+	reader->_in->embedded_breaks = 0;
+
+	while (_newline_pos(p, reader->_in->offset) < nominal_end) {
+		unsigned breaks = reader->_in->embedded_breaks;
+		/* On EOF or any qualifier issue, stop. The serial
+		 * parser takes over from the last good record and
+		 * reports or recovers from the problem itself.
+		 */
+		if (csv_get_record_to(reader, rec, p->field_limit) != CSV_GOOD) {
+			break;
+		}
+		_store_record(p, c, reader, rec, reader->_in->embedded_breaks - breaks);
+		c->parsed_end = reader->_in->offset;
+	}
+}
+
+static void* _worker_main(void* arg)
+{
+	struct worker* w = arg;
+	struct csv_parallel* p = w->pool;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->shutdown && p->next_chunk < p->chunk_count
+		       && p->slots[p->next_chunk % p->slot_count].state != CHUNK_EMPTY) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if (p->shutdown || p->next_chunk >= p->chunk_count) {
+			break;
+		}
+
+		struct chunk* c = &p->slots[p->next_chunk % p->slot_count];
+		c->idx = p->next_chunk++;
+		c->state = CHUNK_PARSING;
+		pthread_mutex_unlock(&p->lock);
+
+		_parse_chunk(w, c);
+
+		pthread_mutex_lock(&p->lock);
+		c->state = CHUNK_READY;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static struct chunk* _wait_chunk(struct csv_parallel* p, unsigned idx)
+{
+	struct chunk* c = &p->slots[idx % p->slot_count];
+	pthread_mutex_lock(&p->lock);
+	while (c->state != CHUNK_READY || c->idx != idx) {
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return c;
+}
+
+static void _release_chunk(struct csv_parallel* p, struct chunk* c)
+{
+	pthread_mutex_lock(&p->lock);
+	c->state = CHUNK_EMPTY;
+	++p->current;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void _worker_construct(struct csv_reader* self, struct worker* w)
+{
+	w->pool = self->_in->parallel;
+
+	struct csv_reader* reader = csv_reader_construct(&w->reader);
+	csv_reader_set_delim(reader, string_c_str(&self->_in->delim));
+	csv_reader_set_embedded_break(reader, string_c_str(&self->_in->embedded_break));
+	reader->quotes = self->quotes;
+	reader->trim = self->trim;
+	reader->_in->max_newlines = self->_in->max_newlines;
+	csv_reader_set_columns(reader, self->_in->columns.data, self->_in->columns.size);
+	reader->_in->mmap_ptr = self->_in->mmap_ptr;
+	reader->_in->file_size = self->_in->file_size;
+	reader->_in->is_mmap = true;
+	reader->_in->quiet = true;
+
+	csv_record_construct(&w->record);
+}
+
+int csv_parallel_start(struct csv_reader* self)
+{
+	size_t start = self->_in->offset;
+	if (start >= self->_in->file_size) {
+		return CSV_GOOD;
+	}
+	size_t remaining = self->_in->file_size - start;
+
+	struct csv_parallel* p = malloc_(sizeof(*p));
+	*p = (struct csv_parallel) {
+	        .mmap_ptr = self->_in->mmap_ptr,
+	        .file_size = self->_in->file_size,
+	        .start = start,
+	        .field_limit = UINT_MAX,
+	        .worker_count = self->_in->threads,
+	        .slot_count = 2 * self->_in->threads,
+	        .quotes = self->quotes,
+	        .delim = string_c_str(&self->_in->delim)[0],
+	};
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	p->chunk_size = remaining / (4 * p->worker_count);
+	if (p->chunk_size < CSV_CHUNK_SIZE_MIN) {
+		p->chunk_size = CSV_CHUNK_SIZE_MIN;
+	} else if (p->chunk_size > CSV_CHUNK_SIZE) {
+		p->chunk_size = CSV_CHUNK_SIZE;
+	}
+	p->chunk_count = (remaining + p->chunk_size - 1) / p->chunk_size;
+
+	p->slots = malloc_(p->slot_count * sizeof(*p->slots));
+	unsigned i = 0;
+	for (; i < p->slot_count; ++i) {
+		struct chunk* c = &p->slots[i];
+		*c = (struct chunk) {.state = CHUNK_EMPTY};
+		vec_construct_(&c->records, struct chunk_record);
+		vec_construct_(&c->fields, struct chunk_field);
+		string_construct(&c->arena);
+	}
+
+	self->_in->parallel = p;
+
+	p->workers = malloc_(p->worker_count * sizeof(*p->workers));
+	for (i = 0; i < p->worker_count; ++i) {
+		struct worker* w = &p->workers[i];
+		_worker_construct(self, w);
+		if (pthread_create(&w->thread, NULL, _worker_main, w)) {
+			csv_reader_destroy(&w->reader);
+			csv_record_destroy(&w->record);
+			break;
+		}
+	}
+	p->worker_count = i;
+
+	if (p->worker_count == 0) {
+		csv_parallel_stop(self);
+		csvfail_if_(true, "pthread_create");
+	}
+
+	return CSV_GOOD;
+}
+
+void csv_parallel_stop(struct csv_reader* self)
+{
+	struct csv_parallel* p = self->_in->parallel;
+	if (p == NULL) {
+		return;
+	}
+	self->_in->parallel = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	unsigned i = 0;
+	for (; i < p->worker_count; ++i) {
+		pthread_join(p->workers[i].thread, NULL);
+		csv_reader_destroy(&p->workers[i].reader);
+		csv_record_destroy(&p->workers[i].record);
+	}
+	free_(p->workers);
+
+	for (i = 0; i < p->slot_count; ++i) {
+		vec_destroy(&p->slots[i].records);
+		vec_destroy(&p->slots[i].fields);
+		string_destroy(&p->slots[i].arena);
+	}
+	free_(p->slots);
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free_(p);
+}
+
+static void _deliver_record(struct csv_reader* self,
+                            struct csv_parallel* p,
+                            struct chunk* c,
+                            struct csv_record* rec,
+                            unsigned field_limit)
+{
+	const struct chunk_record* cr = vec_at(&c->records, p->record_idx++);
+
+	if (rec->_in->rec_alloc > 0) {
+		rec->_in->rec_alloc = 0;
+		free_(rec->rec);
+	}
+	rec->rec = (char*)&p->mmap_ptr[cr->rec_offset];
+	rec->reclen = cr->reclen;
+
+	unsigned size = cr->size;
+	if (size > field_limit) {
+		size = field_limit;
+	}
+
+	rec->size = 0;
+	unsigned i = 0;
+	for (; i < size; ++i) {
+		const struct chunk_field* cf = vec_at(&c->fields, cr->field_idx + i);
+		csv_append_empty_field(rec);
+		struct csv_field* field = &rec->fields[i];
+		if (cf->owned) {
+			field->data = (const char*)c->arena.data + cf->offset;
+		} else {
+			field->data = &p->mmap_ptr[cf->offset];
+		}
+		field->len = cf->len;
+	}
+
+	self->_in->embedded_breaks += cr->embedded_breaks;
+	self->_in->offset = cr->end_offset;
+	self->offset = cr->end_offset;
+	csv_finish_record(self, rec);
+}
+
+int csv_parallel_get_record(struct csv_reader* self,
+                            struct csv_record* rec,
+                            unsigned field_limit)
+{
+	struct csv_parallel* p = self->_in->parallel;
+
+	for (;;) {
+		if (p->in_chunk) {
+			struct chunk* c = &p->slots[p->current % p->slot_count];
+			if (p->record_idx < c->records.size) {
+				_deliver_record(self, p, c, rec, field_limit);
+				return CSV_GOOD;
+			}
+
+			/* Chunk is exhausted. Pick up where it really ended. */
+			self->_in->offset = c->parsed_end;
+			p->in_chunk = false;
+			_release_chunk(p, c);
+			continue;
+		}
+
+		/* Validate: the next chunk is only usable if its
+		 * speculated beginning is exactly where we are now.
+		 * Chunks that begin behind us were mis-speculated.
+		 */
+		while (p->current < p->chunk_count) {
+			struct chunk* c = _wait_chunk(p, p->current);
+			if (c->begin > self->_in->offset) {
+				break;
+			}
+			if (c->begin == self->_in->offset) {
+				p->in_chunk = true;
+				p->record_idx = 0;
+				break;
+			}
+			_release_chunk(p, c);
+		}
+
+		if (p->in_chunk) {
+			continue;
+		}
+
+		/* Parse serially until we catch up with a chunk. This
+		 * may reset the reader and stop parallel parsing, so
+		 * `p' must not be touched after this.
+		 */
+		return csv_get_record_serial(self, rec, field_limit);
+	}
+}
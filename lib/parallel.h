@@ -0,0 +1,40 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "csv.h"
+
+/* Target bytes per chunk. Small files get smaller
+ * chunks so every worker has something to do.
+ */
+#define CSV_CHUNK_SIZE     (1 << 23)
+#define CSV_CHUNK_SIZE_MIN (1 << 16)
+
+/* How far to look for a quote when guessing whether
+ * a chunk begins inside of a qualified field.
+ */
+#define CSV_SPECULATE_WINDOW (1 << 16)
+
+struct csv_parallel;
+
+/**
+ * Split the rest of the mmapped file, starting from the
+ * current offset, into chunks and start parsing them
+ * with the reader's worker threads.
+ */
+int csv_parallel_start(struct csv_reader*);
+
+/**
+ * Join the workers and release every parsed chunk.
+ * Safe to call if parallel parsing was never started.
+ */
+void csv_parallel_stop(struct csv_reader*);
+
+/**
+ * Hand out the next record in file order. A chunk whose
+ * speculated starting point does not match where the
+ * previous chunk actually ended is discarded and that
+ * part of the file is parsed serially instead.
+ */
+int csv_parallel_get_record(struct csv_reader*, struct csv_record*, unsigned field_limit);
+
+#endif /* PARALLEL_H */
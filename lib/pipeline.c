@@ -0,0 +1,682 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include "csv.h"
+#include "csverror.h"
+#include "internal.h"
+#include "parallel.h"
+#include "simd.h"
+#include "util/util.h"
+
+/* New bytes the reader puts in each block */
+#define PIPELINE_BLOCK (1 << 20)
+
+/* A block that cannot be cut after a record by this
+ * size is left to the serial parser.
+ */
+#define PIPELINE_BLOCK_MAX (1 << 26)
+
+/* One block of records on its way through the pipeline.
+ * A block ends after a record. For a file it holds
+ * the bytes of its records. For an mmap it is the span
+ * from the line ending before its first record to the
+ * line ending of its last, like sgetline_mmap reads it.
+ */
+struct pipeline_job {
+	char* buf; /* owned copy of a file's block */
+	size_t buf_size;
+	const char* data;
+	size_t len;
+	size_t offset; /* of data in the input */
+	size_t resume; /* where the serial parser takes over */
+	string out;
+	unsigned rows;
+	unsigned breaks;
+	_Bool serial; /* the reader could not cut the block */
+	_Bool failed; /* stopped at `resume' */
+	_Bool done;
+};
+
+/* A worker parses with its own reader and re-encodes into
+ * the current job's output with its own writer.
+ */
+struct pipeline_worker {
+	struct csv_pipeline* pipe;
+	struct csv_reader reader;
+	struct csv_writer writer;
+	struct csv_record record;
+	pthread_t thread;
+};
+
+struct csv_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct csv_reader* reader;
+	struct pipeline_worker* workers;
+	struct pipeline_job* jobs; /* ring of job_count, indexed by sequence */
+	char* carry;               /* read past the last block */
+	size_t carry_len;
+	size_t carry_size;
+	size_t next;      /* offset of the next block */
+	size_t submitted; /* jobs the reader filled */
+	size_t taken;     /* jobs a worker has started on */
+	size_t written;   /* jobs written out */
+	pthread_t read_thread;
+	unsigned worker_count;
+	unsigned job_count;
+	unsigned max_breaks;
+	int normal;
+	char delim;
+	_Bool quotes;
+	_Bool is_mmap;
+	_Bool finished; /* the reader submitted its last job */
+	_Bool stop;
+	_Bool shutdown;
+};
+
+/**
+ * Whether blocks can be cut by scanning. The same rules
+ * as csv_count_records: weak quoting and multi-byte
+ * delimiters are left to the parser.
+ */
+_Bool _pipeline_can_split(struct csv_reader*);
+
+/* Offset of the reader's next record */
+size_t _pipeline_position(struct csv_reader*);
+
+/**
+ * Find the last record in `len' bytes that begin with a
+ * record. Returns the offset past its line ending, or 0
+ * if there is none. `term' is set to where the line
+ * ending begins. `bail' is set if the scan ran into
+ * something only the parser can settle.
+ */
+size_t _pipeline_cut(const struct csv_pipeline*,
+                     const char* data,
+                     size_t len,
+                     size_t* term,
+                     _Bool* bail);
+
+/**
+ * Fill the job with the next block. Returns true if
+ * it is the last block the reader hands out.
+ */
+_Bool _pipeline_fill_file(struct csv_pipeline*, struct pipeline_job*);
+_Bool _pipeline_fill_mmap(struct csv_pipeline*, struct pipeline_job*);
+
+/* Parse and re-encode a job on a worker */
+void _pipeline_parse(struct pipeline_worker*, struct pipeline_job*);
+
+/**
+ * Run the reader and have the workers go through the input
+ * from the reader's position, writing blocks out in order.
+ * Returns true if the input was used up. Otherwise the
+ * reader is moved to where a worker stopped, and `stop_at'
+ * is set to the end of that block.
+ */
+_Bool _pipeline_stage(struct csv_pipeline*, struct csv_writer*, size_t* stop_at);
+
+/**
+ * Hand everything read from the file after `resume'
+ * back to the reader's block buffer.
+ */
+void _pipeline_unread(struct csv_pipeline*, size_t resume);
+
+/* Start the workers. NULL if none could be started. */
+struct csv_pipeline* _pipeline_new(struct csv_reader*, struct csv_writer*, unsigned);
+void _pipeline_free(struct csv_pipeline*);
+
+_Bool _pipeline_can_split(struct csv_reader* self)
+{
+	if (self->quotes == QUOTE_WEAK || self->_in->delim.size != 1) {
+		return false;
+	}
+	return (string_c_str(&self->_in->delim)[0] != '"');
+}
+
+size_t _pipeline_position(struct csv_reader* self)
+{
+	if (self->_in->is_mmap) {
+		return self->_in->offset;
+	}
+	return blockbuf_offset(&self->_in->block);
+}
+
+size_t _pipeline_cut(const struct csv_pipeline* self,
+                     const char* data,
+                     size_t len,
+                     size_t* term,
+                     _Bool* bail)
+{
+	/* With '\r' line endings, the byte after
+	 * one decides whether it is "\r\n".
+	 */
+	_Bool cr_breaks = !self->is_mmap;
+	struct simd_scan scan = {.field_start = true};
+	simd_scan_records(data,
+	                  len - cr_breaks,
+	                  self->delim,
+	                  self->quotes,
+	                  cr_breaks,
+	                  self->max_breaks,
+	                  &scan);
+	*bail = scan.bail;
+	if (scan.record_end == 0) {
+		return 0;
+	}
+
+	/* Last byte of the line ending */
+	size_t last = scan.record_end - 1;
+	if (data[last] == '\r' && data[last + 1] == '\n') {
+		++last;
+	}
+
+	/* A blank line is not a record at the end of the input,
+	 * so a block may not end with one. The line ending before
+	 * a blank line is outside of quotes too.
+	 */
+	for (;;) {
+		*term = last;
+		if (data[last] == '\n' && last > 0 && data[last - 1] == '\r') {
+			--*term;
+		}
+		if (*term == 0) {
+			return 0;
+		}
+		char before = data[*term - 1];
+		if (before != '\n' && (!cr_breaks || before != '\r')) {
+			return last + 1;
+		}
+		last = *term - 1;
+	}
+}
+
+_Bool _pipeline_fill_file(struct csv_pipeline* self, struct pipeline_job* job)
+{
+	struct blockbuf* block = &self->reader->_in->block;
+	size_t want = self->carry_len + PIPELINE_BLOCK;
+	if (job->buf_size < want) {
+		realloc_(job->buf, want);
+		job->buf_size = want;
+	}
+	if (self->carry_len) {
+		memcpy(job->buf, self->carry, self->carry_len);
+	}
+	size_t len = self->carry_len;
+	self->carry_len = 0;
+
+	job->data = job->buf;
+	job->offset = self->next;
+	job->serial = false;
+
+	for (;;) {
+		while (len < want) {
+			ssize_t n = blockbuf_read(block, job->buf + len, want - len);
+
+			/* The serial parser runs into a read error too */
+			if (n <= 0) {
+				job->serial = (n == -1);
+				job->len = len;
+				self->next += len;
+				return true;
+			}
+			len += n;
+		}
+
+		size_t term = 0;
+		_Bool bail = false;
+		size_t cut = _pipeline_cut(self, job->buf, len, &term, &bail);
+		if (cut) {
+			self->carry_len = len - cut;
+			if (self->carry_size < self->carry_len) {
+				realloc_(self->carry, self->carry_len);
+				self->carry_size = self->carry_len;
+			}
+			memcpy(self->carry, job->buf + cut, self->carry_len);
+			job->len = cut;
+			self->next += cut;
+			return false;
+		}
+
+		if (bail || want >= PIPELINE_BLOCK_MAX) {
+			job->serial = true;
+			job->len = len;
+			self->next += len;
+			return true;
+		}
+
+		/* The record is longer than the block */
+		want *= 2;
+		realloc_(job->buf, want);
+		job->buf_size = want;
+		job->data = job->buf;
+	}
+}
+
+_Bool _pipeline_fill_mmap(struct csv_pipeline* self, struct pipeline_job* job)
+{
+	const char* mmap = self->reader->_in->mmap_ptr;
+	size_t size = self->reader->_in->file_size;
+
+	/* sgetline_mmap steps over the line ending
+	 * that the offset is left on.
+	 */
+	size_t begin = self->next;
+	size_t start = begin;
+	if (start < size && mmap[start] == '\r') {
+		start += 2;
+	} else if (start < size && mmap[start] == '\n') {
+		start += 1;
+	}
+
+	job->data = mmap + begin;
+	job->offset = begin;
+	job->serial = false;
+
+	size_t want = PIPELINE_BLOCK;
+	for (;;) {
+		if (start + want >= size) {
+			job->len = size - begin;
+			self->next = size;
+			return true;
+		}
+
+		size_t term = 0;
+		_Bool bail = false;
+		if (_pipeline_cut(self, mmap + start, want, &term, &bail)) {
+			job->len = start + term - begin;
+			self->next = start + term;
+			return false;
+		}
+
+		if (bail || want >= PIPELINE_BLOCK_MAX) {
+			job->serial = true;
+			job->len = start + want - begin;
+			self->next = start + want;
+			return true;
+		}
+		want *= 2;
+	}
+}
+
+static void* _pipeline_read_main(void* arg)
+{
+	struct csv_pipeline* self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		while (!self->stop && self->submitted - self->written == self->job_count) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if (self->stop) {
+			break;
+		}
+		struct pipeline_job* job = &self->jobs[self->submitted % self->job_count];
+		pthread_mutex_unlock(&self->lock);
+
+		_Bool last = (self->is_mmap) ? _pipeline_fill_mmap(self, job)
+		                             : _pipeline_fill_file(self, job);
+
+		pthread_mutex_lock(&self->lock);
+		job->done = false;
+		++self->submitted;
+		self->finished = last;
+		pthread_cond_broadcast(&self->cond);
+		if (last) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+void _pipeline_parse(struct pipeline_worker* self, struct pipeline_job* job)
+{
+	struct csv_reader* reader = &self->reader;
+
+	string_clear(&job->out);
+	job->failed = false;
+	job->rows = 0;
+	job->breaks = 0;
+	if (job->serial) {
+		job->failed = true;
+		job->resume = job->offset;
+		return;
+	}
+
+	if (reader->_in->is_mmap) {
+		reader->_in->offset = job->offset;
+		reader->_in->file_size = job->offset + job->len;
+	} else {
+		blockbuf_reset(&reader->_in->block, job->offset);
+		blockbuf_push(&reader->_in->block, job->data, job->len);
+	}
+	reader->normal = self->pipe->normal;
+	reader->_in->rows = 0;
+	reader->_in->embedded_breaks = 0;
+
+	/* Anything the worker cannot parse is left to the
+	 * serial parser, from the beginning of the record.
+	 */
+	for (;;) {
+		size_t offset = _pipeline_position(reader);
+		unsigned rows = reader->_in->rows;
+		unsigned breaks = reader->_in->embedded_breaks;
+
+		int ret = csv_get_record_serial(reader, &self->record, UINT_MAX);
+		if (ret == CSV_GOOD) {
+			csv_write_record(&self->writer, &self->record);
+			continue;
+		}
+		if (ret != EOF) {
+			job->failed = true;
+			job->resume = offset;
+			reader->_in->rows = rows;
+			reader->_in->embedded_breaks = breaks;
+		}
+		break;
+	}
+	job->rows = reader->_in->rows;
+	job->breaks = reader->_in->embedded_breaks;
+
+	/* The writer never reaches its threshold, so all
+	 * it wrote is in its buffer. Trade it for the
+	 * job's empty one.
+	 */
+	string out = job->out;
+	job->out = self->writer._in->buffer;
+	self->writer._in->buffer = out;
+}
+
+static void* _pipeline_worker_main(void* arg)
+{
+	struct pipeline_worker* w = arg;
+	struct csv_pipeline* p = w->pipe;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->shutdown && (p->stop || p->taken == p->submitted)) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if (p->shutdown) {
+			break;
+		}
+		struct pipeline_job* job = &p->jobs[p->taken++ % p->job_count];
+		pthread_mutex_unlock(&p->lock);
+
+		_pipeline_parse(w, job);
+
+		pthread_mutex_lock(&p->lock);
+		job->done = true;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+void _pipeline_unread(struct csv_pipeline* self, size_t resume)
+{
+	struct pipeline_job* first = &self->jobs[self->written % self->job_count];
+	size_t skip = resume - first->offset;
+	size_t len = self->carry_len;
+	size_t i = self->written;
+	for (; i < self->submitted; ++i) {
+		len += self->jobs[i % self->job_count].len;
+	}
+	len -= skip;
+
+	char* data = malloc_(len);
+	char* ptr = data;
+	for (i = self->written; i < self->submitted; ++i) {
+		const struct pipeline_job* job = &self->jobs[i % self->job_count];
+		memcpy(ptr, job->data + skip, job->len - skip);
+		ptr += job->len - skip;
+		skip = 0;
+	}
+	if (self->carry_len) {
+		memcpy(ptr, self->carry, self->carry_len);
+	}
+
+	blockbuf_unread(&self->reader->_in->block, data, len);
+	free_(data);
+}
+
+_Bool _pipeline_stage(struct csv_pipeline* self, struct csv_writer* writer, size_t* stop_at)
+{
+	struct csv_reader* reader = self->reader;
+
+	self->submitted = 0;
+	self->taken = 0;
+	self->written = 0;
+	self->carry_len = 0;
+	self->finished = false;
+	self->stop = false;
+	self->next = _pipeline_position(reader);
+	self->normal = reader->normal;
+
+	if (pthread_create(&self->read_thread, NULL, _pipeline_read_main, self)) {
+		*stop_at = SIZE_MAX;
+		return false;
+	}
+
+	struct pipeline_job* job = NULL;
+	for (;;) {
+		pthread_mutex_lock(&self->lock);
+		while (self->written == self->submitted && !self->finished) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if (self->written == self->submitted) {
+			pthread_mutex_unlock(&self->lock);
+			job = NULL;
+			break;
+		}
+		job = &self->jobs[self->written % self->job_count];
+		while (!job->done) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		pthread_mutex_unlock(&self->lock);
+
+		csv_writer_write(writer, job->out.data, job->out.size);
+		reader->_in->rows += job->rows;
+		reader->_in->embedded_breaks += job->breaks;
+		if (job->failed) {
+			break;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		++self->written;
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	/* Stop the reader and wait for the jobs in progress */
+	pthread_mutex_lock(&self->lock);
+	self->stop = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	pthread_join(self->read_thread, NULL);
+
+	pthread_mutex_lock(&self->lock);
+	size_t i = self->written;
+	while (i < self->taken) {
+		if (self->jobs[i % self->job_count].done) {
+			++i;
+		} else {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	if (job == NULL) {
+		if (reader->_in->is_mmap) {
+			csv_reader_seek(reader, reader->_in->file_size);
+		}
+		return true;
+	}
+
+	*stop_at = job->offset + job->len;
+	if (reader->_in->is_mmap) {
+		csv_reader_seek(reader, job->resume);
+	} else {
+		_pipeline_unread(self, job->resume);
+	}
+	return false;
+}
+
+static void _worker_construct(struct csv_pipeline* p,
+                              struct pipeline_worker* w,
+                              struct csv_writer* writer)
+{
+	struct csv_reader* self = p->reader;
+	w->pipe = p;
+
+	struct csv_reader* reader = csv_reader_construct(&w->reader);
+	csv_reader_set_delim(reader, string_c_str(&self->_in->delim));
+	csv_reader_set_embedded_break(reader, string_c_str(&self->_in->embedded_break));
+	reader->quotes = self->quotes;
+	reader->trim = self->trim;
+	reader->_in->max_newlines = self->_in->max_newlines;
+	csv_reader_set_columns(reader, self->_in->columns.data, self->_in->columns.size);
+	reader->_in->quiet = true;
+	if (p->is_mmap) {
+		reader->_in->mmap_ptr = self->_in->mmap_ptr;
+		reader->_in->is_mmap = true;
+	} else {
+		reader->_in->block.fd = -1;
+		blockbuf_close(&reader->_in->block);
+	}
+	csv_record_construct(&w->record);
+
+	struct csv_writer* out = csv_writer_construct(&w->writer);
+	out->quotes = writer->quotes;
+	csv_writer_set_delim(out, string_c_str(&writer->_in->delim));
+	csv_writer_set_line_ending(out, string_c_str(&writer->_in->rec_terminator));
+	csv_writer_set_buffer(out, SIZE_MAX);
+}
+
+static void _worker_destroy(struct pipeline_worker* w)
+{
+	csv_writer_destroy(&w->writer);
+	csv_record_destroy(&w->record);
+	csv_reader_destroy(&w->reader);
+}
+
+struct csv_pipeline* _pipeline_new(struct csv_reader* reader,
+                                   struct csv_writer* writer,
+                                   unsigned threads)
+{
+	struct csv_pipeline* self = malloc_(sizeof(*self));
+	*self = (struct csv_pipeline) {
+	        .reader = reader,
+	        .job_count = 2 * threads,
+	        .max_breaks = reader->_in->max_newlines,
+	        .delim = string_c_str(&reader->_in->delim)[0],
+	        .quotes = (reader->quotes != QUOTE_NONE),
+	        .is_mmap = reader->_in->is_mmap,
+	};
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	self->jobs = malloc_(self->job_count * sizeof(*self->jobs));
+	memset(self->jobs, 0, self->job_count * sizeof(*self->jobs));
+	unsigned i = 0;
+	for (; i < self->job_count; ++i) {
+		string_construct(&self->jobs[i].out);
+	}
+
+	self->workers = malloc_(threads * sizeof(*self->workers));
+	for (; self->worker_count < threads; ++self->worker_count) {
+		struct pipeline_worker* w = &self->workers[self->worker_count];
+		_worker_construct(self, w, writer);
+		if (pthread_create(&w->thread, NULL, _pipeline_worker_main, w)) {
+			_worker_destroy(w);
+			break;
+		}
+	}
+
+	if (self->worker_count == 0) {
+		_pipeline_free(self);
+		return NULL;
+	}
+	return self;
+}
+
+void _pipeline_free(struct csv_pipeline* self)
+{
+	pthread_mutex_lock(&self->lock);
+	self->shutdown = true;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	unsigned i = 0;
+	for (; i < self->worker_count; ++i) {
+		pthread_join(self->workers[i].thread, NULL);
+		_worker_destroy(&self->workers[i]);
+	}
+	for (i = 0; i < self->job_count; ++i) {
+		free_if_exists_(self->jobs[i].buf);
+		string_destroy(&self->jobs[i].out);
+	}
+	free_if_exists_(self->carry);
+	free_(self->jobs);
+	free_(self->workers);
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free_(self);
+}
+
+int csv_pipeline(struct csv_reader* reader, struct csv_writer* writer, unsigned threads)
+{
+	struct csv_record* rec = csv_record_new();
+	int ret = CSV_GOOD;
+
+	/* The first record is read serially, so the delimiter
+	 * and normal field count are known to the workers.
+	 */
+	_Bool pipelined = (threads > 1 && reader->_in->window == 0
+	                   && (reader->_in->is_mmap || reader->_in->block.fd != -1));
+	if (pipelined) {
+		csv_parallel_stop(reader);
+		ret = csv_get_record_serial(reader, rec, UINT_MAX);
+		if (ret == CSV_GOOD) {
+			csv_write_record(writer, rec);
+		}
+		pipelined = _pipeline_can_split(reader);
+	}
+
+	struct csv_pipeline* self = NULL;
+	if (ret == CSV_GOOD && pipelined) {
+		self = _pipeline_new(reader, writer, threads);
+	}
+
+	/* After a block a worker stopped in, parse serially
+	 * to the end of it and start the pipeline again.
+	 */
+	size_t stop_at = 0;
+	while (self && !_pipeline_stage(self, writer, &stop_at) && stop_at != SIZE_MAX) {
+		do {
+			ret = csv_get_record_serial(reader, rec, UINT_MAX);
+			if (ret == CSV_GOOD) {
+				csv_write_record(writer, rec);
+			}
+		} while (ret == CSV_GOOD && _pipeline_position(reader) < stop_at);
+		if (ret != CSV_GOOD) {
+			break;
+		}
+	}
+	if (self) {
+		_pipeline_free(self);
+	}
+
+	while (ret == CSV_GOOD && (ret = csv_get_record(reader, rec)) == CSV_GOOD) {
+		csv_write_record(writer, rec);
+	}
+	csv_record_free(rec);
+
+	return ret;
+}
@@ -5,12 +5,16 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include "csv.h"
 #include "csvsignal.h"
 #include "csverror.h"
+#include "decompress.h"
 #include "safegetline.h"
 #include "internal.h"
 #include "misc.h"
+#include "parallel.h"
+#include "simd.h"
 #include "util/vec.h"
 #include "util/stringy.h"
 #include "util/stringview.h"
@@ -20,34 +24,144 @@
  * Internal prototypes
  */
 
-/**
- * csv_determine_delimiter chooses between comma, pipe, semi-colon,
- * colon or tab depending on which  one is found most. If none of
- * these delimiters are found, use comma. If self->delimiter was set
- * externally, simply update self->_in->delimlen and return.
- */
-void csv_determine_delimiter(struct csv_reader*, const char* header, unsigned byte_limit);
-
 /**
  * csv_record_grow allocates space for the fields
  * member (char**) of the csv_record struct
  */
 void csv_record_grow(struct csv_record*);
 
+/**
+ * Point the current field at what was copied into the
+ * arena since `start'. `base' is where the arena was
+ * when the copy began. If it has grown since, fields
+ * copied before are pointed at it again.
+ */
+void _set_field_owned(struct csv_record*, const char* base, size_t start);
+
 /**
  * csv_append_line is used to retrieve another line
  * of input for an in-line break.
  */
 int csv_append_line(struct csv_reader* self, struct csv_record*);
 
+/**
+ * Read and parse one record from the file or mmap
+ */
+int _read_record(struct csv_reader*, struct csv_record*, unsigned field_limit);
+
+/* Report why the input could not be read. Returns CSV_FAIL. */
+int _read_fail(struct csv_reader*);
+
+/**
+ * Release the mmap before `rec_offset' once it is a
+ * whole window behind, and advise the next window.
+ */
+void _slide_window(struct csv_reader*, size_t rec_offset);
+
+/**
+ * Hand every complete record in the pushed
+ * data to the callback.
+ */
+int _feed_records(struct csv_reader*);
+
+/**
+ * Close the input of an earlier open so that the
+ * reader can be used for another file.
+ */
+int _reader_reopen(struct csv_reader*);
+
+/* Parse loops are written once, taking their mode as
+ * constant arguments, and inlined into one specialized
+ * copy per mode. See _bind_parser.
+ */
+#define PARSE_INLINE_ static inline __attribute__((always_inline))
+
+/**
+ * Pick the parser specialized for the reader's quote
+ * style, trimming and delimiter. Checked once per record
+ * because these are public members that can change at
+ * any time, including under failsafe mode.
+ */
+void _bind_parser(struct csv_reader*);
+
+/**
+ * Parse a line using the structural index built by
+ * simd_index_fields. Returns SIMD_BAIL if the line
+ * must be handed to the field by field parsers instead.
+ */
+PARSE_INLINE_ int csv_parse_indexed(struct csv_reader*,
+                                    struct csv_record*,
+                                    const char* line,
+                                    unsigned byte_limit,
+                                    unsigned field_limit,
+                                    const int quotes);
+
+/**
+ * Field by field parsing that supports every quote
+ * style, trimming and embedded line breaks.
+ */
+PARSE_INLINE_ int csv_parse_scalar(struct csv_reader*,
+                                   struct csv_record*,
+                                   const char* line,
+                                   unsigned byte_limit,
+                                   unsigned field_limit,
+                                   const int quotes,
+                                   const _Bool trim,
+                                   const _Bool single);
+
+/**
+ * True unless columns were selected with
+ * csv_reader_set_columns and `idx' is not one
+ */
+_Bool _column_selected(struct csv_reader*, unsigned idx);
+
+/**
+ * Rearrange the parsed fields of `rec' into
+ * the columns chosen by csv_reader_set_columns.
+ */
+void _project_record(struct csv_reader*, struct csv_record*, unsigned field_limit);
+
+/**
+ * Make room for `size' bytes in the arena, doubling
+ * it so a record of many copied fields does not
+ * reallocate for each one.
+ */
+PARSE_INLINE_ void _arena_reserve(string* arena, size_t size);
+
+/**
+ * Point the current field at [begin, end) of the
+ * record rather than copying it into the arena.
+ */
+PARSE_INLINE_ void _set_field_view(struct csv_record*,
+                                   const char* begin,
+                                   const char* end,
+                                   const _Bool trim);
+
+/**
+ * Next delimiter in [ptr, ptr + len) or NULL. `single'
+ * means the delimiter is one byte long.
+ */
+PARSE_INLINE_ const char*
+_find_delim(struct csv_reader*, const char* ptr, size_t len, const _Bool single);
+
+/**
+ * True if `ptr' is at a delimiter or the end of the record
+ */
+PARSE_INLINE_ _Bool _is_field_end(struct csv_reader*,
+                                  const char* ptr,
+                                  const char* rec_end,
+                                  const _Bool single);
+
 /**
  * Simple CSV parsing. Disregard all quotes.
  */
-int csv_parse_none(struct csv_reader*,
-                   struct csv_record*,
-                   const char** line,
-                   size_t* recidx,
-                   unsigned* byte_limit);
+PARSE_INLINE_ int csv_parse_none(struct csv_reader*,
+                                 struct csv_record*,
+                                 const char** line,
+                                 size_t* recidx,
+                                 unsigned* byte_limit,
+                                 const _Bool trim,
+                                 const _Bool single);
 
 /**
  * Parse line respecting quotes. Quotes within
@@ -55,21 +169,24 @@ int csv_parse_none(struct csv_reader*,
  * Leading spaces will cause the field to not
  * be treated as qualified.
  */
-int csv_parse_weak(struct csv_reader*,
-                   struct csv_record*,
-                   const char** line,
-                   size_t* recidx,
-                   unsigned* byte_limit);
+PARSE_INLINE_ int csv_parse_weak(struct csv_reader*,
+                                 struct csv_record*,
+                                 const char** line,
+                                 size_t* recidx,
+                                 unsigned* byte_limit,
+                                 const _Bool trim);
 
 /**
  * Parse line according to RFC-4180 guidelines.
  * More info: https://tools.ietf.org/html/rfc4180
  */
-int csv_parse_rfc4180(struct csv_reader* self,
-                      struct csv_record*,
-                      const char** line,
-                      size_t* recidx,
-                      unsigned* byte_limit);
+PARSE_INLINE_ int csv_parse_rfc4180(struct csv_reader* self,
+                                    struct csv_record*,
+                                    const char** line,
+                                    size_t* recidx,
+                                    unsigned* byte_limit,
+                                    const _Bool trim,
+                                    const _Bool single);
 
 struct csv_reader* csv_reader_new()
 {
@@ -77,6 +194,25 @@ struct csv_reader* csv_reader_new()
 	return csv_reader_construct(reader);
 }
 
+struct csv_reader* csv_reader_new_like(const struct csv_reader* other)
+{
+	struct csv_reader* reader = csv_reader_new();
+	csv_reader_set_delim(reader, string_c_str(&other->_in->delim));
+	csv_reader_set_embedded_break(reader, string_c_str(&other->_in->embedded_break));
+	csv_reader_set_columns(reader, other->_in->columns.data, other->_in->columns.size);
+	reader->quotes = other->quotes;
+	reader->normal = other->normal;
+	reader->failsafe_mode = other->failsafe_mode;
+	reader->trim = other->trim;
+	reader->_in->normorg = other->_in->normorg;
+	reader->_in->threads = other->_in->threads;
+	reader->_in->window = other->_in->window;
+	reader->_in->max_newlines = other->_in->max_newlines;
+	reader->_in->failsafe_incremental = other->_in->failsafe_incremental;
+	reader->_in->quiet = other->_in->quiet;
+	return reader;
+}
+
 struct csv_reader* csv_reader_construct(struct csv_reader* reader)
 {
 	init_sig();
@@ -88,11 +224,18 @@ struct csv_reader* csv_reader_construct(struct csv_reader* reader)
 	*reader->_in = (struct csv_read_internal) {
 	        .file = stdin,
 	        .fd = -1,
+	        .max_newlines = CSV_MAX_NEWLINES,
 	};
 
 	string_construct(&reader->_in->delim);
 	string_construct(&reader->_in->weak_delim);
 	string_construct_from_char_ptr(&reader->_in->embedded_break, "\n");
+	vec_construct_(&reader->_in->field_ends, unsigned);
+	vec_construct_(&reader->_in->columns, unsigned);
+	vec_construct_(&reader->_in->selected, _Bool);
+	vec_construct_(&reader->_in->projected, struct csv_field);
+	vec_construct_(&reader->_in->row_marks, struct csv_row_mark);
+	blockbuf_construct(&reader->_in->block, STDIN_FILENO);
 
 	return reader;
 }
@@ -105,10 +248,26 @@ void csv_reader_free(struct csv_reader* self)
 
 void csv_reader_destroy(struct csv_reader* self)
 {
-	csv_perror();
+	/* Worker readers have nothing of their own to report,
+	 * and the queue belongs to the caller.
+	 */
+	if (!self->_in->quiet) {
+		csv_perror();
+	}
+	csv_parallel_stop(self);
+	csv_decompress_stop(self);
 	string_destroy(&self->_in->delim);
 	string_destroy(&self->_in->weak_delim);
 	string_destroy(&self->_in->embedded_break);
+	vec_destroy(&self->_in->field_ends);
+	vec_destroy(&self->_in->columns);
+	vec_destroy(&self->_in->selected);
+	vec_destroy(&self->_in->projected);
+	vec_destroy(&self->_in->row_marks);
+	blockbuf_destroy(&self->_in->block);
+	if (self->_in->feed_record) {
+		csv_record_free(self->_in->feed_record);
+	}
 	free_(self->_in);
 }
 
@@ -152,17 +311,112 @@ void csv_reader_set_embedded_break(struct csv_reader* self, const char* embedded
 	string_strcpy(&self->_in->embedded_break, embedded_break);
 }
 
-void csv_record_grow(struct csv_record* self)
+void csv_reader_set_threads(struct csv_reader* self, unsigned threads)
 {
-	string* s = vec_add_one(self->_in->field_data);
-	string_construct(s);
-	++self->_in->field_alloc;
+	self->_in->threads = threads;
+}
+
+void csv_reader_set_columns(struct csv_reader* self, const unsigned* idx, unsigned n)
+{
+	vec_clear(&self->_in->columns);
+	vec_clear(&self->_in->selected);
+	if (idx == NULL) {
+		return;
+	}
+
+	vec_append(&self->_in->columns, idx, n);
 
-	struct csv_field field = {s->data, s->size};
+	unsigned i = 0;
+	for (; i < n; ++i) {
+		if (idx[i] >= self->_in->selected.size) {
+			vec_resize_and_zero(&self->_in->selected, idx[i] + 1);
+		}
+		_Bool* selected = vec_at(&self->_in->selected, idx[i]);
+		*selected = true;
+	}
+}
+
+void csv_reader_set_mmap_window(struct csv_reader* self, size_t bytes)
+{
+	self->_in->window = bytes;
+}
+
+void csv_reader_set_failsafe_incremental(struct csv_reader* self, bool incremental)
+{
+	self->_in->failsafe_incremental = incremental;
+}
+
+void csv_reader_set_max_newlines(struct csv_reader* self, unsigned max_newlines)
+{
+	self->_in->max_newlines = (max_newlines) ? max_newlines : UINT_MAX;
+}
+
+void csv_reader_set_callback(struct csv_reader* self, csv_record_fn fn, void* data)
+{
+	self->_in->record_fn = fn;
+	self->_in->record_data = data;
+}
+
+void csv_record_grow(struct csv_record* self)
+{
+	struct csv_field field = {"", 0};
 	vec_push_back(self->_in->_fields, &field);
+	++self->_in->field_alloc;
 	self->fields = vec_begin(self->_in->_fields);
 }
 
+void csv_record_reserve(struct csv_record* self, unsigned n)
+{
+	vec_reserve(self->_in->_fields, n);
+	while (self->_in->field_alloc < n) {
+		csv_record_grow(self);
+	}
+}
+
+void csv_record_rebase(struct csv_record* self,
+                       const char* begin,
+                       const char* end,
+                       const char* to)
+{
+	uintptr_t lo = (uintptr_t)begin;
+	uintptr_t hi = (uintptr_t)end;
+	unsigned i = 0;
+	for (; i < self->_in->_fields->size; ++i) {
+		struct csv_field* field = &self->fields[i];
+		uintptr_t at = (uintptr_t)field->data;
+		if (at >= lo && at <= hi) {
+			field->data = to + (at - lo);
+		}
+	}
+}
+
+PARSE_INLINE_ void _arena_reserve(string* arena, size_t size)
+{
+	if (size >= arena->_alloc) {
+		vec_reserve(arena, 2 * size);
+	}
+}
+
+void _set_field_owned(struct csv_record* rec, const char* base, size_t start)
+{
+	string* arena = &rec->_in->arena;
+	vec* owned = &rec->_in->owned;
+	if (arena->data != base) {
+		unsigned i = 0;
+		for (; i < owned->size; ++i) {
+			const struct csv_owned_field* it = vec_at(owned, i);
+			rec->fields[it->index].data = (const char*)arena->data + it->offset;
+		}
+	}
+
+	struct csv_owned_field add = {rec->size - 1, start};
+	vec_push_back(owned, &add);
+
+	struct csv_field* field = &rec->fields[rec->size - 1];
+	field->data = (const char*)arena->data + start;
+	field->len = arena->size - start;
+}
+
 int csv_get_record(struct csv_reader* self, struct csv_record* rec)
 {
 	return csv_get_record_to(self, rec, UINT_MAX);
@@ -172,16 +426,98 @@ int csv_get_record_to(struct csv_reader* self,
                       struct csv_record* rec,
                       unsigned field_limit)
 {
+	if (self->_in->parallel) {
+		int ret = csv_parallel_get_record(self, rec, field_limit);
+		if (ret == CSV_GOOD && self->_in->window) {
+			_slide_window(self, rec->rec - self->_in->mmap_ptr);
+		}
+		return ret;
+	}
+
+	int ret = csv_get_record_serial(self, rec, field_limit);
+	if (ret == CSV_GOOD && self->_in->window && self->_in->is_mmap) {
+		_slide_window(self, rec->rec - self->_in->mmap_ptr);
+	}
+
+	/* The first record is always read serially so the
+	 * delimiter and normal field count are known before
+	 * the workers start on the rest of the file.
+	 */
+	if (ret == CSV_GOOD && self->_in->threads > 1 && self->_in->is_mmap) {
+		if (csv_parallel_start(self) == CSV_FAIL) {
+			self->_in->threads = 1;
+		}
+	}
+
+	return ret;
+}
+
+void _slide_window(struct csv_reader* self, size_t rec_offset)
+{
+	size_t window = self->_in->window;
+	if (rec_offset < self->_in->released + window) {
+		return;
+	}
+
+	/* Records already handed out point into the map. That is
+	 * fine. Private, unwritten pages are simply read again.
+	 */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t end = rec_offset - rec_offset % page;
+	madvise(self->_in->mmap_ptr + self->_in->released,
+	        end - self->_in->released,
+	        MADV_DONTNEED);
+	self->_in->released = end;
+
+	if (window > self->_in->file_size - end) {
+		window = self->_in->file_size - end;
+	}
+	madvise(self->_in->mmap_ptr + end, window, MADV_WILLNEED);
+}
+
+int csv_get_record_serial(struct csv_reader* self,
+                          struct csv_record* rec,
+                          unsigned field_limit)
+{
+	if (!self->_in->failsafe_incremental) {
+		return _read_record(self, rec, field_limit);
+	}
+
+	/* Retry a bad record under lower standards,
+	 * then go back to the original for the next.
+	 */
+	enum quote_style quotes = self->quotes;
+	size_t offset = self->_in->offset;
+	unsigned breaks = self->_in->embedded_breaks;
+
 	int ret = 0;
-	if (self->_in->is_mmap) {
-		/* sgetline allocates memory into rec, and sgetline_mmap
-		 * references an mmaped file. If a record was used on
-		 * sgetline first, it will have allocated memory in 
-		 * rec->rec.  Free that first. */
-		if (rec->_in->rec_alloc > 0) {
-			rec->_in->rec_alloc = 0;
-			free_(rec->rec);
+	while ((ret = _read_record(self, rec, field_limit)) == CSV_RESET) {
+		self->_in->embedded_breaks = breaks;
+		if (self->_in->is_mmap) {
+			self->_in->offset = offset;
+		} else {
+			blockbuf_rewind(&self->_in->block);
 		}
+	}
+
+	self->quotes = quotes;
+	return ret;
+}
+
+int _read_record(struct csv_reader* self, struct csv_record* rec, unsigned field_limit)
+{
+	int ret = 0;
+
+	/* sgetline allocates memory into rec, but sgetline_mmap
+	 * and sgetline_block reference memory owned by the reader.
+	 * If a record was used on sgetline first, it will have
+	 * allocated memory in rec->rec.  Free that first. */
+	if (rec->_in->rec_alloc > 0) {
+		rec->_in->rec_alloc = 0;
+		free_(rec->rec);
+	}
+
+	if (self->_in->is_mmap) {
 		ret = sgetline_mmap(self->_in->mmap_ptr,
 		                    &rec->rec,
 		                    &self->_in->offset,
@@ -189,26 +525,56 @@ int csv_get_record_to(struct csv_reader* self,
 		                    self->_in->file_size);
 		self->offset = self->_in->offset;
 	} else {
-		ret = sgetline(self->_in->file,
-		               &rec->rec,
-		               &rec->_in->rec_alloc,
-		               &rec->reclen);
-		if (self->_in->file != stdin) {
-			self->offset = ftello(self->_in->file);
+		ret = sgetline_block(&self->_in->block, &rec->rec, &rec->reclen);
+		if (self->_in->file != stdin || self->_in->block.fd == -1) {
+			self->offset = blockbuf_offset(&self->_in->block);
 		}
 	}
 
+	if (ret == SGETLINE_STARVED) {
+		return ret;
+	}
+
+	if (ret == CSV_FAIL) {
+		return _read_fail(self);
+	}
+
 	if (ret == EOF) {
 		self->normal = self->_in->normorg;
 		return ret;
 	}
 
-	return csv_nparse_to(self, rec, rec->rec, rec->reclen, field_limit);
+	ret = csv_nparse_to(self, rec, rec->rec, rec->reclen, field_limit);
+
+	/* The record continues in data not pushed yet */
+	if (self->_in->starved) {
+		self->_in->starved = false;
+		return SGETLINE_STARVED;
+	}
+
+	return ret;
+}
+
+int _read_fail(struct csv_reader* self)
+{
+	try_(csv_decompress_error(self));
+	csvfail_if_(true, "read");
+	return CSV_FAIL;
 }
 
 int csv_lowerstandard(struct csv_reader* self)
 {
-	if (!self->failsafe_mode || (self->_in->file == stdin && !self->_in->is_mmap)) {
+	/* Worker readers leave reporting to the serial parser */
+	if (self->_in->quiet) {
+		return CSV_FAIL;
+	}
+
+	/* Incremental failsafe re-reads the record from memory,
+	 * so stdin is fine.
+	 */
+	_Bool can_reset = (self->_in->file != stdin || self->_in->is_mmap
+	                   || self->_in->failsafe_incremental);
+	if (!self->failsafe_mode || !can_reset) {
 		switch (self->quotes) {
 		case QUOTE_ALL:
 		case QUOTE_RFC4180:
@@ -228,17 +594,20 @@ int csv_lowerstandard(struct csv_reader* self)
 		return CSV_FAIL;
 	}
 
+	const char* scope = (self->_in->failsafe_incremental) ? " for this record" : "";
 	switch (self->quotes) {
 	case QUOTE_ALL:
 	case QUOTE_RFC4180:
 		fprintf(stderr,
-		        "Line %d: Qualifier issue. RFC4180 quotes disabled.\n",
-		        1 + self->_in->rows + self->_in->embedded_breaks);
+		        "Line %d: Qualifier issue. RFC4180 quotes disabled%s.\n",
+		        1 + self->_in->rows + self->_in->embedded_breaks,
+		        scope);
 		break;
 	case QUOTE_WEAK:
 		fprintf(stderr,
-		        "Line %d: Qualifier issue. Quotes disabled.\n",
-		        1 + self->_in->rows + self->_in->embedded_breaks);
+		        "Line %d: Qualifier issue. Quotes disabled%s.\n",
+		        1 + self->_in->rows + self->_in->embedded_breaks,
+		        scope);
 		break;
 	default:
 		fputs("Unexpected Condition.\n", stderr);
@@ -246,6 +615,9 @@ int csv_lowerstandard(struct csv_reader* self)
 	}
 
 	--self->quotes;
+	if (self->_in->failsafe_incremental) {
+		return CSV_RESET;
+	}
 	//self->_in->rows = 0;
 	//self->_in->embedded_breaks = 0;
 	//fseek(self->_in->file, 0, SEEK_SET);
@@ -300,42 +672,79 @@ int csv_nparse_to(struct csv_reader* self,
 	if (string_empty(&self->_in->delim))
 		csv_determine_delimiter(self, line, byte_limit);
 
+	/* With columns selected, every field still has to be
+	 * scanned to find where the record ends, but only the
+	 * selected ones are copied.
+	 */
+	unsigned parse_limit = field_limit;
+	if (!vec_empty(&self->_in->columns)) {
+		parse_limit = UINT_MAX;
+	}
+
+	_bind_parser(self);
+
+	/* Copies from the last record are no longer needed */
+	string_clear(&rec->_in->arena);
+	vec_clear(&rec->_in->owned);
+	if (self->normal > 0) {
+		csv_record_reserve(rec, self->normal);
+	}
+
 	rec->size = 0;
-	size_t recidx = 0;
-	int ret = 0;
+	int ret = self->_in->parse(self, rec, line, byte_limit, parse_limit);
+	if (ret != CSV_GOOD) {
+		return ret;
+	}
 
-	while (recidx < byte_limit && (unsigned)rec->size < field_limit) {
-		if (rec->size > 0) {
-			recidx += self->_in->delim.size;
-		}
-		csv_append_empty_field(rec);
+	if (!vec_empty(&self->_in->columns)) {
+		_project_record(self, rec, field_limit);
+	}
 
-		int quotes = self->quotes;
-		if (quotes != QUOTE_NONE && line[recidx] != '"') {
-			quotes = QUOTE_NONE;
-		}
+	csv_finish_record(self, rec);
+	return 0;
+}
 
-		switch (quotes) {
-		case QUOTE_ALL:
-			/* Not seeing a point to implementing this for reading. */
-		case QUOTE_RFC4180:
-			ret = csv_parse_rfc4180(self, rec, &line, &recidx, &byte_limit);
-			break;
-		case QUOTE_WEAK:
-			ret = csv_parse_weak(self, rec, &line, &recidx, &byte_limit);
-			break;
-		case QUOTE_NONE:
-			ret = csv_parse_none(self, rec, &line, &recidx, &byte_limit);
-			break;
-		}
+_Bool _column_selected(struct csv_reader* self, unsigned idx)
+{
+	if (vec_empty(&self->_in->columns)) {
+		return true;
+	}
+	if (idx >= self->_in->selected.size) {
+		return false;
+	}
+	return ((_Bool*)self->_in->selected.data)[idx];
+}
 
-		if (ret == CSV_RESET) {
-			ret = csv_lowerstandard(self);
-			csv_reader_reset(self);
-			return ret;
+void _project_record(struct csv_reader* self, struct csv_record* rec, unsigned field_limit)
+{
+	static const struct csv_field missing = {"", 0};
+
+	unsigned n = self->_in->columns.size;
+	if (n > field_limit) {
+		n = field_limit;
+	}
+
+	vec_clear(&self->_in->projected);
+	const unsigned* columns = vec_begin(&self->_in->columns);
+	unsigned i = 0;
+	for (; i < n; ++i) {
+		const struct csv_field* field = &missing;
+		if (columns[i] < (unsigned)rec->size) {
+			field = &rec->fields[columns[i]];
 		}
+		vec_push_back(&self->_in->projected, field);
 	}
 
+	rec->size = 0;
+	const struct csv_field* projected = vec_begin(&self->_in->projected);
+	for (i = 0; i < n; ++i) {
+		csv_append_empty_field(rec);
+		rec->fields[i] = projected[i];
+	}
+}
+
+void csv_finish_record(struct csv_reader* self, struct csv_record* rec)
+{
 	if (self->normal > 0) {
 		/* Append fields if we are short */
 		while (self->normal > rec->size)
@@ -347,58 +756,106 @@ int csv_nparse_to(struct csv_reader* self,
 		self->normal = rec->_in->field_alloc;
 
 	++self->_in->rows;
-	return 0;
 }
 
-int csv_append_line(struct csv_reader* self, struct csv_record* rec)
+/* Copy spans between quotes in bulk to the end of the
+ * arena. A quote is only kept if it directly follows a
+ * closing quote.
+ */
+void _unescape_rfc4180(string* field_data, const char* begin, const char* end)
 {
-	int ret = 0;
+	_arena_reserve(field_data, field_data->size + (end - begin));
 
-	const char* old_rec = rec->rec;
-	if (self->_in->is_mmap) {
-		ret = sappline_mmap(self->_in->mmap_ptr,
-		                    &rec->rec,
-		                    &self->_in->offset,
-		                    &rec->reclen,
-		                    self->_in->file_size);
-	} else {
-		ret = sappline(self->_in->file,
-		               &rec->rec,
-		               &rec->_in->rec_alloc,
-		               &rec->reclen);
+	_Bool qualified = true;
+	const char* ptr = begin;
+	while (ptr < end) {
+		const char* quote = memchr(ptr, '"', end - ptr);
+		if (quote == NULL) {
+			quote = end;
+		}
+		struct stringview span = {ptr, quote - ptr};
+		string_append_stringview(field_data, &span);
+		if (quote == end) {
+			break;
+		}
+
+		qualified = !qualified;
+		ptr = quote + 1;
+		if (!qualified && ptr < end && *ptr == '"') {
+			string_push_back(field_data, '"');
+			qualified = true;
+			++ptr;
+		}
 	}
+}
 
-	if (old_rec == rec->rec) {
-		return ret;
+PARSE_INLINE_ void _set_field_view(struct csv_record* rec,
+                                   const char* begin,
+                                   const char* end,
+                                   const _Bool trim)
+{
+	if (trim) {
+		while (begin < end && isspace(*begin))
+			++begin;
+		while (end > begin && isspace(*(end - 1)))
+			--end;
 	}
 
-	/* If we have reached this spot, there was a realloc
-	 * that moved the location of the record.  Any fields
-	 * that were pointing to the record are now invalid
-	 * and must be fixed.
-	 */
-	unsigned i = 0;
-	for (; i < rec->_in->_fields->size; ++i) {
-		struct csv_field* field = vec_at(rec->_in->_fields, i);
-		string* field_data = vec_at(rec->_in->field_data, i);
-		if (field->data == field_data->data) {
-			continue;
-		}
-		size_t offset = field->data - old_rec;
-		field->data = rec->rec + offset;
+	struct csv_field* field = vec_at(rec->_in->_fields, rec->size - 1);
+	field->data = begin;
+	field->len = end - begin;
+}
+
+PARSE_INLINE_ const char*
+_find_delim(struct csv_reader* self, const char* ptr, size_t len, const _Bool single)
+{
+	if (single) {
+		return memchr(ptr, *(const char*)self->_in->delim.data, len);
 	}
+	return memmem(ptr, len, self->_in->delim.data, self->_in->delim.size);
+}
 
-	return ret;
+PARSE_INLINE_ _Bool _is_field_end(struct csv_reader* self,
+                                  const char* ptr,
+                                  const char* rec_end,
+                                  const _Bool single)
+{
+	if (ptr == rec_end) {
+		return true;
+	}
+	if (single) {
+		return *ptr == *(const char*)self->_in->delim.data;
+	}
+	return ((size_t)(rec_end - ptr) >= self->_in->delim.size
+	        && !memcmp(ptr, self->_in->delim.data, self->_in->delim.size));
 }
 
-int csv_parse_rfc4180(struct csv_reader* self,
-                      struct csv_record* rec,
-                      const char** line,
-                      size_t* recidx,
-                      unsigned* byte_limit)
+PARSE_INLINE_ int csv_parse_rfc4180(struct csv_reader* self,
+                                    struct csv_record* rec,
+                                    const char** line,
+                                    size_t* recidx,
+                                    unsigned* byte_limit,
+                                    const _Bool trim,
+                                    const _Bool single)
 {
-	string* field_data = vec_at(rec->_in->field_data, rec->size - 1);
-	string_clear(field_data);
+	/* If the first quote we find closes the field, there
+	 * is nothing to unescape. No need to copy anything.
+	 * Trimming around embedded delimiters is left to the
+	 * loop below.
+	 */
+	const char* content = &(*line)[*recidx + 1];
+	const char* rec_end = &(*line)[*byte_limit];
+	const char* close = memchr(content, '"', rec_end - content);
+	if (close != NULL && _is_field_end(self, close + 1, rec_end, single)
+	    && (!trim || !_find_delim(self, content, close - content, single))) {
+		_set_field_view(rec, content, close, trim);
+		*recidx += (close + 1) - (content - 1);
+		return CSV_GOOD;
+	}
+
+	string* field_data = &rec->_in->arena;
+	const char* base = field_data->data;
+	size_t start = field_data->size;
 
 	unsigned trailing_space = 0;
 	unsigned nl_count = 0;
@@ -408,19 +865,16 @@ int csv_parse_rfc4180(struct csv_reader* self,
 	_Bool qualified = true;
 	_Bool delim_skip = false;
 
+	const unsigned delimlen = (single) ? 1 : self->_in->delim.size;
 	const char* begin = &(*line)[++(*recidx)];
 	const char* ptr = begin;
 	const char* end = NULL;
-	const char* rec_end = &(*line)[*byte_limit];
 
 	for (;;) {
-		for (; qualified && end != rec_end; ptr = end + self->_in->delim.size) {
-			end = memmem(ptr,
-			             *byte_limit - *recidx,
-			             self->_in->delim.data,
-			             self->_in->delim.size);
+		for (; qualified && end != rec_end; ptr = end + delimlen) {
+			end = _find_delim(self, ptr, rec_end - ptr, single);
 
-			if (!delim_skip && ptr != begin) {
+			if (!delim_skip && ptr != begin && !self->_in->skip_field) {
 				string_append(field_data, &self->_in->delim);
 			}
 
@@ -428,7 +882,9 @@ int csv_parse_rfc4180(struct csv_reader* self,
 			if (delim_skip) {
 				end = rec_end;
 			}
-			vec_reserve(field_data, end - begin);
+			if (!self->_in->skip_field) {
+				_arena_reserve(field_data, start + (end - begin));
+			}
 
 			const char* it = ptr;
 			for (; it < end; ++it) {
@@ -445,13 +901,14 @@ int csv_parse_rfc4180(struct csv_reader* self,
 						keep = false;
 					last_was_quote = false;
 				}
-				if (!keep || (first_char && self->trim && isspace(*it))) {
+				if (!keep || self->_in->skip_field
+				    || (first_char && trim && isspace(*it))) {
 					continue;
 				}
 				string_push_back(field_data, *it);
 
 				first_char = false;
-				if (self->trim && isspace(*it))
+				if (trim && isspace(*it))
 					++trailing_space;
 				else
 					trailing_space = 0;
@@ -462,31 +919,37 @@ int csv_parse_rfc4180(struct csv_reader* self,
 			break;
 
 		/** In-line break found **/
-		if (qualified && !rec->_in->rec_alloc && !self->_in->is_mmap) {
+		if (qualified && *line != rec->rec) {
 			return CSV_RESET;
 		}
 
-		if (++nl_count > CSV_MAX_NEWLINES) {
+		if (++nl_count > self->_in->max_newlines) {
 			return CSV_RESET;
 		}
 		int ret = csv_append_line(self, rec);
-		string_append(field_data, &self->_in->embedded_break);
+		if (ret == CSV_FAIL) {
+			return ret;
+		}
+		if (!self->_in->skip_field) {
+			string_append(field_data, &self->_in->embedded_break);
+		}
 		if (ret == EOF) {
 			return CSV_RESET;
 		}
 		*line = rec->rec;
 		begin = &(*line)[*recidx];
-		ptr = &(*line)[*byte_limit + 1];
+		/* An mmap keeps the "\r\n" between the lines */
+		ptr = &(*line)[*byte_limit + 1 + ((*line)[*byte_limit] == '\r')];
 		*byte_limit = rec->reclen;
 		rec_end = &(*line)[*byte_limit];
+		/* The line may have moved under the old end */
+		end = NULL;
 	}
 
 	if (trailing_space) {
 		string_resize(field_data, field_data->size - trailing_space);
 	}
-	struct csv_field* field = vec_at(rec->_in->_fields, rec->size - 1);
-	field->data = field_data->data;
-	field->len = field_data->size;
+	_set_field_owned(rec, base, start);
 
 	*recidx += (end - begin);
 
@@ -494,14 +957,13 @@ int csv_parse_rfc4180(struct csv_reader* self,
 	return CSV_GOOD;
 }
 
-int csv_parse_weak(struct csv_reader* self,
-                   struct csv_record* rec,
-                   const char** line,
-                   size_t* recidx,
-                   unsigned* byte_limit)
+PARSE_INLINE_ int csv_parse_weak(struct csv_reader* self,
+                                 struct csv_record* rec,
+                                 const char** line,
+                                 size_t* recidx,
+                                 unsigned* byte_limit,
+                                 const _Bool trim)
 {
-	string* field_data = vec_at(rec->_in->field_data, rec->size - 1);
-	string_clear(field_data);
 	unsigned trailing_space = 0;
 	unsigned nl_count = 0;
 	_Bool first_char = true;
@@ -520,16 +982,19 @@ int csv_parse_weak(struct csv_reader* self,
 			break;
 		}
 
-		/* Cannot reset if we don't own source */
-		if (!rec->_in->rec_alloc && !self->_in->is_mmap) {
+		/* Cannot append to a line we did not read */
+		if (*line != rec->rec) {
 			return CSV_RESET;
 		}
 
 		/* Looks fucky */
-		if (++nl_count > CSV_MAX_NEWLINES) {
+		if (++nl_count > self->_in->max_newlines) {
 			return CSV_RESET;
 		}
 		int ret = csv_append_line(self, rec);
+		if (ret == CSV_FAIL) {
+			return ret;
+		}
 
 		/* Hit EOF before finishing record */
 		if (ret == EOF) {
@@ -545,17 +1010,30 @@ int csv_parse_weak(struct csv_reader* self,
 		             self->_in->weak_delim.size);
 	}
 
-	vec_reserve(field_data, end - begin);
+	/* Nothing to unescape in weak quoting. Unless a line
+	 * was appended, the field can point into the record.
+	 */
+	if (nl_count == 0 || self->_in->skip_field) {
+		_set_field_view(rec, begin, end, trim);
+		*recidx += (end - begin) + 1;
+		self->_in->embedded_breaks += nl_count;
+		return CSV_GOOD;
+	}
+
+	string* field_data = &rec->_in->arena;
+	const char* base = field_data->data;
+	size_t start = field_data->size;
+	_arena_reserve(field_data, start + (end - begin));
 
 	const char* it = begin;
 	for (; it < end; ++it) {
-		if (first_char && self->trim && isspace(*it)) {
+		if (first_char && trim && isspace(*it)) {
 			continue;
 		}
 		string_push_back(field_data, *it);
 
 		first_char = false;
-		if (self->trim && isspace(*it))
+		if (trim && isspace(*it))
 			++trailing_space;
 		else
 			trailing_space = 0;
@@ -564,9 +1042,7 @@ int csv_parse_weak(struct csv_reader* self,
 	if (trailing_space) {
 		string_resize(field_data, field_data->size - trailing_space);
 	}
-	struct csv_field* field = vec_at(rec->_in->_fields, rec->size - 1);
-	field->data = field_data->data;
-	field->len = field_data->size;
+	_set_field_owned(rec, base, start);
 
 	/* + 1 because we treated " as part of delimiter */
 	*recidx += (end - begin) + 1;
@@ -575,34 +1051,33 @@ int csv_parse_weak(struct csv_reader* self,
 	return CSV_GOOD;
 }
 
-int csv_parse_none(struct csv_reader* self,
-                   struct csv_record* rec,
-                   const char** line,
-                   size_t* recidx,
-                   unsigned* byte_limit)
+PARSE_INLINE_ int csv_parse_none(struct csv_reader* self,
+                                 struct csv_record* rec,
+                                 const char** line,
+                                 size_t* recidx,
+                                 unsigned* byte_limit,
+                                 const _Bool trim,
+                                 const _Bool single)
 {
 	unsigned trailing_space = 0;
 	_Bool first_char = true;
 
 	const char* begin = &(*line)[*recidx];
-	const char* end = memmem(begin,
-	                         *byte_limit - *recidx,
-	                         self->_in->delim.data,
-	                         self->_in->delim.size);
+	const char* end = _find_delim(self, begin, *byte_limit - *recidx, single);
 	if (end == NULL) {
 		end = &(*line)[*byte_limit];
 	}
 
 	const char* it = begin;
-	for (; it != end; ++it) {
-		if (first_char && self->trim && isspace(*it)) {
+	for (; trim && it != end; ++it) {
+		if (first_char && isspace(*it)) {
 			++begin;
 			++(*recidx);
 			continue;
 		}
 
 		first_char = false;
-		if (self->trim && isspace(*it))
+		if (isspace(*it))
 			++trailing_space;
 		else
 			trailing_space = 0;
@@ -617,6 +1092,255 @@ int csv_parse_none(struct csv_reader* self,
 	return CSV_GOOD;
 }
 
+PARSE_INLINE_ int csv_parse_indexed(struct csv_reader* self,
+                                    struct csv_record* rec,
+                                    const char* line,
+                                    unsigned byte_limit,
+                                    unsigned field_limit,
+                                    const int quotes)
+{
+	int count = simd_index_fields(line,
+	                              byte_limit,
+	                              string_c_str(&self->_in->delim)[0],
+	                              quotes != QUOTE_NONE,
+	                              field_limit,
+	                              &self->_in->field_ends);
+	if (count == SIMD_BAIL) {
+		return SIMD_BAIL;
+	}
+
+	const unsigned* ends = vec_begin(&self->_in->field_ends);
+	_Bool all_columns = vec_empty(&self->_in->columns);
+	unsigned begin = 0;
+	int i = 0;
+	for (; i < count; ++i) {
+		csv_append_empty_field(rec);
+		struct csv_field* field = &rec->fields[rec->size - 1];
+
+		if (!all_columns && !_column_selected(self, i)) {
+			field->len = 0;
+		} else if (quotes != QUOTE_NONE && begin < ends[i]
+		           && line[begin] == '"') {
+			const char* content = &line[begin + 1];
+			const char* close = &line[ends[i] - 1];
+			/* Only the closing quote left? Nothing to unescape. */
+			if (close >= content && *close == '"'
+			    && !memchr(content, '"', close - content)) {
+				field->data = content;
+				field->len = close - content;
+				begin = ends[i] + 1;
+				continue;
+			}
+			string* arena = &rec->_in->arena;
+			const char* base = arena->data;
+			size_t start = arena->size;
+			_unescape_rfc4180(arena, content, &line[ends[i]]);
+			_set_field_owned(rec, base, start);
+		} else {
+			field->data = &line[begin];
+			field->len = ends[i] - begin;
+		}
+
+		begin = ends[i] + 1;
+	}
+
+	return CSV_GOOD;
+}
+
+PARSE_INLINE_ int csv_parse_scalar(struct csv_reader* self,
+                                   struct csv_record* rec,
+                                   const char* line,
+                                   unsigned byte_limit,
+                                   unsigned field_limit,
+                                   const int quotes,
+                                   const _Bool trim,
+                                   const _Bool single)
+{
+	size_t recidx = 0;
+	int ret = 0;
+
+	while (recidx < byte_limit && (unsigned)rec->size < field_limit) {
+		if (rec->size > 0) {
+			recidx += (single) ? 1 : self->_in->delim.size;
+		}
+		csv_append_empty_field(rec);
+		self->_in->skip_field = !_column_selected(self, rec->size - 1);
+
+		/* A line from a block is not terminated, so an
+		 * empty last field must not look past its end.
+		 */
+		if (quotes == QUOTE_NONE || recidx == byte_limit || line[recidx] != '"') {
+			ret = csv_parse_none(self,
+			                     rec,
+			                     &line,
+			                     &recidx,
+			                     &byte_limit,
+			                     trim,
+			                     single);
+		} else if (quotes == QUOTE_WEAK) {
+			ret = csv_parse_weak(self,
+			                     rec,
+			                     &line,
+			                     &recidx,
+			                     &byte_limit,
+			                     trim);
+		} else {
+			ret = csv_parse_rfc4180(self,
+			                        rec,
+			                        &line,
+			                        &recidx,
+			                        &byte_limit,
+			                        trim,
+			                        single);
+		}
+
+		if (ret == CSV_FAIL || (ret == CSV_RESET && self->_in->starved)) {
+			return ret;
+		}
+
+		if (ret == CSV_RESET) {
+			ret = csv_lowerstandard(self);
+
+			/* Worker readers stay where they stopped */
+			if (!self->_in->quiet
+			    && (ret != CSV_RESET || !self->_in->failsafe_incremental)) {
+				csv_reader_reset(self);
+			}
+			return ret;
+		}
+	}
+
+	return CSV_GOOD;
+}
+
+/* Everything the structural index cannot handle
+ * falls back to parsing field by field.
+ */
+PARSE_INLINE_ int _parse_record(struct csv_reader* self,
+                                struct csv_record* rec,
+                                const char* line,
+                                unsigned byte_limit,
+                                unsigned field_limit,
+                                const int quotes,
+                                const _Bool trim,
+                                const _Bool single)
+{
+	if (!trim && single && quotes != QUOTE_WEAK) {
+		int ret = csv_parse_indexed(self,
+		                            rec,
+		                            line,
+		                            byte_limit,
+		                            field_limit,
+		                            quotes);
+		if (ret != SIMD_BAIL) {
+			return ret;
+		}
+		rec->size = 0;
+		string_clear(&rec->_in->arena);
+		vec_clear(&rec->_in->owned);
+	}
+
+	return csv_parse_scalar(self,
+	                        rec,
+	                        line,
+	                        byte_limit,
+	                        field_limit,
+	                        quotes,
+	                        trim,
+	                        single);
+}
+
+#define PARSER_(quotes_, trim_, single_)                   \
+	static int _parse_##quotes_##_##trim_##_##single_( \
+	        struct csv_reader* self,                   \
+	        struct csv_record* rec,                    \
+	        const char* line,                          \
+	        unsigned byte_limit,                       \
+	        unsigned field_limit)                      \
+	{                                                  \
+		return _parse_record(self,                 \
+		                     rec,                  \
+		                     line,                 \
+		                     byte_limit,           \
+		                     field_limit,          \
+		                     QUOTE_##quotes_,      \
+		                     trim_,                \
+		                     single_);             \
+	}
+
+PARSER_(NONE, 0, 0)
+PARSER_(NONE, 0, 1)
+PARSER_(NONE, 1, 0)
+PARSER_(NONE, 1, 1)
+PARSER_(WEAK, 0, 0)
+PARSER_(WEAK, 0, 1)
+PARSER_(WEAK, 1, 0)
+PARSER_(WEAK, 1, 1)
+PARSER_(RFC4180, 0, 0)
+PARSER_(RFC4180, 0, 1)
+PARSER_(RFC4180, 1, 0)
+PARSER_(RFC4180, 1, 1)
+
+/* [quotes][trim][single] */
+static const csv_parse_fn _parsers[3][2][2] = {
+        [QUOTE_NONE] = {{_parse_NONE_0_0, _parse_NONE_0_1},
+                        {_parse_NONE_1_0, _parse_NONE_1_1}},
+        [QUOTE_WEAK] = {{_parse_WEAK_0_0, _parse_WEAK_0_1},
+                        {_parse_WEAK_1_0, _parse_WEAK_1_1}},
+        [QUOTE_RFC4180] = {{_parse_RFC4180_0_0, _parse_RFC4180_0_1},
+                           {_parse_RFC4180_1_0, _parse_RFC4180_1_1}},
+};
+
+void _bind_parser(struct csv_reader* self)
+{
+	/* A quote as the delimiter is left to memmem so the
+	 * structural index never sees it.
+	 */
+	int quotes = (self->quotes == QUOTE_ALL) ? QUOTE_RFC4180 : (int)self->quotes;
+	_Bool trim = self->trim;
+	const char* delim = string_c_str(&self->_in->delim);
+	_Bool single = (self->_in->delim.size == 1 && delim[0] != '"');
+
+	self->_in->parse = _parsers[quotes][trim][single];
+}
+
+int csv_append_line(struct csv_reader* self, struct csv_record* rec)
+{
+	int ret = 0;
+
+	const char* old_rec = rec->rec;
+	size_t old_reclen = rec->reclen;
+	if (self->_in->is_mmap) {
+		ret = sappline_mmap(self->_in->mmap_ptr,
+		                    &rec->rec,
+		                    &self->_in->offset,
+		                    &rec->reclen,
+		                    self->_in->file_size);
+	} else {
+		ret = sappline_block(&self->_in->block, &rec->rec, &rec->reclen);
+		if (ret == SGETLINE_STARVED) {
+			self->_in->starved = true;
+			ret = EOF;
+		}
+		if (ret == CSV_FAIL) {
+			return _read_fail(self);
+		}
+	}
+
+	if (old_rec == rec->rec) {
+		return ret;
+	}
+
+	/* If we have reached this spot, there was a realloc
+	 * that moved the location of the record.  Any fields
+	 * that were pointing to the record are now invalid
+	 * and must be fixed.
+	 */
+	csv_record_rebase(rec, old_rec, old_rec + old_reclen, rec->rec);
+
+	return ret;
+}
+
 void csv_determine_delimiter(struct csv_reader* self,
                              const char* header,
                              unsigned byte_limit)
@@ -625,16 +1349,20 @@ void csv_determine_delimiter(struct csv_reader* self,
 		return;
 	}
 
+	/* One pass over the header for every candidate */
 	const char* delims = ",|\t;:";
+	unsigned counts[UCHAR_MAX + 1] = {0};
 	unsigned i = 0;
+	for (; i < byte_limit && header[i] != '\0'; ++i) {
+		++counts[(unsigned char)header[i]];
+	}
+
 	int sel = 0;
-	int count = 0;
-	int max_count = 0;
-	for (; i < strlen(delims); ++i) {
-		count = charncount(header, delims[i], byte_limit);
-		if (count > max_count) {
+	unsigned max_count = 0;
+	for (i = 0; delims[i]; ++i) {
+		if (counts[(unsigned char)delims[i]] > max_count) {
 			sel = i;
-			max_count = count;
+			max_count = counts[(unsigned char)delims[i]];
 		}
 	}
 
@@ -645,30 +1373,112 @@ void csv_determine_delimiter(struct csv_reader* self,
 	csv_reader_set_delim(self, delim);
 }
 
+int csv_feed(struct csv_reader* self, const char* buf, size_t len)
+{
+	csvfail_if_(!self->_in->record_fn, "no record callback");
+	csvfail_if_(self->_in->is_mmap || self->_in->file != stdin,
+	            "cannot feed a reader with an open file");
+
+	/* Switch the block reader from stdin to pushed data */
+	if (self->_in->block.fd != -1) {
+		self->_in->block.fd = -1;
+		blockbuf_reset(&self->_in->block, 0);
+	}
+	if (self->_in->feed_record == NULL) {
+		self->_in->feed_record = csv_record_new();
+	}
+
+	blockbuf_push(&self->_in->block, buf, len);
+	return _feed_records(self);
+}
+
+int csv_feed_end(struct csv_reader* self)
+{
+	blockbuf_close(&self->_in->block);
+	return csv_feed(self, NULL, 0);
+}
+
+int _feed_records(struct csv_reader* self)
+{
+	struct csv_record* rec = self->_in->feed_record;
+	int ret = 0;
+	while ((ret = csv_get_record_serial(self, rec, UINT_MAX)) == CSV_GOOD) {
+		self->_in->record_fn(rec, self->_in->record_data);
+	}
+
+	if (ret == SGETLINE_STARVED || ret == EOF) {
+		return CSV_GOOD;
+	}
+	return ret;
+}
+
 int csv_reader_open(struct csv_reader* self, const char* file_name)
 {
-	self->_in->file = fopen(file_name, "r");
-	csvfail_if_(!self->_in->file, file_name);
+	int fd = open(file_name, O_RDONLY);
+	csvfail_if_(fd == -1, file_name);
+	return csv_reader_open_fd(self, fd, file_name);
+}
+
+int _reader_reopen(struct csv_reader* self)
+{
+	if (csv_reader_close(self) == CSV_FAIL) {
+		return CSV_FAIL;
+	}
+	self->offset = 0;
+	self->_in->offset = 0;
+	return CSV_GOOD;
+}
+
+int csv_reader_open_fd(struct csv_reader* self, int fd, const char* name)
+{
+	if (_reader_reopen(self) == CSV_FAIL) {
+		close(fd);
+		return CSV_FAIL;
+	}
+
+	self->_in->file = fdopen(fd, "r");
+	if (!self->_in->file) {
+		close(fd);
+	}
+	csvfail_if_(!self->_in->file, name);
 
 	/* populate size */
-	self->_in->fd = fileno(self->_in->file);
+	self->_in->fd = fd;
 	struct stat sb;
-	csvfail_if_(fstat(self->_in->fd, &sb) == -1, file_name);
+	csvfail_if_(fstat(self->_in->fd, &sb) == -1, name);
 	self->_in->file_size = sb.st_size;
 
-	return CSV_GOOD;
+	self->_in->block.fd = self->_in->fd;
+	blockbuf_reset(&self->_in->block, 0);
+
+	return csv_decompress_start(self);
 }
 
 int csv_reader_open_mmap(struct csv_reader* self, const char* file_name)
 {
-	self->_in->fd = open(file_name, O_RDONLY);
-	csvfail_if_(self->_in->fd == -1, file_name);
+	int fd = open(file_name, O_RDONLY);
+	csvfail_if_(fd == -1, file_name);
+	return csv_reader_map_fd(self, fd, file_name);
+}
+
+int csv_reader_map_fd(struct csv_reader* self, int fd, const char* name)
+{
+	/* Compressed files are read through the block reader */
+	if (csv_decompress_detect(fd)) {
+		return csv_reader_open_fd(self, fd, name);
+	}
+	if (_reader_reopen(self) == CSV_FAIL) {
+		close(fd);
+		return CSV_FAIL;
+	}
 
-	struct stat sb;
-	csvfail_if_(fstat(self->_in->fd, &sb) == -1, file_name);
+	self->_in->fd = fd;
+	self->_in->is_mmap = true;
+	self->_in->released = 0;
 
+	struct stat sb;
+	csvfail_if_(fstat(self->_in->fd, &sb) == -1, name);
 	self->_in->file_size = sb.st_size;
-	self->_in->is_mmap = true;
 
 	if (sb.st_size != 0) {
 		self->_in->mmap_ptr =
@@ -691,17 +1501,26 @@ int csv_reader_seek(struct csv_reader* self, size_t offset)
 {
 	csvfail_if_(offset > self->_in->file_size, "offset out of range");
 
+	csv_parallel_stop(self);
 	self->offset = offset;
 
 	if (self->_in->is_mmap) {
 		self->_in->offset = offset;
+		self->_in->released = offset - offset % sysconf(_SC_PAGESIZE);
 		return CSV_GOOD;
 	}
 
 	csvfail_if_(!self->_in->file, "<null> file");
 	csvfail_if_(self->_in->file == stdin, "cannot seek stdin");
-	int ret = fseek(self->_in->file, offset, SEEK_SET);
-	csvfail_if_(ret, "fseek");
+	if (self->_in->decompress) {
+		if (csv_decompress_rewind(self) == CSV_FAIL) {
+			return CSV_FAIL;
+		}
+	} else {
+		off_t ret = lseek(self->_in->block.fd, offset, SEEK_SET);
+		csvfail_if_(ret == -1, "lseek");
+	}
+	blockbuf_reset(&self->_in->block, offset);
 
 	return CSV_GOOD;
 }
@@ -714,6 +1533,7 @@ int csv_reader_goto(struct csv_reader* self, const char* location)
 
 int csv_reader_close(struct csv_reader* self)
 {
+	csv_parallel_stop(self);
 	if (self->_in->is_mmap) {
 		self->_in->is_mmap = false;
 		/* If the file was 0 size, we didn't map anything... */
@@ -729,7 +1549,11 @@ int csv_reader_close(struct csv_reader* self)
 		}
 
 	} else if (self->_in->file && self->_in->file != stdin) {
-		csvfail_if_(fclose(self->_in->file), "fclose");
+		csv_decompress_stop(self);
+		FILE* file = self->_in->file;
+		self->_in->file = NULL;
+		self->_in->fd = -1;
+		csvfail_if_(fclose(file), "fclose");
 	}
 	return CSV_GOOD;
 }
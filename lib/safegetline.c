@@ -1,7 +1,11 @@
 #include "safegetline.h"
+#include "csv.h"
 #include "misc.h"
 
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include "util/util.h"
 
 int _safegetline(FILE* fp, char* buffer, size_t* restrict buflen, size_t* off)
 {
@@ -82,6 +86,373 @@ int sgetline(FILE* f, char** buf, size_t* restrict buflen, size_t* restrict len)
 	return _getline_runner(f, buf, buflen, len, 0);
 }
 
+void blockbuf_construct(struct blockbuf* self, int fd)
+{
+	*self = (struct blockbuf) {
+	        .fd = fd,
+	};
+}
+
+void blockbuf_destroy(struct blockbuf* self)
+{
+	free_if_exists_(self->store);
+}
+
+void blockbuf_reset(struct blockbuf* self, size_t offset)
+{
+	self->buf = self->store;
+	self->src = NULL;
+	self->src_len = 0;
+	self->src_taken = 0;
+	self->begin = 0;
+	self->line_end = 0;
+	self->idx = 0;
+	self->end = 0;
+	self->gap = 0;
+	self->file_offset = offset;
+	self->lf_known = false;
+	self->eof = false;
+}
+
+void blockbuf_rewind(struct blockbuf* self)
+{
+	/* Move the joined lines up to the line being
+	 * appended so the line can be read again as is.
+	 */
+	if (self->gap) {
+		memmove(self->buf + self->begin + self->gap,
+		        self->buf + self->begin,
+		        self->joined);
+		self->begin += self->gap;
+		self->gap = 0;
+	}
+
+	self->idx = self->begin;
+	self->line_end = self->begin;
+	self->lf_known = false;
+}
+
+void blockbuf_push(struct blockbuf* self, const char* data, size_t len)
+{
+	self->src = data;
+	self->src_len = len;
+	self->src_taken = 0;
+}
+
+void blockbuf_close(struct blockbuf* self)
+{
+	self->closed = true;
+}
+
+size_t blockbuf_offset(struct blockbuf* self)
+{
+	return self->file_offset + self->idx;
+}
+
+void _blockbuf_reserve(struct blockbuf* self, size_t size)
+{
+	if (self->store != NULL && self->storesize >= size) {
+		return;
+	}
+	if (self->storesize == 0) {
+		self->storesize = SGETLINE_BLOCK_SIZE;
+	}
+	while (self->storesize < size) {
+		self->storesize *= 2;
+	}
+	realloc_(self->store, self->storesize);
+}
+
+ssize_t blockbuf_read(struct blockbuf* self, char* buf, size_t len)
+{
+	if (self->idx < self->end) {
+		size_t n = self->end - self->idx;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buf, self->buf + self->idx, n);
+		self->idx += n;
+		self->begin = self->idx;
+		self->line_end = self->idx;
+		return n;
+	}
+
+	/* The buffer is used up */
+	self->file_offset += self->end;
+	self->begin = 0;
+	self->line_end = 0;
+	self->idx = 0;
+	self->end = 0;
+	self->lf_known = false;
+
+	ssize_t n = 0;
+	do {
+		n = (self->source) ? self->source(self->source_data, buf, len)
+		                   : read(self->fd, buf, len);
+	} while (n == -1 && errno == EINTR);
+
+	if (n > 0) {
+		self->file_offset += n;
+	}
+	self->eof = (n == 0);
+	return n;
+}
+
+void blockbuf_unread(struct blockbuf* self, const char* data, size_t len)
+{
+	size_t rest = self->end - self->idx;
+	_blockbuf_reserve(self, len + rest);
+	self->buf = self->store;
+	memmove(self->buf + len, self->buf + self->idx, rest);
+	memcpy(self->buf, data, len);
+
+	self->file_offset += self->idx;
+	self->file_offset -= len;
+	self->begin = 0;
+	self->line_end = 0;
+	self->idx = 0;
+	self->end = len + rest;
+	self->gap = 0;
+	self->lf_known = false;
+}
+
+/* Stop reading pushed data in place. Copy the current
+ * line up to `upto' into the store. Anything after it
+ * is pushed back to be copied when it is needed.
+ */
+void _blockbuf_own(struct blockbuf* self, size_t upto)
+{
+	size_t len = upto - self->begin;
+	_blockbuf_reserve(self, len);
+	memcpy(self->store, self->buf + self->begin, len);
+
+	self->src = self->buf + upto;
+	self->src_len = self->end - upto;
+	self->src_taken = len;
+	self->buf = self->store;
+	self->file_offset += self->begin;
+	self->line_end -= self->begin;
+	self->idx -= self->begin;
+	self->end = len;
+	self->begin = 0;
+	self->lf_known = false;
+}
+
+/* Go back to reading pushed data in place. Bytes left
+ * in the store were copied from just before src.
+ */
+void _blockbuf_borrow(struct blockbuf* self)
+{
+	size_t back = self->end - self->idx;
+	self->file_offset += self->idx;
+	self->buf = (char*)self->src - back;
+	self->end = self->src_len + back;
+	self->begin = 0;
+	self->line_end = 0;
+	self->idx = 0;
+	self->src = NULL;
+	self->src_len = 0;
+	self->src_taken = 0;
+	self->lf_known = false;
+}
+
+/* Copy pushed data into the store through the next
+ * line ending, and the byte after a '\r' in case it
+ * is a '\n'. The lines after it are read in place.
+ */
+int _blockbuf_take(struct blockbuf* self)
+{
+	if (self->src_len == 0) {
+		self->eof = self->closed;
+		return (self->eof) ? 0 : SGETLINE_STARVED;
+	}
+
+	size_t n = self->src_len;
+	const char* lf = memchr(self->src, '\n', n);
+	size_t lf_idx = (lf) ? (size_t)(lf - self->src) : n;
+	const char* cr = memchr(self->src, '\r', lf_idx);
+	if (cr != NULL && (size_t)(cr - self->src) + 2 < n) {
+		n = cr - self->src + 2;
+	} else if (cr == NULL && lf != NULL) {
+		n = lf_idx + 1;
+	}
+	if (n > self->storesize - self->end) {
+		n = self->storesize - self->end;
+	}
+
+	memcpy(self->store + self->end, self->src, n);
+	self->end += n;
+	self->src += n;
+	self->src_len -= n;
+	self->src_taken += n;
+	self->lf_known = false;
+	return 0;
+}
+
+/* Drop everything before the current line, make
+ * room if the line fills the buffer and read(2)
+ * or take pushed data. CSV_FAIL with errno set if
+ * the read fails.
+ */
+int _blockbuf_fill(struct blockbuf* self)
+{
+	if (self->buf != self->store) {
+		_blockbuf_own(self, self->end);
+	}
+
+	if (self->begin > 0) {
+		size_t shift = self->begin;
+		memmove(self->buf, self->buf + shift, self->end - shift);
+		self->file_offset += shift;
+		self->line_end -= shift;
+		self->idx -= shift;
+		self->end -= shift;
+		self->begin = 0;
+	}
+
+	if (self->end == self->storesize) {
+		_blockbuf_reserve(self, self->storesize + 1);
+	}
+	self->buf = self->store;
+
+	if (self->fd == -1) {
+		return _blockbuf_take(self);
+	}
+
+	size_t room = self->storesize - self->end;
+	ssize_t n = 0;
+	do {
+		n = (self->source) ? self->source(self->source_data, self->buf + self->end, room)
+		                   : read(self->fd, self->buf + self->end, room);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		return CSV_FAIL;
+	}
+
+	self->end += n;
+	self->eof = (n == 0);
+	self->lf_known = false;
+	return 0;
+}
+
+/* First '\r' or '\n' at or after `from'. The next '\n'
+ * is remembered so that files ending lines with '\r'
+ * do not scan the whole buffer for every line.
+ */
+size_t _blockbuf_find_eol(struct blockbuf* self, size_t from)
+{
+	if (from == self->end) {
+		return from;
+	}
+
+	if (!self->lf_known || self->lf_idx < from) {
+		char* lf = memchr(self->buf + from, '\n', self->end - from);
+		self->lf_idx = (lf) ? (size_t)(lf - self->buf) : self->end;
+		self->lf_known = true;
+	}
+
+	char* cr = memchr(self->buf + from, '\r', self->lf_idx - from);
+	return (cr) ? (size_t)(cr - self->buf) : self->lf_idx;
+}
+
+/* Find the end of the line starting at self->idx */
+int _blockbuf_next(struct blockbuf* self)
+{
+	size_t scan = self->idx - self->begin;
+	size_t start = self->idx - self->begin;
+
+	for (;;) {
+		size_t eol = _blockbuf_find_eol(self, self->begin + scan);
+		_Bool peek = (eol + 1 == self->end && self->buf[eol] == '\r');
+		if (eol < self->end && (!peek || self->eof)) {
+			self->line_end = eol;
+			self->idx = eol + 1;
+			if (self->buf[eol] == '\r' && self->idx < self->end
+			    && self->buf[self->idx] == '\n') {
+				++self->idx;
+			}
+
+			/* Like sgetline, a blank line at EOF is EOF */
+			if (eol != self->begin + start || self->idx != self->end) {
+				return 0;
+			}
+			if (self->eof) {
+				return EOF;
+			}
+			peek = true;
+			eol = self->begin + start;
+		}
+
+		if (self->eof) {
+			self->line_end = self->end;
+			self->idx = self->end;
+			return (self->end == self->begin + start) ? EOF : 0;
+		}
+
+		scan = (peek) ? eol - self->begin : self->end - self->begin;
+		int ret = _blockbuf_fill(self);
+		if (ret == SGETLINE_STARVED) {
+			blockbuf_rewind(self);
+			return SGETLINE_STARVED;
+		}
+		if (ret == CSV_FAIL) {
+			return CSV_FAIL;
+		}
+	}
+}
+
+int sgetline_block(struct blockbuf* self, char** line, size_t* restrict len)
+{
+	if (self->src_len && self->buf == self->store
+	    && self->end - self->idx <= self->src_taken) {
+		_blockbuf_borrow(self);
+	}
+
+	self->begin = self->idx;
+	self->gap = 0;
+	int ret = _blockbuf_next(self);
+	*line = self->buf + self->begin;
+	*len = self->line_end - self->begin;
+	return ret;
+}
+
+int sappline_block(struct blockbuf* self, char** line, size_t* restrict len)
+{
+	/* Already at EOF with no line ending */
+	if (self->idx == self->line_end) {
+		return EOF;
+	}
+
+	/* Pushed data is read-only */
+	if (self->buf != self->store) {
+		_blockbuf_own(self, self->idx);
+	}
+
+	/* Whatever ended the line becomes a single '\n'. A
+	 * "\r\n" leaves a byte between the lines. The new
+	 * line and its ending are moved over the gap once
+	 * read, so joining costs the length of that line.
+	 */
+	self->joined = self->line_end - self->gap - self->begin;
+	self->buf[self->begin + self->joined] = '\n';
+	++self->joined;
+	self->gap = self->idx - (self->begin + self->joined);
+
+	int ret = _blockbuf_next(self);
+	if (ret == CSV_FAIL) {
+		return ret;
+	}
+	if (self->gap) {
+		char* dest = self->buf + self->begin + self->joined;
+		memmove(dest, dest + self->gap, self->idx - self->gap - (dest - self->buf));
+		self->joined = self->line_end - self->gap - self->begin;
+	}
+	*line = self->buf + self->begin;
+	*len = self->line_end - self->gap - self->begin;
+	return ret;
+}
+
 /**
  * Unlike sgetline sgetline_mmap, will not read a
  * carriage return only line ending file. I ignored it
@@ -2,6 +2,7 @@
 #define SAFEGETLINE_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 /**
  * safegetline gets the next line from the provided
@@ -17,6 +18,105 @@
 int sappline(FILE*, char** buf, size_t* restrict buflen, size_t* restrict linelen);
 int sgetline(FILE*, char** buf, size_t* restrict buflen, size_t* restrict linelen);
 
+/* Bytes requested from each read(2) by sgetline_block */
+#define SGETLINE_BLOCK_SIZE (1 << 20)
+
+/* Returned by sgetline_block and sappline_block when
+ * pushed data ran out before the end of the line.
+ */
+#define SGETLINE_STARVED (EOF - 2)
+
+/**
+ * blockbuf reads a file descriptor in large blocks. Lines
+ * handed out by sgetline_block point into the buffer and
+ * stay valid until the next call on the same blockbuf.
+ *
+ * A `source' set by the owner is called in place of
+ * read(2), with the same return values.
+ *
+ * With an fd of -1, data is pushed with blockbuf_push
+ * instead. Pushed data is read in place. Only a line that
+ * is still incomplete when the pushed data runs out is
+ * copied into memory owned by the blockbuf.
+ */
+struct blockbuf {
+	char* buf;          /* store or pushed data being read */
+	char* store;        /* memory owned by the blockbuf */
+	const char* src;    /* pushed data not in buf yet */
+	void* source_data;
+	ssize_t (*source)(void* source_data, char* buf, size_t len);
+	size_t storesize;
+	size_t src_len;
+	size_t src_taken;   /* bytes at the end of store copied from src */
+	size_t begin;       /* start of the current line */
+	size_t line_end;    /* end of the current line's content */
+	size_t idx;         /* start of the next line */
+	size_t end;         /* end of the data in buf */
+	size_t lf_idx;      /* next '\n' from idx, or end if none */
+	size_t file_offset; /* file offset of buf[0] */
+	size_t joined;      /* bytes of the line joined so far */
+	size_t gap;         /* bytes after `joined' left by "\r\n" */
+	int fd;
+	_Bool lf_known;
+	_Bool closed;       /* nothing more will be pushed */
+	_Bool eof;
+};
+
+void blockbuf_construct(struct blockbuf*, int fd);
+void blockbuf_destroy(struct blockbuf*);
+
+/**
+ * Forget buffered data after the file descriptor
+ * was moved to `offset'.
+ */
+void blockbuf_reset(struct blockbuf*, size_t offset);
+
+/**
+ * Go back to the beginning of the current line so it,
+ * and anything appended to it, is handed out again.
+ */
+void blockbuf_rewind(struct blockbuf*);
+
+/**
+ * Hand the blockbuf more data. `data' must stay valid until
+ * sgetline_block returns SGETLINE_STARVED. After
+ * blockbuf_close, running out of data is EOF.
+ */
+void blockbuf_push(struct blockbuf*, const char* data, size_t len);
+void blockbuf_close(struct blockbuf*);
+
+/* File offset of the next line */
+size_t blockbuf_offset(struct blockbuf*);
+
+/**
+ * Raw bytes from where the next line begins: whatever is
+ * buffered first, then straight from the file. Same return
+ * values as read(2). Not for pushed data.
+ */
+ssize_t blockbuf_read(struct blockbuf*, char* buf, size_t len);
+
+/**
+ * Put `len' bytes back in front of the next line, as if
+ * they had not been read from the file yet. Not for
+ * pushed data.
+ */
+void blockbuf_unread(struct blockbuf*, const char* data, size_t len);
+
+/**
+ * Same line endings and return values as sgetline and
+ * sappline. sappline_block joins the next line to the
+ * current one with '\n', so `line' may move.
+ *
+ * SGETLINE_STARVED is returned if pushed data runs out
+ * first. The blockbuf is then rewound to the beginning
+ * of the line that sgetline_block last returned.
+ *
+ * CSV_FAIL is returned with errno set if read(2) or the
+ * source fails.
+ */
+int sgetline_block(struct blockbuf*, char** line, size_t* restrict len);
+int sappline_block(struct blockbuf*, char** line, size_t* restrict len);
+
 int sappline_mmap(const char* mmap,
                   char** line,
                   size_t* restrict bufidx,
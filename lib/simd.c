@@ -0,0 +1,401 @@
+#include "simd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+/* One bit per byte of a 64 byte block */
+struct blockmask {
+	uint64_t quote;
+	uint64_t delim;
+	uint64_t lf;
+	uint64_t cr;
+};
+
+typedef void (*classify_fn)(const char*, char, struct blockmask*);
+
+static void _classify_scalar(const char* block, char delim, struct blockmask* mask)
+{
+	mask->quote = 0;
+	mask->delim = 0;
+	mask->lf = 0;
+	mask->cr = 0;
+	unsigned i = 0;
+	for (; i < 64; ++i) {
+		mask->quote |= (uint64_t)(block[i] == '"') << i;
+		mask->delim |= (uint64_t)(block[i] == delim) << i;
+		mask->lf |= (uint64_t)(block[i] == '\n') << i;
+		mask->cr |= (uint64_t)(block[i] == '\r') << i;
+	}
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2"))) static void
+_classify_sse2(const char* block, char delim, struct blockmask* mask)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i sep = _mm_set1_epi8(delim);
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	mask->quote = 0;
+	mask->delim = 0;
+	mask->lf = 0;
+	mask->cr = 0;
+	unsigned i = 0;
+	for (; i < 4; ++i) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+		uint64_t q = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, quote));
+		uint64_t d = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, sep));
+		uint64_t l = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, lf));
+		uint64_t c = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(in, cr));
+		mask->quote |= q << (16 * i);
+		mask->delim |= d << (16 * i);
+		mask->lf |= l << (16 * i);
+		mask->cr |= c << (16 * i);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+_classify_avx2(const char* block, char delim, struct blockmask* mask)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i sep = _mm256_set1_epi8(delim);
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i cr = _mm256_set1_epi8('\r');
+
+	__m256i lo = _mm256_loadu_si256((const __m256i*)block);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+
+	uint64_t q_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quote));
+	uint64_t q_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quote));
+	uint64_t d_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, sep));
+	uint64_t d_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, sep));
+	uint64_t l_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, lf));
+	uint64_t l_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, lf));
+	uint64_t c_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cr));
+	uint64_t c_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cr));
+
+	mask->quote = q_lo | (q_hi << 32);
+	mask->delim = d_lo | (d_hi << 32);
+	mask->lf = l_lo | (l_hi << 32);
+	mask->cr = c_lo | (c_hi << 32);
+}
+#endif
+
+static classify_fn _classify = _classify_scalar;
+
+/* Pick the widest classifier the CPU supports once at load */
+__attribute__((constructor)) static void _select_classifier()
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		_classify = _classify_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		_classify = _classify_sse2;
+	}
+#endif
+}
+
+/* Each bit becomes the XOR of itself and every bit
+ * below it. For a quote mask, this marks every byte
+ * from an opening quote up to its closing quote.
+ */
+static inline uint64_t _prefix_xor(uint64_t bits)
+{
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
+
+static inline long _highest_bit(unsigned base, uint64_t bits)
+{
+	return base + 63 - __builtin_clzll(bits);
+}
+
+int simd_index_fields(const char* line,
+                      unsigned len,
+                      char delim,
+                      bool quotes,
+                      unsigned field_limit,
+                      vec* ends)
+{
+	vec_clear(ends);
+	if (len == 0 || field_limit == 0) {
+		return 0;
+	}
+
+	char tail[64];
+	uint64_t qualified = 0;
+	long last_quote = -1;
+	unsigned field_begin = 0;
+	unsigned base = 0;
+
+	for (; base < len; base += 64) {
+		const char* block = &line[base];
+		unsigned remaining = len - base;
+
+		/* Never read past the end of line */
+		if (remaining < 64) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, block, remaining);
+			block = tail;
+		}
+
+		struct blockmask mask;
+		_classify(block, delim, &mask);
+		if (remaining < 64) {
+			uint64_t valid = (UINT64_C(1) << remaining) - 1;
+			mask.quote &= valid;
+			mask.delim &= valid;
+		}
+		if (!quotes) {
+			mask.quote = 0;
+		}
+
+		uint64_t inside = _prefix_xor(mask.quote) ^ qualified;
+		qualified = (uint64_t)((int64_t)inside >> 63);
+
+		uint64_t seps = mask.delim & ~inside;
+		for (; seps; seps &= seps - 1) {
+			unsigned bit = __builtin_ctzll(seps);
+			unsigned pos = base + bit;
+
+			uint64_t quotes_before = mask.quote & ((UINT64_C(1) << bit) - 1);
+			long field_quote = last_quote;
+			if (quotes_before) {
+				field_quote = _highest_bit(base, quotes_before);
+			}
+
+			/* quote in the middle of an unqualified field */
+			if (line[field_begin] != '"' && field_quote >= (long)field_begin) {
+				return SIMD_BAIL;
+			}
+
+			vec_push_back(ends, &pos);
+			if (ends->size == field_limit) {
+				return ends->size;
+			}
+			field_begin = pos + 1;
+		}
+
+		if (mask.quote) {
+			last_quote = _highest_bit(base, mask.quote);
+		}
+	}
+
+	/* Embedded line break. Let the scalar parser append lines. */
+	if (qualified) {
+		return SIMD_BAIL;
+	}
+
+	if (field_begin < len && line[field_begin] != '"'
+	    && last_quote >= (long)field_begin) {
+		return SIMD_BAIL;
+	}
+
+	vec_push_back(ends, &len);
+	return ends->size;
+}
+
+/* Fill `block' from the rest of the input, zero padded, and
+ * classify it. Returns the index of the last valid byte.
+ */
+static unsigned _classify_tail(const char* data,
+                               size_t remaining,
+                               char delim,
+                               struct blockmask* mask)
+{
+	if (remaining >= 64) {
+		_classify(data, delim, mask);
+		return 63;
+	}
+
+	char tail[64];
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data, remaining);
+	_classify(tail, delim, mask);
+
+	uint64_t valid = (UINT64_C(1) << remaining) - 1;
+	mask->quote &= valid;
+	mask->delim &= valid;
+	mask->lf &= valid;
+	mask->cr &= valid;
+	return remaining - 1;
+}
+
+uint64_t simd_count_quotes(const char* data, size_t len)
+{
+	uint64_t count = 0;
+	size_t base = 0;
+	for (; base < len; base += 64) {
+		struct blockmask mask;
+		_classify_tail(&data[base], len - base, '"', &mask);
+		count += __builtin_popcountll(mask.quote);
+	}
+	return count;
+}
+
+/* Fields shorter than this are not worth padding out to a block */
+#define QUOTING_SHORT 16
+
+static unsigned _quoting_short(const char* data,
+                               size_t len,
+                               const char* delim,
+                               size_t delim_len)
+{
+	unsigned found = 0;
+	size_t i = 0;
+	for (; i < len; ++i) {
+		if (data[i] == '"') {
+			return SIMD_QUOTE_CHAR;
+		}
+		if (data[i] == '\r' || data[i] == '\n'
+		    || (delim_len && data[i] == delim[0] && len - i >= delim_len
+		        && !memcmp(&data[i], delim, delim_len))) {
+			found = SIMD_QUOTE_SPECIAL;
+		}
+	}
+	return found;
+}
+
+unsigned simd_quoting(const char* data, size_t len, const char* delim, size_t delim_len)
+{
+	if (len < QUOTING_SHORT) {
+		return _quoting_short(data, len, delim, delim_len);
+	}
+
+	unsigned found = 0;
+	size_t base = 0;
+	for (; base < len; base += 64) {
+		struct blockmask mask;
+		_classify_tail(&data[base], len - base, (delim_len) ? delim[0] : '\n', &mask);
+		if (mask.quote) {
+			return SIMD_QUOTE_CHAR;
+		}
+		if (found) {
+			continue;
+		}
+		if (mask.cr | mask.lf) {
+			found = SIMD_QUOTE_SPECIAL;
+			continue;
+		}
+
+		uint64_t delims = (delim_len) ? mask.delim : 0;
+		for (; delims; delims &= delims - 1) {
+			size_t idx = base + __builtin_ctzll(delims);
+			if (len - idx >= delim_len && !memcmp(&data[idx], delim, delim_len)) {
+				found = SIMD_QUOTE_SPECIAL;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+/* Field starts, breaks inside of quotes and quotes that
+ * reopen a field, in the order they appear in the block.
+ * These are rare enough to handle one at a time.
+ */
+static void _scan_events(struct simd_scan* scan,
+                         uint64_t starts,
+                         uint64_t quote,
+                         uint64_t breaks,
+                         uint64_t reopen,
+                         unsigned max_breaks)
+{
+	uint64_t events = starts | breaks | reopen;
+	for (; events; events &= events - 1) {
+		uint64_t bit = events & -events;
+		if (starts & bit) {
+			scan->quoted_field = ((quote & bit) != 0);
+			scan->field_known = true;
+			scan->field_breaks = 0;
+		}
+		if (breaks & bit) {
+			if (!scan->field_known) {
+				++scan->head_breaks;
+			} else if (++scan->field_breaks > max_breaks) {
+				scan->bail = true;
+			}
+		}
+		if ((reopen & bit) && !scan->quoted_field) {
+			/* quote in the middle of an unqualified field */
+			if (scan->field_known) {
+				scan->bail = true;
+			} else {
+				scan->head_reopen = true;
+			}
+		}
+	}
+}
+
+void simd_scan_records(const char* data,
+                       size_t len,
+                       char delim,
+                       bool quotes,
+                       bool cr_breaks,
+                       unsigned max_breaks,
+                       struct simd_scan* scan)
+{
+	size_t base = 0;
+	for (; base < len && !scan->bail; base += 64) {
+		struct blockmask mask;
+		unsigned last = _classify_tail(&data[base], len - base, delim, &mask);
+		if (!quotes) {
+			mask.quote = 0;
+		}
+
+		uint64_t inside = _prefix_xor(mask.quote);
+		if (scan->inside) {
+			inside = ~inside;
+		}
+
+		uint64_t ends = mask.lf;
+		uint64_t edges = mask.delim | mask.lf;
+		if (cr_breaks) {
+			ends = mask.cr | (mask.lf & ~((mask.cr << 1) | scan->cr));
+			edges |= mask.cr;
+		}
+		edges &= ~inside;
+
+		uint64_t starts = (edges << 1) | scan->field_start;
+		if (last < 63) {
+			starts &= (UINT64_C(2) << last) - 1;
+		}
+
+		/* An opening quote is inside of its own quoted region */
+		uint64_t reopen = mask.quote & inside & ~starts;
+		uint64_t breaks = ends & inside;
+
+		uint64_t records = ends & ~inside;
+		scan->records += __builtin_popcountll(records);
+		scan->breaks += __builtin_popcountll(breaks);
+
+		if (breaks | reopen) {
+			_scan_events(scan, starts, mask.quote, breaks, reopen, max_breaks);
+		} else if (starts) {
+			uint64_t bit = UINT64_C(1) << (63 - __builtin_clzll(starts));
+			scan->quoted_field = ((mask.quote & bit) != 0);
+			scan->field_known = true;
+			scan->field_breaks = 0;
+		}
+		if (records && !scan->bail) {
+			scan->record_end = scan->scanned + base + 64 - __builtin_clzll(records);
+		}
+
+		scan->inside = (inside >> last) & 1;
+		scan->field_start = (edges >> last) & 1;
+		scan->cr = (mask.cr >> last) & 1;
+	}
+	scan->scanned += len;
+}
@@ -0,0 +1,114 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "util/vec.h"
+
+/* Returned by simd_index_fields when the line
+ * cannot be indexed the way the scalar parsers
+ * would have parsed it.
+ */
+#define SIMD_BAIL -1
+
+/**
+ * simd_index_fields builds a structural index of a single
+ * line. 64 bytes at a time, it classifies quotes and
+ * delimiters into bitmasks, resolves quoted regions with a
+ * prefix-XOR of the quote mask and collects the position of
+ * every delimiter that is not qualified.
+ *
+ * `ends' (vec<unsigned>) receives the end offset of each
+ * field, the last of which is `len'. No more than
+ * `field_limit' fields are indexed.
+ *
+ * Quotes are only meaningful at the beginning of a field.
+ * If a field that does not start with a quote contains one,
+ * or the line ends inside of a quoted field, SIMD_BAIL is
+ * returned and the line should be handed to the scalar parser.
+ *
+ * Returns:
+ *      - the number of fields indexed
+ *      - SIMD_BAIL
+ */
+int simd_index_fields(const char* line,
+                      unsigned len,
+                      char delim,
+                      bool quotes,
+                      unsigned field_limit,
+                      vec* ends);
+
+/* State of simd_scan_records between calls. Zero it and
+ * set `field_start' to scan from the beginning of a record.
+ */
+struct simd_scan {
+	uint64_t records;      /* line endings outside of quotes */
+	uint64_t breaks;       /* line endings inside of quotes */
+	uint64_t head_breaks;  /* breaks before the first field began */
+	uint64_t scanned;      /* bytes fed so far */
+	uint64_t record_end;   /* see below */
+	unsigned field_breaks; /* breaks in the current field */
+	_Bool inside;          /* in a quoted region */
+	_Bool field_start;     /* the next byte begins a field */
+	_Bool field_known;     /* a field began during the scan */
+	_Bool quoted_field;    /* the current field began with a quote */
+	_Bool head_reopen;     /* see below */
+	_Bool cr;              /* the last byte was '\r' */
+	_Bool bail;
+};
+
+/**
+ * simd_scan_records finds record boundaries without parsing
+ * fields. Quotes, delimiters and line endings are classified
+ * 64 bytes at a time the same way as simd_index_fields, and
+ * line endings outside of quoted regions are counted. With
+ * `cr_breaks', '\r', '\n' and "\r\n" each end a line as in
+ * sgetline. Otherwise only '\n' does as in sgetline_mmap.
+ *
+ * The scan is resumable: feeding consecutive pieces of the
+ * input gives the same result as feeding all of it at once.
+ *
+ * `bail' is set where the parsers would not agree with the
+ * count: a quote in the middle of an unqualified field, or
+ * a field with more than `max_breaks' embedded breaks.
+ * When the scan does not begin at a field, those cannot be
+ * known for the field it begins in. `head_reopen' and
+ * `head_breaks' are left for the caller to check instead.
+ *
+ * `record_end' is how many bytes were fed up to and including
+ * the first byte of the last line ending counted in `records'.
+ * It is not moved by the 64 bytes in which the scan bailed, so
+ * everything before it can still be split into records.
+ */
+void simd_scan_records(const char* data,
+                       size_t len,
+                       char delim,
+                       bool quotes,
+                       bool cr_breaks,
+                       unsigned max_breaks,
+                       struct simd_scan* scan);
+
+/* Number of '"' in `data' */
+uint64_t simd_count_quotes(const char* data, size_t len);
+
+/* Returned by simd_quoting */
+#define SIMD_QUOTE_SPECIAL 1 /* '\r', '\n' or the delimiter */
+#define SIMD_QUOTE_CHAR 2    /* '"' */
+
+/**
+ * simd_quoting tells the writer in one pass whether a field
+ * has to be quoted. Quotes, line endings and the first byte
+ * of `delim' are classified together 64 bytes at a time.
+ * Candidates for a longer delimiter are then compared one
+ * by one. An empty delimiter never matches.
+ *
+ * Returns:
+ *      - SIMD_QUOTE_CHAR if the field holds a '"'
+ *      - SIMD_QUOTE_SPECIAL if it holds anything else
+ *        that needs quotes
+ *      - 0
+ */
+unsigned simd_quoting(const char* data, size_t len, const char* delim, size_t delim_len);
+
+#endif /* SIMD_H */
@@ -0,0 +1,475 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include "csv.h"
+#include "csverror.h"
+#include "internal.h"
+#include "util/vec.h"
+#include "util/util.h"
+
+/* Sample this much from the head, middle and tail */
+#define SNIFF_BLOCK_SIZE (1 << 16)
+#define SNIFF_BLOCKS     3
+
+/* Fewer lines than this lower the confidence */
+#define SNIFF_MIN_LINES 8
+
+#define SNIFF_DELIMS ",|\t;:"
+
+enum sniff_field {
+	SNIFF_PLAIN,   /* reads the same with any quote style */
+	SNIFF_RFC4180, /* has escaped quotes or line breaks */
+	SNIFF_WEAK,    /* only makes sense with weak quoting */
+	SNIFF_NONE,    /* makes no sense quoted */
+	SNIFF_CUT,     /* ran out of sample */
+};
+
+struct sniff_sample {
+	const char* data;
+	size_t len;
+};
+
+struct sniff_stats {
+	vec field_counts; /* vec<unsigned> */
+	unsigned mode;
+	double consistency;
+};
+
+/**
+ * Copy up to SNIFF_BLOCK_SIZE bytes at `offset' into `buf'
+ * and trim partial lines. Every block but the first drops
+ * the line it begins in, and every block that does not
+ * reach the end of the file drops the line it ends in.
+ */
+int _sniff_read(struct csv_reader*, char* buf, size_t offset, struct sniff_sample*);
+
+/**
+ * A block taken from the middle of the file may begin inside
+ * of a quoted field. Of the two possible states, take the one
+ * that puts more quotes next to a field edge, and move the
+ * sample to the first line ending outside of quotes.
+ */
+void _sniff_sync(struct sniff_sample*);
+
+/**
+ * Field count of every record for one delimiter and quote
+ * style, from every sample. Their mode and how many of the
+ * records have it go in `stats'. A quoted field is given
+ * up on after `max_breaks' line breaks like the parser.
+ */
+void _sniff_field_counts(const struct sniff_sample*,
+                         unsigned n,
+                         char delim,
+                         enum quote_style,
+                         unsigned max_breaks,
+                         struct sniff_stats*);
+
+/**
+ * Where the field opened by the quote at `it' ends with weak
+ * quoting: after a quote followed by a delimiter or the end
+ * of the line. NULL if there is none on this line.
+ */
+const char* _sniff_weak_end(const char* it, const char* end, char delim);
+
+/**
+ * How the quoted field starting at `begin' ends. `end' is
+ * left on the delimiter or line ending after the field.
+ */
+enum sniff_field _sniff_quoted(const char* data,
+                               size_t len,
+                               size_t begin,
+                               char delim,
+                               unsigned max_breaks,
+                               size_t* end);
+
+static _Bool _is_eol(char c)
+{
+	return (c == '\n' || c == '\r');
+}
+
+/* Anything a quote may follow or precede in a field that
+ * is quoted, whatever the delimiter
+ */
+static _Bool _is_edge(char c)
+{
+	return (c == '"' || _is_eol(c) || strchr(SNIFF_DELIMS, c));
+}
+
+static int _cmp_unsigned(const void* a, const void* b)
+{
+	unsigned x = *(const unsigned*)a;
+	unsigned y = *(const unsigned*)b;
+	return (x > y) - (x < y);
+}
+
+int _sniff_read(struct csv_reader* self, char* buf, size_t offset, struct sniff_sample* sample)
+{
+	size_t len = self->_in->file_size - offset;
+	if (len > SNIFF_BLOCK_SIZE) {
+		len = SNIFF_BLOCK_SIZE;
+	}
+
+	if (self->_in->is_mmap) {
+		memcpy(buf, &self->_in->mmap_ptr[offset], len);
+	} else {
+		ssize_t n = pread(self->_in->fd, buf, len, offset);
+		csvfail_if_(n == -1, "pread");
+		len = n;
+	}
+
+	const char* begin = buf;
+	const char* end = buf + len;
+	if (offset > 0) {
+		while (begin < end && !_is_eol(*begin)) {
+			++begin;
+		}
+		if (begin < end && *begin == '\r') {
+			++begin;
+		}
+		if (begin < end && *begin == '\n') {
+			++begin;
+		}
+	}
+	if (offset + len < self->_in->file_size) {
+		const char* last = end;
+		while (last > begin && !_is_eol(last[-1])) {
+			--last;
+		}
+		if (last > begin || offset > 0) {
+			end = last;
+		}
+	}
+
+	sample->data = begin;
+	sample->len = end - begin;
+	return CSV_GOOD;
+}
+
+void _sniff_sync(struct sniff_sample* sample)
+{
+	const char* data = sample->data;
+	size_t len = sample->len;
+	size_t misplaced[2] = {0, 0};
+	size_t first_eol = len;
+
+	unsigned parity = 0;
+	for (; parity < 2; ++parity) {
+		_Bool inside = parity;
+		size_t i = 0;
+		for (; i < len; ++i) {
+			if (data[i] == '"') {
+				/* wraps around for i == 0 */
+				size_t near = (inside) ? i + 1 : i - 1;
+				if (near < len && !_is_edge(data[near])) {
+					++misplaced[parity];
+				}
+				inside = !inside;
+			} else if (parity && !inside && _is_eol(data[i]) && first_eol == len) {
+				first_eol = i;
+			}
+		}
+	}
+	if (misplaced[1] >= misplaced[0]) {
+		return;
+	}
+
+	if (first_eol + 1 < len && data[first_eol] == '\r' && data[first_eol + 1] == '\n') {
+		++first_eol;
+	}
+	if (first_eol < len) {
+		++first_eol;
+	}
+	sample->data += first_eol;
+	sample->len -= first_eol;
+}
+
+const char* _sniff_weak_end(const char* it, const char* end, char delim)
+{
+	for (++it; it < end && !_is_eol(*it); ++it) {
+		if (*it == '"' && (it + 1 == end || it[1] == delim || _is_eol(it[1]))) {
+			return it + 1;
+		}
+	}
+	return NULL;
+}
+
+void _sniff_field_counts(const struct sniff_sample* samples,
+                         unsigned n,
+                         char delim,
+                         enum quote_style quotes,
+                         unsigned max_breaks,
+                         struct sniff_stats* stats)
+{
+	vec_clear(&stats->field_counts);
+	unsigned i = 0;
+	for (; i < n; ++i) {
+		const char* it = samples[i].data;
+		const char* end = it + samples[i].len;
+		unsigned fields = 1;
+		unsigned breaks = 0;
+		_Bool field_start = true;
+		_Bool quoted_field = false;
+		_Bool inside = false;
+
+		for (; it < end; ++it) {
+			_Bool eol = _is_eol(*it);
+			if (eol && *it == '\r' && it + 1 < end && it[1] == '\n') {
+				++it;
+			}
+
+			/* Give up on a quote the parser would give up on */
+			if (inside && eol && ++breaks > max_breaks) {
+				inside = false;
+			}
+
+			if (*it == '"' && quotes == QUOTE_RFC4180
+			    && (field_start || quoted_field)) {
+				quoted_field = true;
+				inside = !inside;
+				breaks = 0;
+			} else if (*it == '"' && quotes == QUOTE_WEAK && field_start) {
+				const char* weak_end = _sniff_weak_end(it, end, delim);
+				if (weak_end) {
+					it = weak_end - 1;
+				}
+			} else if (inside) {
+				/* qualified */
+			} else if (*it == delim || eol) {
+				if (eol) {
+					vec_push_back(&stats->field_counts, &fields);
+					fields = 0;
+				}
+				++fields;
+				quoted_field = false;
+				field_start = true;
+				continue;
+			}
+			field_start = false;
+		}
+		if (!field_start || fields > 1) {
+			vec_push_back(&stats->field_counts, &fields);
+		}
+	}
+
+	stats->mode = 1;
+	stats->consistency = 0;
+	size_t lines = stats->field_counts.size;
+	if (lines == 0) {
+		return;
+	}
+
+	unsigned* counts = stats->field_counts.data;
+	qsort(counts, lines, sizeof(*counts), _cmp_unsigned);
+
+	size_t best = 0;
+	size_t run = 0;
+	for (i = 0; i < lines; ++i) {
+		run = (i > 0 && counts[i] == counts[i - 1]) ? run + 1 : 1;
+		if (run > best) {
+			best = run;
+			stats->mode = counts[i];
+		}
+	}
+	stats->consistency = (double)best / lines;
+}
+
+enum sniff_field _sniff_quoted(const char* data,
+                               size_t len,
+                               size_t begin,
+                               char delim,
+                               unsigned max_breaks,
+                               size_t* end)
+{
+	const char* weak_end = _sniff_weak_end(&data[begin], &data[len], delim);
+
+	/* Follow it the way the RFC4180 parser would. Text
+	 * after a closing quote is accepted there, but it
+	 * is what fields quoted the weak way look like.
+	 */
+	unsigned breaks = 0;
+	_Bool inside = true;
+	_Bool stray = false;
+	_Bool escaped = false;
+	size_t i = begin + 1;
+	for (; i < len; ++i) {
+		char c = data[i];
+		if (c == '"' && inside && i + 1 < len && data[i + 1] == '"') {
+			escaped = true;
+			++i;
+		} else if (c == '"') {
+			inside = !inside;
+			stray |= (!inside && i + 1 < len && data[i + 1] != delim
+			          && !_is_eol(data[i + 1]));
+		} else if (!inside && (c == delim || _is_eol(c))) {
+			break;
+		} else if (_is_eol(c) && !(c == '\n' && data[i - 1] == '\r')
+		           && ++breaks > max_breaks) {
+			break;
+		}
+	}
+	if (stray && weak_end) {
+		*end = weak_end - data;
+		return SNIFF_WEAK;
+	}
+	if (inside && i == len) {
+		*end = len;
+		return SNIFF_CUT;
+	}
+
+	/* Closed on another line by what looks like an opening
+	 * quote is a field that was never closed.
+	 */
+	if (!inside && !(stray && breaks)) {
+		*end = i;
+		return (escaped || breaks) ? SNIFF_RFC4180 : SNIFF_PLAIN;
+	}
+
+	*end = begin + 1;
+	while (*end < len && !_is_eol(data[*end])) {
+		++*end;
+	}
+	return SNIFF_NONE;
+}
+
+int csv_reader_sniff(struct csv_reader* self, struct csv_dialect* dialect)
+{
+	csvfail_if_(!self->_in->is_mmap && self->_in->file == stdin, "cannot sniff stdin");
+	csvfail_if_(self->_in->decompress, "cannot sniff compressed input");
+
+	size_t size = self->_in->file_size;
+	size_t offsets[SNIFF_BLOCKS] = {0, size / 2, size - SNIFF_BLOCK_SIZE};
+	unsigned n = SNIFF_BLOCKS;
+	if (size <= SNIFF_BLOCKS * SNIFF_BLOCK_SIZE) {
+		n = (size + SNIFF_BLOCK_SIZE - 1) / SNIFF_BLOCK_SIZE;
+		offsets[1] = SNIFF_BLOCK_SIZE;
+		offsets[2] = 2 * SNIFF_BLOCK_SIZE;
+	}
+
+	char* buf = malloc_(SNIFF_BLOCKS * SNIFF_BLOCK_SIZE);
+	struct sniff_sample samples[SNIFF_BLOCKS];
+	unsigned i = 0;
+	for (; i < n; ++i) {
+		if (_sniff_read(self, &buf[i * SNIFF_BLOCK_SIZE], offsets[i], &samples[i])
+		    == CSV_FAIL) {
+			free_(buf);
+			return CSV_FAIL;
+		}
+		if (offsets[i] > 0) {
+			_sniff_sync(&samples[i]);
+		}
+	}
+
+	/* Delimiter: the one giving the most lines the same
+	 * number of fields. Comma if none gives more than one.
+	 */
+	struct sniff_stats stats;
+	vec_construct_(&stats.field_counts, unsigned);
+
+	const char* delims = SNIFF_DELIMS;
+	char delim = ',';
+	unsigned field_count = 1;
+	double consistency = 0;
+	size_t lines = 0;
+	for (i = 0; delims[i]; ++i) {
+		_sniff_field_counts(samples,
+		                    n,
+		                    delims[i],
+		                    QUOTE_RFC4180,
+		                    self->_in->max_newlines,
+		                    &stats);
+		if (i == 0 || (stats.mode > 1 && (field_count == 1
+		                                 || stats.consistency > consistency))) {
+			delim = delims[i];
+			field_count = stats.mode;
+			consistency = stats.consistency;
+			lines = stats.field_counts.size;
+		}
+	}
+
+	/* Quote style: how fields that begin with a quote end */
+	unsigned kinds[SNIFF_CUT + 1] = {0};
+	unsigned crlf = 0;
+	unsigned lf = 0;
+	unsigned cr = 0;
+	for (i = 0; i < n; ++i) {
+		const char* data = samples[i].data;
+		size_t len = samples[i].len;
+		_Bool field_start = true;
+		size_t pos = 0;
+		while (pos < len) {
+			char c = data[pos];
+			if (field_start && c == '"') {
+				++kinds[_sniff_quoted(data,
+				                      len,
+				                      pos,
+				                      delim,
+				                      self->_in->max_newlines,
+				                      &pos)];
+				field_start = false;
+				continue;
+			}
+			if (c == '\r' && pos + 1 < len && data[pos + 1] == '\n') {
+				++crlf;
+				++pos;
+			} else if (c == '\r') {
+				++cr;
+			} else if (c == '\n') {
+				++lf;
+			}
+			field_start = (c == delim || _is_eol(c));
+			++pos;
+		}
+	}
+
+	/* The style most fields that only read right with one
+	 * style need. Plain quoted fields do not count.
+	 */
+	enum quote_style quotes = QUOTE_RFC4180;
+	unsigned best = kinds[SNIFF_RFC4180];
+	if (kinds[SNIFF_WEAK] > best) {
+		quotes = QUOTE_WEAK;
+		best = kinds[SNIFF_WEAK];
+	}
+	if (kinds[SNIFF_NONE] > best) {
+		quotes = QUOTE_NONE;
+		best = kinds[SNIFF_NONE];
+	}
+	unsigned telling = kinds[SNIFF_RFC4180] + kinds[SNIFF_WEAK] + kinds[SNIFF_NONE];
+	double agreement = (telling) ? (double)best / telling : 1;
+
+	/* Records split differently with the other styles */
+	if (quotes != QUOTE_RFC4180) {
+		_sniff_field_counts(samples, n, delim, quotes, self->_in->max_newlines, &stats);
+		field_count = stats.mode;
+		consistency = stats.consistency;
+		lines = stats.field_counts.size;
+	}
+	vec_destroy(&stats.field_counts);
+	free_(buf);
+
+	*dialect = (struct csv_dialect) {
+	        .quotes = quotes,
+	        .field_count = field_count,
+	        .confidence = consistency * agreement,
+	        .delim = {delim, '\0'},
+	        .line_ending = "\n",
+	};
+	if (lines < SNIFF_MIN_LINES) {
+		dialect->confidence *= (double)lines / SNIFF_MIN_LINES;
+	}
+	if (crlf > lf && crlf >= cr) {
+		strcpy(dialect->line_ending, "\r\n");
+	} else if (cr > lf) {
+		strcpy(dialect->line_ending, "\r");
+	}
+
+	return CSV_GOOD;
+}
+
+void csv_reader_set_dialect(struct csv_reader* self, const struct csv_dialect* dialect)
+{
+	csv_reader_set_delim(self, dialect->delim);
+	self->quotes = dialect->quotes;
+}
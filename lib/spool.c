@@ -0,0 +1,124 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "csv.h"
+#include "csverror.h"
+#include "internal.h"
+#include "util/util.h"
+
+/* Most bytes moved by one splice(2) or read(2) */
+#define SPOOL_BLOCK_SIZE (1 << 20)
+
+/**
+ * An unnamed file for the copy: O_TMPFILE in `dir', or a
+ * memfd if `dir' is NULL. Returns -1 on failure.
+ */
+int _spool_create(const char* dir);
+
+/**
+ * Append everything left in `in' to `out'. Pages of a pipe
+ * are spliced without passing through user space. Anything
+ * else is read and written.
+ */
+int _spool_copy(int in, int out);
+
+/**
+ * Set `spool' to a seekable descriptor with the contents
+ * of `fd' from its current offset on. A regular file read
+ * from the beginning is only duplicated.
+ */
+int _spool_fd(int fd, const char* dir, int* spool);
+
+int _spool_create(const char* dir)
+{
+	if (dir == NULL) {
+		return memfd_create("csv_spool", MFD_CLOEXEC);
+	}
+	return open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+}
+
+int _spool_copy(int in, int out)
+{
+	struct stat sb;
+	csvfail_if_(fstat(in, &sb) == -1, "fstat");
+
+	if (S_ISFIFO(sb.st_mode)) {
+		ssize_t n = 0;
+		do {
+			n = splice(in, NULL, out, NULL, SPOOL_BLOCK_SIZE, SPLICE_F_MOVE);
+		} while (n > 0 || (n == -1 && errno == EINTR));
+
+		if (n == 0) {
+			return CSV_GOOD;
+		}
+		/* The target does not take splices. Copy the rest. */
+		csvfail_if_(errno != EINVAL, "splice");
+	}
+
+	char* buf = malloc_(SPOOL_BLOCK_SIZE);
+	ssize_t n = 0;
+	for (;;) {
+		n = read(in, buf, SPOOL_BLOCK_SIZE);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+
+		if (write_all(out, buf, n) == -1) {
+			n = -1;
+			break;
+		}
+	}
+	free_(buf);
+	csvfail_if_(n == -1, "spool");
+
+	return CSV_GOOD;
+}
+
+int _spool_fd(int fd, const char* dir, int* spool)
+{
+	struct stat sb;
+	csvfail_if_(fstat(fd, &sb) == -1, "fstat");
+	if (S_ISREG(sb.st_mode) && lseek(fd, 0, SEEK_CUR) == 0) {
+		*spool = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		csvfail_if_(*spool == -1, "dup");
+		return CSV_GOOD;
+	}
+
+	*spool = _spool_create(dir);
+	csvfail_if_(*spool == -1, (dir) ? dir : "memfd_create");
+
+	int ret = _spool_copy(fd, *spool);
+	if (ret == CSV_GOOD && lseek(*spool, 0, SEEK_SET) == -1) {
+		ret = CSV_FAIL;
+	}
+	if (ret == CSV_FAIL) {
+		close(*spool);
+	}
+	return ret;
+}
+
+int csv_reader_spool(struct csv_reader* self, int fd, const char* dir)
+{
+	int spool = -1;
+	if (_spool_fd(fd, dir, &spool) == CSV_FAIL) {
+		return CSV_FAIL;
+	}
+	return csv_reader_open_fd(self, spool, "spool");
+}
+
+int csv_reader_spool_mmap(struct csv_reader* self, int fd, const char* dir)
+{
+	int spool = -1;
+	if (_spool_fd(fd, dir, &spool) == CSV_FAIL) {
+		return CSV_FAIL;
+	}
+	return csv_reader_map_fd(self, spool, "spool");
+}
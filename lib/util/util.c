@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <dirent.h>
+#include <unistd.h>
 
 int str2longbase(long* restrict ret, const char* restrict s, int base)
 {
@@ -53,7 +54,7 @@ int charncount(const char* restrict s, char c, unsigned n)
 {
 	int count = 0;
 	unsigned i = 0;
-	for(; s[i] != '\0' && i < n; ++i)
+	for(; i < n && s[i] != '\0'; ++i)
 		if (s[i] == c)
 			++count;
 
@@ -202,3 +203,20 @@ node* dir_list_files(const char* restrict dir)
 
 	return files;
 }
+
+int write_all(int fd, const void* buf, size_t len)
+{
+	const char* it = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, it, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		it += n;
+		len -= n;
+	}
+	return 0;
+}
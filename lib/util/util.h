@@ -194,6 +194,16 @@ char* strnstr(const char* restrict s, const char* restrict find, size_t slen);
 
 struct node* dir_list_files(const char* restrict dir);
 
+/**
+ * write_all writes all `len' bytes of `buf' to `fd',
+ * retrying short writes and EINTR.
+ *
+ * returns:
+ *      - 0 on success
+ *      - -1 with errno set on failure
+ */
+int write_all(int fd, const void* buf, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
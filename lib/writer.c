@@ -2,19 +2,88 @@
 #define _GNU_SOURCE
 #endif
 
+#include "config.h"
 #include "csv.h"
+#include <fcntl.h>
 #include <libgen.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "compress.h"
 #include "csvsignal.h"
 #include "csverror.h"
 #include "internal.h"
 #include "misc.h"
+#include "simd.h"
 #include "util/util.h"
 
+/* Largest single copy_file_range(2) or sendfile(2) */
+#define WRITER_COPY_CHUNK (1 << 30)
+
+/* read(2)/write(2) block where the kernel cannot copy */
+#define WRITER_COPY_BLOCK (1 << 20)
+
+/* Directories CSV_SYNC_BATCH leaves before syncing anyway */
+#define WRITER_SYNC_BATCH 64
+
+/**
+ * Write to the temp file open at `fd' through a FILE*,
+ * compressed if the writer was asked to.
+ */
+int _writer_fdopen(struct csv_writer*, int fd);
+
+/**
+ * Write out the buffer followed by `len' bytes of `data',
+ * with writev(2) if the writer has a threshold and the
+ * file a descriptor, or fwrite. The buffer is empty after.
+ */
+int _writer_flush(struct csv_writer*, const char* data, size_t len);
+
+/* Add to the buffer, or write out with it if `len' is
+ * as large as the threshold.
+ */
+void _writer_append(struct csv_writer*, const char* data, size_t len);
+
+/* Format a field into the buffer. Returns its length. */
+size_t _format_field(struct csv_writer*, const struct csv_field*);
+
+/**
+ * Copy all of the file open at `fd' to `out' with
+ * copy_file_range(2), sendfile(2) where that does not
+ * work, and read(2)/write(2) where neither does.
+ * Returns -1 with errno set on failure.
+ */
+int _writer_copy(int fd, int out);
+
+/**
+ * Make the file durable the way the writer's sync
+ * policy says. `dir' is for its directory entry.
+ */
+int _writer_sync_file(struct csv_writer*, const char* file, _Bool dir);
+
+int _writer_fdopen(struct csv_writer* self, int fd)
+{
+	if (self->_in->compression != CSV_COMPRESS_NONE) {
+		return csv_compress_open(self, fd);
+	}
+	self->_in->file = fdopen(fd, "w");
+	csvfail_if_(!self->_in->file, string_c_str(&self->_in->tempname));
+	return CSV_GOOD;
+}
+
 struct csv_writer* csv_writer_new()
 {
 	struct csv_writer* self = malloc_(sizeof(*self));
 	return csv_writer_construct(self);
 }
+struct csv_writer* csv_writer_new_like(const struct csv_writer* other)
+{
+	struct csv_writer* self = csv_writer_new();
+	self->quotes = other->quotes;
+	csv_writer_set_delim(self, string_c_str(&other->_in->delim));
+	csv_writer_set_line_ending(self, string_c_str(&other->_in->rec_terminator));
+	return self;
+}
+
 struct csv_writer* csv_writer_construct(struct csv_writer* self)
 {
 	init_sig();
@@ -29,6 +98,7 @@ struct csv_writer* csv_writer_construct(struct csv_writer* self)
 	string_construct(&self->_in->tempname);
 	string_construct(&self->_in->filename);
 	string_construct(&self->_in->buffer);
+	vec_construct_(&self->_in->synced, int);
 	string_construct_from_char_ptr(&self->_in->delim, ",");
 	string_construct_from_char_ptr(&self->_in->rec_terminator, "\n");
 
@@ -45,6 +115,9 @@ void csv_writer_destroy(struct csv_writer* self)
 {
 	csv_perror();
 
+	if (self->_in->file) {
+		csv_writer_flush(self);
+	}
 	if (csv_writer_isopen(self)) {
 		fclose(self->_in->file);
 	}
@@ -58,6 +131,8 @@ void csv_writer_destroy(struct csv_writer* self)
 		tmp_remove_file(string_c_str(tmp));
 		tmp_remove_node(self->_in->tmp_node);
 	}
+	csv_writer_sync(self);
+	vec_destroy(&self->_in->synced);
 	string_destroy(&self->_in->tempname);
 	string_destroy(&self->_in->filename);
 	string_destroy(&self->_in->buffer);
@@ -66,74 +141,217 @@ void csv_writer_destroy(struct csv_writer* self)
 	free_(self->_in);
 }
 
-int _write_field_manually(struct csv_writer* self, const struct csv_field* field)
+/* Make room for `len' more bytes in the buffer */
+static char* _writer_reserve(struct csv_writer* self, size_t len)
 {
-	unsigned i = 0;
-	unsigned quote_count = 2;
-	fputc('"', self->_in->file);
-	for (; i < field->len; ++i) {
-		fputc(field->data[i], self->_in->file);
-		if (field->data[i] == '"') {
-			fputc('"', self->_in->file);
-			++quote_count;
+	string* buf = &self->_in->buffer;
+	if (buf->size + len >= buf->_alloc) {
+		vec_reserve(buf, 2 * (buf->size + len));
+	}
+	return (char*)buf->data + buf->size;
+}
+
+/* write(2) all of the buffer and then `data' */
+static int _writer_writev(struct csv_writer* self, int fd, const char* data, size_t len)
+{
+	string* buf = &self->_in->buffer;
+	struct iovec iov[2] = {
+	        {buf->data, buf->size},
+	        {(void*)data, len},
+	};
+	struct iovec* it = iov;
+	int count = (len) ? 2 : 1;
+	while (count > 0) {
+		ssize_t n = writev(fd, it, count);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		for (; count > 0 && (size_t)n >= it->iov_len; --count, ++it) {
+			n -= it->iov_len;
+		}
+		if (count > 0) {
+			it->iov_base = (char*)it->iov_base + n;
+			it->iov_len -= n;
 		}
 	}
-	fputc('"', self->_in->file);
+	return 0;
+}
 
-	return quote_count + field->len;
+int _writer_flush(struct csv_writer* self, const char* data, size_t len)
+{
+	string* buf = &self->_in->buffer;
+	FILE* file = self->_in->file;
+	int fd = (self->_in->threshold) ? fileno(file) : -1;
+
+	int ret = 0;
+	if (fd == -1) {
+		if (fwrite(buf->data, 1, buf->size, file) != buf->size
+		    || (len && fwrite(data, 1, len, file) != len)) {
+			ret = -1;
+		}
+	} else {
+		/* Whatever went through the FILE comes first */
+		ret = fflush(file);
+		if (ret == 0) {
+			ret = _writer_writev(self, fd, data, len);
+		}
+	}
+	buf->size = 0;
+	csvfail_if_(ret, "write");
+	return CSV_GOOD;
 }
 
-int csv_write_field(struct csv_writer* self, const struct csv_field* field)
+void _writer_append(struct csv_writer* self, const char* data, size_t len)
+{
+	/* Too large to be worth copying */
+	if (self->_in->threshold && len >= self->_in->threshold) {
+		_writer_flush(self, data, len);
+		return;
+	}
+	if (len) {
+		memcpy(_writer_reserve(self, len), data, len);
+		self->_in->buffer.size += len;
+	}
+}
+
+/* Write the buffer out if it reached the threshold */
+static void _writer_commit(struct csv_writer* self)
+{
+	if (self->_in->buffer.size > 0 && self->_in->buffer.size >= self->_in->threshold) {
+		_writer_flush(self, NULL, 0);
+	}
+}
+
+/* Double every quote. The spans between quotes
+ * are copied whole. Returns the length written.
+ */
+static size_t _format_escaped(struct csv_writer* self, const struct csv_field* field)
 {
+	char* begin = _writer_reserve(self, 2 * field->len + 2);
+	char* out = begin;
+	const char* it = field->data;
+	const char* end = it + field->len;
+	const char* quote = NULL;
+
+	*out++ = '"';
+	while ((quote = memchr(it, '"', end - it)) != NULL) {
+		memcpy(out, it, quote + 1 - it);
+		out += quote + 1 - it;
+		*out++ = '"';
+		it = quote + 1;
+	}
+	memcpy(out, it, end - it);
+	out += end - it;
+	*out++ = '"';
+
+	self->_in->buffer.size += out - begin;
+	return out - begin;
+}
+
+size_t _format_field(struct csv_writer* self, const struct csv_field* field)
+{
+	unsigned found = 0;
 	if (self->quotes != QUOTE_NONE) {
-		bool quote_current_field = (self->quotes == QUOTE_ALL);
+		found = simd_quoting(field->data,
+		                     field->len,
+		                     self->_in->delim.data,
+		                     self->_in->delim.size);
+	}
 
-		if (memchr(field->data, '"', field->len)) {
-			quote_current_field = true;
-			if (self->quotes >= QUOTE_RFC4180) {
-				return _write_field_manually(self, field);
-			}
-		}
-		if (quote_current_field || memchr(field->data, '\r', field->len)
-		    || memchr(field->data, '\n', field->len)
-		    || (self->_in->delim.size > 0
-		        && memmem(field->data,
-		                  field->len,
-		                  self->_in->delim.data,
-		                  self->_in->delim.size))) {
-			fprintf(self->_in->file, "\"%.*s\"", field->len, field->data);
-			return field->len + 2;
+	if (found == SIMD_QUOTE_CHAR && self->quotes >= QUOTE_RFC4180) {
+		return _format_escaped(self, field);
+	}
+	if (found || self->quotes == QUOTE_ALL) {
+		char* out = _writer_reserve(self, field->len + 2);
+		*out = '"';
+		if (field->len) {
+			memcpy(out + 1, field->data, field->len);
 		}
+		out[field->len + 1] = '"';
+		self->_in->buffer.size += field->len + 2;
+		return field->len + 2;
 	}
 
-	fwrite(field->data, 1, field->len, self->_in->file);
+	_writer_append(self, field->data, field->len);
 	return field->len;
 }
 
+int csv_write_field(struct csv_writer* self, const struct csv_field* field)
+{
+	size_t len = _format_field(self, field);
+	_writer_commit(self);
+	return len;
+}
+
 int csv_write_record(struct csv_writer* self, struct csv_record* rec)
 {
+	const string* delim = &self->_in->delim;
+	const string* terminator = &self->_in->rec_terminator;
+
 	int i = 0;
 	unsigned len = 0;
 	for (; i < rec->size; ++i) {
 		if (i) {
-			fputs(string_c_str(&self->_in->delim), self->_in->file);
-			len += self->_in->delim.size;
+			_writer_append(self, delim->data, delim->size);
+			len += delim->size;
 		}
-		len += csv_write_field(self, &rec->fields[i]);
+		len += _format_field(self, &rec->fields[i]);
 	}
 
-	fputs(string_c_str(&self->_in->rec_terminator), self->_in->file);
-	return len + self->_in->rec_terminator.size;
+	_writer_append(self, terminator->data, terminator->size);
+	_writer_commit(self);
+	return len + terminator->size;
+}
+
+int csv_writer_write(struct csv_writer* self, const char* data, size_t len)
+{
+	_writer_append(self, data, len);
+	_writer_commit(self);
+	return len;
+}
+
+int csv_writer_flush(struct csv_writer* self)
+{
+	if (self->_in->buffer.size == 0) {
+		return CSV_GOOD;
+	}
+	return _writer_flush(self, NULL, 0);
 }
 
 int csv_writer_reset(struct csv_writer* self)
 {
 	csvfail_if_(self->_in->file == stdout, "Cannot reset stdout");
 	csvfail_if_(!self->_in->file, "No file to reset");
+	string_clear(&self->_in->buffer);
 	csvfail_if_(fclose(self->_in->file) == EOF, string_c_str(&self->_in->tempname));
-	self->_in->file = fopen(string_c_str(&self->_in->tempname), "w");
-	csvfail_if_(!self->_in->file, string_c_str(&self->_in->tempname));
+	self->_in->file = NULL;
+	int fd = open(string_c_str(&self->_in->tempname), O_WRONLY | O_CREAT, 0666);
+	csvfail_if_(fd == -1, string_c_str(&self->_in->tempname));
+	if (ftruncate(fd, self->_in->mark) == -1
+	    || lseek(fd, self->_in->mark, SEEK_SET) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		csvfail_if_(true, string_c_str(&self->_in->tempname));
+	}
+
+	return _writer_fdopen(self, fd);
+}
 
+int csv_writer_mark(struct csv_writer* self)
+{
+	csvfail_if_(self->_in->file == stdout, "Cannot mark stdout");
+	csvfail_if_(!self->_in->file, "No file to mark");
+	csvfail_if_(self->_in->compression != CSV_COMPRESS_NONE,
+	            "Cannot mark compressed output");
+	try_(csv_writer_flush(self));
+	csvfail_if_(fflush(self->_in->file) == EOF, string_c_str(&self->_in->tempname));
+	off_t mark = lseek(fileno(self->_in->file), 0, SEEK_CUR);
+	csvfail_if_(mark == -1, string_c_str(&self->_in->tempname));
+	self->_in->mark = mark;
 	return CSV_GOOD;
 }
 
@@ -155,11 +373,9 @@ int csv_writer_mktmp(struct csv_writer* self)
 	int fd = mkstemp(self->_in->tempname.data);
 	csvfail_if_(fd == -1, string_c_str(&self->_in->tempname));
 
-	self->_in->file = fdopen(fd, "w");
-	csvfail_if_(!self->_in->file, string_c_str(&self->_in->tempname));
-
 	self->_in->tmp_node = tmp_push(&self->_in->tempname);
-	return CSV_GOOD;
+	self->_in->mark = 0;
+	return _writer_fdopen(self, fd);
 }
 
 char* csv_writer_export_tmp(struct csv_writer* self)
@@ -203,6 +419,7 @@ struct csv_field csv_writer_get_terminator_field(struct csv_writer* self)
 
 FILE* csv_writer_get_file(struct csv_writer* self)
 {
+	csv_writer_flush(self);
 	return self->_in->file;
 }
 
@@ -232,6 +449,9 @@ char* csv_writer_detach_filename(struct csv_writer* self)
 
 void csv_writer_set_file(struct csv_writer* self, FILE* out_file)
 {
+	if (self->_in->file) {
+		csv_writer_flush(self);
+	}
 	self->_in->file = out_file;
 }
 
@@ -245,6 +465,53 @@ void csv_writer_set_line_ending(struct csv_writer* self, const char* ending)
 	string_strcpy(&self->_in->rec_terminator, ending);
 }
 
+int csv_writer_set_compression(struct csv_writer* self,
+                               enum csv_compression compression,
+                               int level)
+{
+	csvfail_if_(!csv_compress_supported(compression),
+	            "compression not supported by this build");
+	self->_in->compression = compression;
+	self->_in->level = level;
+	return CSV_GOOD;
+}
+
+void csv_writer_set_threads(struct csv_writer* self, unsigned threads)
+{
+	self->_in->threads = threads;
+}
+
+void csv_writer_set_sync(struct csv_writer* self, enum csv_sync sync)
+{
+	self->_in->sync = sync;
+}
+
+void csv_writer_set_buffer(struct csv_writer* self, size_t threshold)
+{
+	csv_writer_flush(self);
+	self->_in->threshold = threshold;
+	if (threshold && threshold != SIZE_MAX) {
+		_writer_reserve(self, threshold);
+	}
+}
+
+int csv_writer_sync(struct csv_writer* self)
+{
+	vec* synced = &self->_in->synced;
+	int ret = 0;
+	unsigned i = 0;
+	for (; i < synced->size; ++i) {
+		int fd = *(int*)vec_at(synced, i);
+		if (fsync(fd) == -1 && ret == 0) {
+			ret = -1;
+		}
+		close(fd);
+	}
+	vec_clear(synced);
+	csvfail_if_(ret, "fsync");
+	return CSV_GOOD;
+}
+
 int csv_writer_open(struct csv_writer* self, const char* filename)
 {
 	csvfail_if_(csv_writer_isopen(self), "write file already open");
@@ -260,8 +527,9 @@ void csv_writer_set_filename(struct csv_writer* self, const char* filename)
 
 int csv_writer_close(struct csv_writer* self)
 {
-	if (self->_in->file == stdout)
-		return CSV_GOOD;
+	int ret = csv_writer_flush(self);
+	if (self->_in->file == stdout || ret == CSV_FAIL)
+		return ret;
 
 	csvfail_if_(fclose(self->_in->file) == EOF, string_c_str(&self->_in->tempname));
 	self->_in->file = NULL;
@@ -276,24 +544,122 @@ int csv_writer_close(struct csv_writer* self)
 	const char* tmp = string_c_str(&self->_in->tempname);
 
 	if (!string_empty(&self->_in->filename)) {
+		try_(_writer_sync_file(self, tmp, false));
 		csvfail_if_(rename(tmp, file), tmp);
 		csvfail_if_(chmod(file, 0666), file);
+		try_(_writer_sync_file(self, file, true));
 	} else {
-		/* TODO: We are assuming all the written
-		 *       data has made it to disk. We really
-		 *       should be using fsync to check.
-		 */
-		FILE* dump_file = fopen(tmp, "r");
-		csvfail_if_(!dump_file, tmp);
-
-		char c = '\0';
-		while ((c = getc(dump_file)) != EOF)
-			putchar(c);
-
-		csvfail_if_(fclose(dump_file) == EOF, tmp);
-		tmp_remove_file(self->_in->tmp_node->data);
+		/* Anything already in stdout goes first */
+		fflush(stdout);
+		int fd = open(tmp, O_RDONLY);
+		csvfail_if_(fd == -1, tmp);
+		int ret = _writer_copy(fd, STDOUT_FILENO);
+		close(fd);
+		csvfail_if_(ret == -1, tmp);
+		tmp_remove_file(tmp);
 	}
 	tmp_remove_node(self->_in->tmp_node);
 	self->_in->tmp_node = NULL;
 	return CSV_GOOD;
 }
+
+int _writer_copy(int fd, int out)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		return -1;
+	}
+
+	char* buf = NULL;
+	off_t offset = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	int method = 0;
+#else
+	int method = 1;
+#endif
+	while (offset < sb.st_size) {
+		size_t len = sb.st_size - offset;
+		if (len > WRITER_COPY_CHUNK) {
+			len = WRITER_COPY_CHUNK;
+		}
+
+		ssize_t n = -1;
+		switch (method) {
+#ifdef HAVE_COPY_FILE_RANGE
+		case 0:
+			n = copy_file_range(fd, &offset, out, NULL, len, 0);
+			break;
+#endif
+		case 1:
+			n = sendfile(out, fd, &offset, len);
+			break;
+		default:
+			if (buf == NULL) {
+				buf = malloc_(WRITER_COPY_BLOCK);
+			}
+			if (len > WRITER_COPY_BLOCK) {
+				len = WRITER_COPY_BLOCK;
+			}
+			n = pread(fd, buf, len, offset);
+			if (n > 0 && write_all(out, buf, n) == -1) {
+				n = -1;
+			}
+			if (n > 0) {
+				offset += n;
+			}
+		}
+
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		/* Not between these files or on this kernel */
+		if (n == -1 && method < 2
+		    && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF
+		        || errno == EOPNOTSUPP)) {
+			++method;
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+	}
+
+	int err = errno;
+	free_if_exists_(buf);
+	errno = err;
+	return (offset < sb.st_size) ? -1 : 0;
+}
+
+int _writer_sync_file(struct csv_writer* self, const char* file, _Bool dir)
+{
+	if (self->_in->sync == CSV_SYNC_NONE) {
+		return CSV_GOOD;
+	}
+
+	int fd = -1;
+	if (dir) {
+		char* path = strdup(file);
+		fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+		free_(path);
+	} else {
+		fd = open(file, O_RDONLY);
+	}
+	csvfail_if_(fd == -1, file);
+
+	/* The data has to be down before the rename, or a
+	 * crash can leave the new name on an empty file. Only
+	 * the directory entries can wait for csv_writer_sync.
+	 */
+	if (!dir || self->_in->sync == CSV_SYNC_CLOSE) {
+		int ret = fsync(fd);
+		close(fd);
+		csvfail_if_(ret, file);
+		return CSV_GOOD;
+	}
+
+	vec_push_back(&self->_in->synced, &fd);
+	if (self->_in->synced.size >= WRITER_SYNC_BATCH) {
+		return csv_writer_sync(self);
+	}
+	return CSV_GOOD;
+}
@@ -2,41 +2,77 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "util.h"
 #include "csv.h"
 
 static const char* helpString =
-"\nUsage: stdcsv [vhniqQxXS] [-N field_count] [-dD delimiter]"
-"\n       [-r new_line_replacement] [-o outputfile] input_file"
+"\nUsage: stdcsv [cCvhlniqQsxXSzZ] [-N field_count] [-dD delimiter] [-jp threads]"
+"\n       [-L max_newlines] [-r new_line_replacement] [-o outputfile] input_file"
 "\n"
+"\n-c|--concat               Write all input files as one, with the header"
+"\n                          of the first. Later files must have the same"
+"\n                          header. Files are parsed in parallel."
+"\n-C|--concat-all           Like --concat, but drop the first record of"
+"\n                          every later file without comparing it."
 "\n-d|--in-delimiter arg     Specify an input delimiter."
 "\n                          Default delimiters: comma, pipe, tab"
 "\n-D|--out-delimiter arg    Specify an output delimiter."
 "\n                          By default, the input delimiter is used."
 "\n-f|--failsafe             Use failsafe mode (more info below)."
+"\n-F|--failsafe-record      Failsafe mode that only re-reads the bad record."
 "\n-h|--help                 Print this help menu."
 "\n-i|--in-place             Files edited in place. This will not work for stdin."
+"\n-l|--count                Print the number of records instead of the records."
+"\n-L|--max-newlines arg     Most line breaks in one quoted field before the"
+"\n                          quote is taken to be a mistake. 0 for no limit."
+"\n-j|--threads arg          Parse with this many threads (implies --mmap)."
 "\n-m|--mmap                 Prefer to read via mmap."
+"\n-w|--mmap-window arg      Keep only about this many MiB of mmapped input"
+"\n                          in memory (implies --mmap)."
 "\n-M|--cr                   Output will have Macintosh line endings."
 "\n-n|--normalize            Output field count will match header."
 "\n-N|--num-fields arg       Specify number of output fields (Implies -n)"
 "\n-o|--output-file arg      Specify an output file. Default is stdout."
 "\n                          Note: This implies concatenation"
+"\n-p|--pipeline arg         Experimental. Read, parse and write on separate"
+"\n                          threads, with this many parsing. The output does"
+"\n                          not change, but it is not yet faster than without."
 "\n-x|--quotes arg           Specify quoting rules for input and output."
 "\n-Q|--out-quotes arg       Specify quoting rule set for output."
 "\n-q|--in-quotes arg        Specify quoting rule set for input."
 "\n                          Options: NONE, WEAK, RFC4180, ALL (details below)"
+"\n-s|--sniff                Guess the delimiter and input quotes from samples"
+"\n                          of each file. -d, -q and -x take precedence."
+"\n-S|--spool                Copy stdin to memory before reading it, so that"
+"\n                          --failsafe, --sniff and --mmap work on a pipe."
+"\n-T|--spool-dir arg        Like --spool with the copy in an unnamed file"
+"\n                          in this directory instead of memory."
 "\n-r|--no-embedded-nl       Remove embedded new lines."
 "\n-R|--replace-newline arg  Specify a string to replace embedded new lines."
 "\n-t|--trim                 Trim white space from read fields."
 //"\n-v|--verbose              More detailed output."
 "\n-W|--crlf                 Output will have Windows line endings."
+"\n-z|--gzip                 Compress the output with gzip."
+"\n-Z|--zstd                 Compress the output with zstd."
 "\n"
 "\nFAILSAFE MODE"
 "\nFailsafe mode allows us to loop through the different CSV rule sets"
 "\nlooking for violations along the way.  If a violation is discovered,"
 "\nfile reading is restarted from the beginning of the file."
-"\nNOTE: Failsafe mode will be turned off when reading from stdin."
+"\nNOTE: Failsafe mode will be turned off when reading from stdin"
+"\nunless it is spooled (-S or -T)."
+"\nWith --failsafe-record, only the record with the violation is read"
+"\nagain under the next rule set. Output written so far is kept and"
+"\nthe following records use the original rules. This works for stdin."
+"\n"
+"\nCOMPRESSED INPUT"
+"\nFiles that begin with gzip or zstd magic are decompressed as they are"
+"\nread, by up to --threads workers. BGZF blocks and files of several"
+"\nzstd frames are decompressed in parallel. Compressed stdin must be"
+"\nspooled. --sniff does not work on compressed input."
 "\n"
 "\nQUOTING RULES"
 "\n  NONE - Assume no text qualification."
@@ -51,31 +87,129 @@ typedef struct csv_reader csv_reader;
 typedef struct csv_writer csv_writer;
 typedef struct csv_record csv_record;
 
+/* Output buffered before each write(2) */
+#define WRITE_BUFFER (1 << 20)
+
 static _Bool prefer_mmap = false;
+static _Bool failsafe_record = false;
+static _Bool count_only = false;
+static _Bool sniff_dialect = false;
+static _Bool delim_given = false;
+static _Bool quotes_given = false;
+static _Bool spool_stdin = false;
+static const char* spool_dir = NULL;
+static const char* output_file = NULL;
+static _Bool compress_output = false;
+
+/* --pipeline: parsing threads, 0 for the serial loop */
+static unsigned pipeline_threads = 0;
 
 /** Conflicting Options **/
 static _Bool in_place_edit = false;
 static _Bool set_output_file = false;
+static _Bool concat = false;
+
+/* --concat-all: drop later headers without comparing */
+static _Bool concat_all = false;
+
+static struct option long_options[] =
+{
+	/* long option, (no) arg, 0, short option */
+	{"help", no_argument, 0, 'h'},
+	{"mmap", no_argument, 0, 'm'},
+	{"count", no_argument, 0, 'l'},
+	{"mmap-window", required_argument, 0, 'w'},
+	{"max-newlines", required_argument, 0, 'L'},
+	{"threads", required_argument, 0, 'j'},
+	{"normalize", no_argument, 0, 'n'},
+	{"num-fields", required_argument, 0, 'N'},
+	{"failsafe", no_argument, 0, 'f'},
+	{"failsafe-record", no_argument, 0, 'F'},
+	{"in-place-edit", no_argument, 0, 'i'},
+	{"quotes", required_argument, 0, 'x'},
+	{"out-quotes", required_argument, 0, 'Q'},
+	{"in-quotes", required_argument, 0, 'q'},
+	{"out-delimiter", required_argument, 0, 'd'},
+	{"in-delimiter", required_argument, 0, 'D'},
+	{"no-embedded-nl", no_argument, 0, 'r'},
+	{"embedded-nl-sub", required_argument, 0, 'R'},
+	{"output-file", required_argument, 0, 'o'},
+	{"pipeline", required_argument, 0, 'p'},
+	{"concat", no_argument, 0, 'c'},
+	{"concat-all", no_argument, 0, 'C'},
+	{"sniff", no_argument, 0, 's'},
+	{"spool", no_argument, 0, 'S'},
+	{"spool-dir", required_argument, 0, 'T'},
+	{"trim", no_argument, 0, 't'},
+	{"crlf", no_argument, 0, 'W'},
+	{"cr", no_argument, 0, 'M' },
+	{"gzip", no_argument, 0, 'z'},
+	{"zstd", no_argument, 0, 'Z'},
+	{0, 0, 0, 0}
+};
+static const char* short_options = "cCfFhlmMnirsStWzZd:D:j:L:N:o:p:Q:q:R:T:w:x:";
+
 
 void parseargs(char c, csv_reader* reader, csv_writer* writer)
 {
 	switch (c) {
-	case 'c':
-		fputs("Not yet implemented\n", stderr);
-		exit(EXIT_FAILURE);
-	case 'C':
-		fputs("Not yet implemented\n", stderr);
-		exit(EXIT_FAILURE);
+	case 'c': /* concat */
+		concat = true;
+		break;
+	case 'C': /* concat-all */
+		concat = true;
+		concat_all = true;
+		break;
+	case 'l':
+		count_only = true;
+		break;
 	case 'f':
 		reader->failsafe_mode = true;
 		//csv_open_temp(writer);
 		break;
+	case 'F':
+		reader->failsafe_mode = true;
+		csv_reader_set_failsafe_incremental(reader, true);
+		failsafe_record = true;
+		break;
 	case 'h': /* help */
 		puts(helpString);
 		exit(EXIT_SUCCESS);
+	case 'j': { /* threads */
+		long val = 0;
+		str2long(&val, optarg);
+		if (val < 1) {
+			fputs("Invalid number of threads.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		csv_reader_set_threads(reader, val);
+		prefer_mmap = true;
+	}
+		break;
+	case 'L': { /* max newlines */
+		long val = 0;
+		str2long(&val, optarg);
+		if (val < 0 || val > UINT_MAX) {
+			fputs("Invalid number of new lines.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		csv_reader_set_max_newlines(reader, val);
+	}
+		break;
 	case 'm':
 		prefer_mmap = true;
 		break;
+	case 'w': { /* mmap window */
+		long val = 0;
+		str2long(&val, optarg);
+		if (val < 1) {
+			fputs("Invalid mmap window.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		csv_reader_set_mmap_window(reader, (size_t)val << 20);
+		prefer_mmap = true;
+	}
+		break;
 	case 'n': /* normalize */
 		reader->normal = CSV_NORMAL_OPEN;
 		break;
@@ -92,7 +226,18 @@ void parseargs(char c, csv_reader* reader, csv_writer* writer)
 	case 'i': /* in-place-edit */
 		in_place_edit = true;
 		break;
+	case 'S': /* spool */
+		spool_stdin = true;
+		break;
+	case 'T': /* spool-dir */
+		spool_stdin = true;
+		spool_dir = optarg;
+		break;
+	case 's': /* sniff */
+		sniff_dialect = true;
+		break;
 	case 'x': /* quotes */
+		quotes_given = true;
 		if(!strcasecmp(optarg, "ALL")) {
 			writer->quotes = QUOTE_ALL;
 			reader->quotes = QUOTE_ALL;
@@ -135,6 +280,7 @@ void parseargs(char c, csv_reader* reader, csv_writer* writer)
 		}
 		break;
 	case 'q': /* in-quotes */
+		quotes_given = true;
 		if(!strcasecmp(optarg, "ALL"))
 			reader->quotes = QUOTE_ALL;
 		else if (!strcasecmp(optarg, "WEAK"))
@@ -156,6 +302,7 @@ void parseargs(char c, csv_reader* reader, csv_writer* writer)
 		break;
 	case 'd': /* input-delimiter */
 		csv_reader_set_delim(reader, optarg);
+		delim_given = true;
 		break;
 	case 'r': /* no-embedded-nl */
 		csv_reader_set_embedded_break(reader, "");
@@ -167,16 +314,36 @@ void parseargs(char c, csv_reader* reader, csv_writer* writer)
 		reader->trim = true;
 		break;
 	case 'o': /* output-file */
-		if (csv_writer_open(writer, optarg) == CSV_FAIL)
-			csv_perror_exit();
+		/* Opened once every option is known */
+		output_file = optarg;
 		set_output_file = 1;
 		break;
+	case 'p': { /* pipeline */
+		long val = 0;
+		str2long(&val, optarg);
+		if (val < 1 || val > UINT_MAX) {
+			fputs("Invalid number of threads.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		pipeline_threads = val;
+	}
+		break;
 	case 'W': /* windows-line-ending */
 		csv_writer_set_line_ending(writer, "\r\n");
 		break;
 	case 'M': /* mac-line-ending */
 		csv_writer_set_line_ending(writer, "\r");
 		break;
+	case 'z': /* gzip */
+		if (csv_writer_set_compression(writer, CSV_COMPRESS_GZIP, 0) == CSV_FAIL)
+			csv_perror_exit();
+		compress_output = true;
+		break;
+	case 'Z': /* zstd */
+		if (csv_writer_set_compression(writer, CSV_COMPRESS_ZSTD, 0) == CSV_FAIL)
+			csv_perror_exit();
+		compress_output = true;
+		break;
 	case '?': /* Should never get here... */
 		exit(EXIT_FAILURE);
 		break;
@@ -185,51 +352,330 @@ void parseargs(char c, csv_reader* reader, csv_writer* writer)
 	}
 }
 
-
-int main (int argc, char **argv)
+/* Apply the command line to a reader and writer */
+void parse_options(int argc, char** argv, csv_reader* reader, csv_writer* writer)
 {
 	int c = 0;
-
-	static struct option long_options[] =
-	{
-		/* long option, (no) arg, 0, short option */
-		{"help", no_argument, 0, 'h'},
-		{"mmap", no_argument, 0, 'm'},
-		{"normalize", no_argument, 0, 'n'},
-		{"num-fields", required_argument, 0, 'N'},
-		{"failsafe", no_argument, 0, 'f'},
-		{"in-place-edit", no_argument, 0, 'i'},
-		{"quotes", required_argument, 0, 'x'},
-		{"out-quotes", required_argument, 0, 'Q'},
-		{"in-quotes", required_argument, 0, 'q'},
-		{"out-delimiter", required_argument, 0, 'd'},
-		{"in-delimiter", required_argument, 0, 'D'},
-		{"no-embedded-nl", no_argument, 0, 'r'},
-		{"embedded-nl-sub", required_argument, 0, 'R'},
-		{"output-file", required_argument, 0, 'o'},
-		{"concat", no_argument, 0, 'c'},
-		{"concat-all", no_argument, 0, 'C'},
-		{"trim", no_argument, 0, 't'},
-		{"crlf", no_argument, 0, 'W'},
-		{"cr", no_argument, 0, 'M' },
-		{0, 0, 0, 0}
-	};
 	/* getopt_long stores the option index here. */
 	int option_index = 0;
 
+	while ( (c = getopt_long (argc, argv, short_options,
+				  long_options, &option_index)) != -1)
+		parseargs(c, reader, writer);
+}
+
+/* --sniff: options from the command line win */
+void sniff(csv_reader* reader)
+{
+	struct csv_dialect dialect;
+	if (csv_reader_sniff(reader, &dialect) == CSV_FAIL)
+		csv_perror_exit();
+
+	if (!delim_given)
+		csv_reader_set_delim(reader, dialect.delim);
+	if (!quotes_given)
+		reader->quotes = dialect.quotes;
+	if (dialect.confidence < 0.5)
+		fprintf(stderr,
+			"Warning: unsure of the dialect (confidence %.2f)\n",
+			dialect.confidence);
+}
+
+/* Open a file or, if file_name is NULL, spool stdin */
+void open_input(csv_reader* reader, const char* file_name)
+{
+	int ret = 0;
+	if (file_name == NULL && prefer_mmap)
+		ret = csv_reader_spool_mmap(reader, STDIN_FILENO, spool_dir);
+	else if (file_name == NULL)
+		ret = csv_reader_spool(reader, STDIN_FILENO, spool_dir);
+	else if (prefer_mmap)
+		ret = csv_reader_open_mmap(reader, file_name);
+	else
+		ret = csv_reader_open(reader, file_name);
+	if (ret == CSV_FAIL)
+		csv_perror_exit();
+	if (sniff_dialect)
+		sniff(reader);
+}
+
+/* --count: one line per input with its number of records */
+int count_records(csv_reader* reader, int argc, char** argv)
+{
+	do {
+		if (optind != argc)
+			open_input(reader, argv[optind]);
+		else if (spool_stdin)
+			open_input(reader, NULL);
+
+		size_t count = 0;
+		if (csv_count_records(reader, &count) == CSV_FAIL)
+			csv_perror_exit();
+		printf("%zu\n", count);
+	} while (++optind < argc);
+
+	csv_reader_free(reader);
+	return 0;
+}
+
+/** --concat **/
+
+/* Most workers parsing files at once */
+#define CONCAT_WORKERS 8
+
+/* Files each worker may parse ahead of the one being written */
+#define CONCAT_AHEAD 2
+
+/* One input file and its output in memory */
+struct concat_file {
+	const char* name;
+	char* out;
+	size_t len;
+	size_t header_len; /* bytes of the first record */
+	int ret;
+	_Bool done;
+};
+
+struct concat {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct concat_file* files;
+	int count;
+	int next;    /* first file not taken by a worker */
+	int written; /* first file not written out */
+	int ahead;   /* most files taken past `written' */
+	_Bool stop;
+};
+
+/* A worker has its own reader and a writer into memory */
+struct concat_worker {
+	struct concat* concat;
+	csv_reader* reader;
+	csv_writer* writer;
+	csv_record* record;
+	pthread_t thread;
+};
+
+/* Parse one file into memory */
+void concat_parse(struct concat_worker* self, struct concat_file* file)
+{
+	open_input(self->reader, file->name);
+
+	FILE* out = NULL;
+	int ret = 0;
+	do {
+		/* Failsafe mode started the file over */
+		if (out) {
+			fclose(out);
+			free(file->out);
+		}
+		out = open_memstream(&file->out, &file->len);
+		if (!out) {
+			perror("open_memstream");
+			exit(EXIT_FAILURE);
+		}
+		csv_writer_set_file(self->writer, out);
+
+		file->header_len = 0;
+		if ((ret = csv_get_record(self->reader, self->record)) == CSV_GOOD) {
+			csv_write_record(self->writer, self->record);
+			fflush(out);
+			file->header_len = file->len;
+		}
+		while (ret == CSV_GOOD
+		       && (ret = csv_get_record(self->reader, self->record)) == CSV_GOOD)
+			csv_write_record(self->writer, self->record);
+	} while (ret == CSV_RESET);
+
+	fclose(out);
+	csv_writer_set_file(self->writer, stdout);
+	file->ret = ret;
+}
+
+void* concat_main(void* arg)
+{
+	struct concat_worker* self = arg;
+	struct concat* cc = self->concat;
+
+	pthread_mutex_lock(&cc->lock);
+	for (;;) {
+		while (!cc->stop && cc->next < cc->count
+		       && cc->next - cc->written >= cc->ahead)
+			pthread_cond_wait(&cc->cond, &cc->lock);
+		if (cc->stop || cc->next == cc->count)
+			break;
+		struct concat_file* file = &cc->files[cc->next++];
+		pthread_mutex_unlock(&cc->lock);
+
+		concat_parse(self, file);
+
+		pthread_mutex_lock(&cc->lock);
+		file->done = true;
+		pthread_cond_broadcast(&cc->cond);
+	}
+	pthread_mutex_unlock(&cc->lock);
+
+	return NULL;
+}
+
+/**
+ * --concat: parse the input files on a pool of workers and
+ * write them out in order, with only the first header.
+ */
+int concat_files(csv_reader* reader, csv_writer* writer, int argc, char** argv)
+{
+	struct concat cc = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.count = argc - optind,
+	};
+	cc.files = calloc(cc.count, sizeof(*cc.files));
+	int i = 0;
+	for (; i < cc.count; ++i)
+		cc.files[i].name = argv[optind + i];
+
+	/* More workers than processors still overlaps the I/O */
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 2)
+		n = 2;
+	if (n > CONCAT_WORKERS)
+		n = CONCAT_WORKERS;
+	if (n > cc.count)
+		n = cc.count;
+	cc.ahead = CONCAT_AHEAD * n;
+
+	/* Every worker gets a reader and writer set up like ours */
+	struct concat_worker* workers = calloc(n, sizeof(*workers));
+	for (i = 0; i < n; ++i) {
+		workers[i].concat = &cc;
+		workers[i].reader = csv_reader_new_like(reader);
+		workers[i].writer = csv_writer_new_like(writer);
+		workers[i].record = csv_record_new();
+	}
+	csv_reader_free(reader);
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, concat_main, &workers[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Compressed output for stdout goes through a temp file */
+	if (compress_output && !csv_writer_isopen(writer)
+	    && csv_writer_mktmp(writer) == CSV_FAIL)
+		csv_perror_exit();
+
+	FILE* out = csv_writer_get_file(writer);
+	char* header = NULL;
+	size_t header_len = 0;
+	const char* header_name = NULL;
+	int ret = 0;
+	for (i = 0; i < cc.count && ret != CSV_FAIL; ++i) {
+		struct concat_file* file = &cc.files[i];
+		pthread_mutex_lock(&cc.lock);
+		while (!file->done)
+			pthread_cond_wait(&cc.cond, &cc.lock);
+		pthread_mutex_unlock(&cc.lock);
+
+		/* The first header is kept. Later ones are dropped
+		 * if they match it, or always with --concat-all.
+		 */
+		size_t skip = 0;
+		if (header == NULL && file->header_len) {
+			header = malloc(file->header_len);
+			memcpy(header, file->out, file->header_len);
+			header_len = file->header_len;
+			header_name = file->name;
+		} else if (file->header_len) {
+			skip = file->header_len;
+		}
+
+		ret = file->ret;
+		if (skip && !concat_all
+		    && (skip != header_len || memcmp(file->out, header, skip))) {
+			fprintf(stderr,
+				"%s: header does not match %s\n",
+				file->name,
+				header_name);
+			ret = CSV_FAIL;
+		} else {
+			fwrite(file->out + skip, 1, file->len - skip, out);
+		}
+		free(file->out);
+
+		pthread_mutex_lock(&cc.lock);
+		cc.written = i + 1;
+		pthread_cond_broadcast(&cc.cond);
+		pthread_mutex_unlock(&cc.lock);
+	}
+
+	pthread_mutex_lock(&cc.lock);
+	cc.stop = true;
+	pthread_cond_broadcast(&cc.cond);
+	pthread_mutex_unlock(&cc.lock);
+
+	for (i = 0; i < n; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		csv_reader_free(workers[i].reader);
+		csv_writer_free(workers[i].writer);
+		csv_record_free(workers[i].record);
+	}
+	/* Files parsed past a failure */
+	for (i = cc.written; i < cc.count; ++i)
+		free(cc.files[i].out);
+	free(workers);
+	free(cc.files);
+	free(header);
+
+	if (csv_writer_close(writer) == CSV_FAIL || csv_writer_sync(writer) == CSV_FAIL)
+		csv_perror_exit();
+	csv_writer_free(writer);
+
+	if (ret != CSV_FAIL)
+		return 0;
+	return ret;
+}
+
+int main (int argc, char **argv)
+{
 	csv_reader* reader = csv_reader_new();
 	csv_writer* writer = csv_writer_new();
 	csv_record* record = csv_record_new();
 
-	while ( (c = getopt_long (argc, argv, "cCfhmMnirtWd:D:N:o:Q:q:R:x:",
-				  long_options, &option_index)) != -1)
-		parseargs(c, reader, writer);
+	parse_options(argc, argv, reader, writer);
+	csv_writer_set_buffer(writer, WRITE_BUFFER);
+	/* -i rewrites many files, so fsync their directories together at the end */
+	csv_writer_set_sync(writer, CSV_SYNC_BATCH);
 
 	/* Check for conflicting options */
 	if (set_output_file + in_place_edit == 2) {
 		fputs("Conflicting options: -i -o\n", stderr);
 		exit(EXIT_FAILURE);
 	}
+	if (concat + in_place_edit == 2) {
+		fputs("Conflicting options: -i -c\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (set_output_file && compress_output && reader->failsafe_mode
+	    && !failsafe_record && argc - optind > 1) {
+		fputs("Conflicting options: -f -o with compressed output of several files\n",
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (output_file && csv_writer_open(writer, output_file) == CSV_FAIL)
+		csv_perror_exit();
+
+	if (count_only) {
+		csv_writer_free(writer);
+		csv_record_free(record);
+		return count_records(reader, argc, argv);
+	}
+
+	if (concat && optind < argc) {
+		csv_record_free(record);
+		return concat_files(reader, writer, argc, argv);
+	}
 
 	int ret = 0;
 
@@ -238,37 +684,45 @@ int main (int argc, char **argv)
 		 * If a file was provided, open it for reading.
 		 * If not and failsafe mode is on, print warning.
 		 */
-		if (optind != argc && ret != CSV_RESET) {
+		if ((optind != argc || spool_stdin) && ret != CSV_RESET) {
 			/** Open the file for reading **/
-
-			int ret = 0;
-			if (prefer_mmap)
-				ret = csv_reader_open_mmap(reader, argv[optind]);
-			else
-				ret = csv_reader_open(reader, argv[optind]);
-			if (ret == CSV_FAIL)
-				csv_perror_exit();
+			open_input(reader, (optind != argc) ? argv[optind] : NULL);
 
 			/* If in_place_edit, open a writer with the
 			 * destination as the reading file
 			 */
-			if (in_place_edit &&
+			if (in_place_edit && optind != argc &&
 			    csv_writer_open(writer, argv[optind]) == CSV_FAIL)
 				csv_perror_exit();
 
+			/* -o keeps the files before this one on a reset */
+			if (set_output_file && reader->failsafe_mode && !failsafe_record
+			    && csv_writer_mark(writer) == CSV_FAIL)
+				csv_perror_exit();
+
 			/* If failsafe mode and writer not opened (AKA stdout),
 			 * open temp file for writing.
 			 */
-			if (reader->failsafe_mode && !csv_writer_isopen(writer))
+			if (reader->failsafe_mode && !failsafe_record
+			    && !csv_writer_isopen(writer))
 				csv_writer_mktmp(writer);
 
-		} else if (reader->failsafe_mode && ret != CSV_RESET) {
-			fputs("Warning: Failsafe mode does not work with stdin\n", stderr);
+		} else if (reader->failsafe_mode && !failsafe_record && ret != CSV_RESET) {
+			fputs("Warning: Failsafe mode does not work with stdin unless spooled\n",
+			      stderr);
 		}
 
+		/* Compressed output for stdout goes through a temp file */
+		if (compress_output && !csv_writer_isopen(writer)
+		    && csv_writer_mktmp(writer) == CSV_FAIL)
+			csv_perror_exit();
+
 		/* Hot loop */
-		while ((ret = csv_get_record(reader, record)) == CSV_GOOD)
-			csv_write_record(writer, record);
+		if (pipeline_threads)
+			ret = csv_pipeline(reader, writer, pipeline_threads);
+		else
+			while ((ret = csv_get_record(reader, record)) == CSV_GOOD)
+				csv_write_record(writer, record);
 
 		/* Post process */
 		switch (ret) {
@@ -280,13 +734,17 @@ int main (int argc, char **argv)
 			optind = argc; /* no break intentional */
 		case EOF:
 		default:
-			if (csv_writer_close(writer) == CSV_FAIL)
+			/* -o gets every file, so it is closed after the last */
+			if ((!set_output_file || optind + 1 >= argc)
+			    && csv_writer_close(writer) == CSV_FAIL)
 				csv_perror_exit();
 			++optind;
 		}
 
 	} while (optind < argc || ret == CSV_RESET);
 
+	if (csv_writer_sync(writer) == CSV_FAIL)
+		csv_perror_exit();
 	csv_reader_free(reader);
 	csv_writer_free(writer);
 	csv_record_free(record);
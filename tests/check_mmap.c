@@ -1,6 +1,9 @@
 #include <check.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "csv.h"
+#include "check_tmp.h"
 
 struct csv_reader* reader = NULL;
 struct csv_record* record = NULL;
@@ -280,6 +283,150 @@ START_TEST(test_fs_weak)
 	_field_check(&record->fields[2], "ghi");
 }
 
+START_TEST(test_parallel)
+{
+	int ret = 0;
+
+	/* Enough data for several chunks. Every third record has
+	 * a multi-line field that looks like it closes a quote.
+	 */
+	char path[PATH_MAX];
+	FILE* f = tmp_open(path);
+	fputs("id,text,tail\n", f);
+	int i = 0;
+	for (; i < 30000; ++i) {
+		if (i % 3 == 0)
+			fprintf(f, "%d,\"x\"\",\ny\"\",z\",end\n", i);
+		else
+			fprintf(f, "%d,plain text,end\n", i);
+	}
+	fclose(f);
+
+	csv_reader_set_threads(reader, 4);
+	csv_reader_open_mmap(reader, path);
+
+	ret = csv_get_record(reader, record);
+	ck_assert_int_eq(ret, CSV_GOOD);
+	_field_check(&record->fields[0], "id");
+
+	/* Stopping the workers leaves the caller's errors queued */
+	ck_assert_int_eq(csv_reader_seek(reader, SIZE_MAX), CSV_FAIL);
+	char err_path[PATH_MAX];
+	FILE* err = tmp_open(err_path);
+	fflush(stderr);
+	int saved = dup(STDERR_FILENO);
+	dup2(fileno(err), STDERR_FILENO);
+	ck_assert_int_eq(csv_reader_seek(reader, reader->offset), CSV_GOOD);
+	fflush(stderr);
+	long stopped_len = lseek(STDERR_FILENO, 0, SEEK_END);
+	csv_perror();
+	fflush(stderr);
+	long len = lseek(STDERR_FILENO, 0, SEEK_END);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+	fclose(err);
+	remove(err_path);
+	ck_assert_int_eq(stopped_len, 0);
+	ck_assert(len > 0);
+
+	char id[16];
+	for (i = 0; i < 30000; ++i) {
+		ret = csv_get_record(reader, record);
+		ck_assert_int_eq(ret, CSV_GOOD);
+		ck_assert_uint_eq(record->size, 3);
+		sprintf(id, "%d", i);
+		_field_check(&record->fields[0], id);
+		if (i % 3 == 0)
+			_field_check(&record->fields[1], "x\",\ny\",z");
+		else
+			_field_check(&record->fields[1], "plain text");
+		_field_check(&record->fields[2], "end");
+	}
+
+	ret = csv_get_record(reader, record);
+	ck_assert_int_eq(ret, EOF);
+
+	unsigned rows = csv_reader_row_count(reader);
+	unsigned breaks = csv_reader_embedded_breaks(reader);
+
+	ck_assert_uint_eq(rows, 30001);
+	ck_assert_uint_eq(breaks, 10000);
+
+	csv_reader_close(reader);
+	remove(path);
+}
+END_TEST
+
+void _window_check(unsigned threads)
+{
+	int ret = 0;
+
+	/* Records span the edges of the window */
+	char path[PATH_MAX];
+	FILE* f = tmp_open(path);
+	int i = 0;
+	for (; i < 20000; ++i) {
+		fprintf(f, "%d,\"multi\nline %d\",end\n", i, i);
+	}
+	fclose(f);
+
+	csv_reader_set_threads(reader, threads);
+	csv_reader_set_mmap_window(reader, 4096);
+	csv_reader_open_mmap(reader, path);
+
+	char s[32];
+	for (i = 0; i < 20000; ++i) {
+		ret = csv_get_record(reader, record);
+		ck_assert_int_eq(ret, CSV_GOOD);
+		ck_assert_uint_eq(record->size, 3);
+		sprintf(s, "%d", i);
+		_field_check(&record->fields[0], s);
+		sprintf(s, "multi\nline %d", i);
+		_field_check(&record->fields[1], s);
+	}
+
+	ret = csv_get_record(reader, record);
+	ck_assert_int_eq(ret, EOF);
+	ck_assert_uint_eq(csv_reader_embedded_breaks(reader), 20000);
+
+	/* Released pages are read again after seeking back */
+	csv_reader_seek(reader, 0);
+	ret = csv_get_record(reader, record);
+	ck_assert_int_eq(ret, CSV_GOOD);
+	_field_check(&record->fields[1], "multi\nline 0");
+
+	csv_reader_close(reader);
+	remove(path);
+}
+
+START_TEST(test_window)
+{
+	_window_check(1);
+	csv_reader_free(reader);
+	reader = csv_reader_new();
+	_window_check(3);
+}
+END_TEST
+
+START_TEST(test_reopen)
+{
+	/* The second file starts at its own beginning */
+	csv_reader_open_mmap(reader, "basic.csv");
+	while (csv_get_record(reader, record) == CSV_GOOD)
+		;
+	ck_assert_int_eq(csv_reader_open_mmap(reader, "test_reopen.txt"), CSV_GOOD);
+	ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+	_field_check(&record->fields[0], "x");
+	ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+	_field_check(&record->fields[1], "2");
+
+	/* And from mmap to a plain read */
+	ck_assert_int_eq(csv_reader_open(reader, "test_reopen.txt"), CSV_GOOD);
+	ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+	_field_check(&record->fields[1], "y");
+}
+END_TEST
+
 Suite* mmap_suite(void)
 {
 	Suite* s;
@@ -325,6 +472,17 @@ Suite* mmap_suite(void)
 	tcase_add_test(tc_failsafe_weak, test_fs_weak);
 	suite_add_tcase(s, tc_failsafe_weak);
 
+	TCase* tc_parallel = tcase_create("parallel");
+	tcase_add_checked_fixture(tc_parallel, parse_setup, parse_teardown);
+	tcase_add_test(tc_parallel, test_parallel);
+	suite_add_tcase(s, tc_parallel);
+
+	TCase* tc_window = tcase_create("window");
+	tcase_add_checked_fixture(tc_window, parse_setup, parse_teardown);
+	tcase_add_test(tc_window, test_window);
+	tcase_add_test(tc_window, test_reopen);
+	suite_add_tcase(s, tc_window);
+
 	//TCase* tc_weak_trailing = tcase_create("failsafe_weak");
 	//tcase_add_checked_fixture(tc_weak_trailing, parse_setup, parse_teardown);
 	//tcase_add_test(tc_weak_trailing, test_weak_trailing);
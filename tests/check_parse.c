@@ -286,6 +286,154 @@ START_TEST(test_parse_ldnone)
 }
 END_TEST
 
+START_TEST(test_parse_wide)
+{
+        int ret = 0;
+        ret = csv_parse(reader, record,
+                        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa,"
+                        "\"bb,bb\"\"bb,bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\","
+                        "c,\"d\"e,");
+        ck_assert_uint_eq(record->size, 5);
+        _field_check(&record->fields[0], "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+        _field_check(&record->fields[1],
+                     "bb,bb\"bb,bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb");
+        _field_check(&record->fields[2], "c");
+        _field_check(&record->fields[3], "de");
+        _field_check(&record->fields[4], "");
+
+        /* quotes only count at the start of a field */
+        ret = csv_parse(reader, record, "ab\"c,d,\"e,f\"");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "ab\"c");
+        _field_check(&record->fields[1], "d");
+        _field_check(&record->fields[2], "e,f");
+
+        ret = csv_parse(reader, record, "\"a\"\"\"\"b\",");
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "a\"\"b");
+        _field_check(&record->fields[1], "");
+
+        ret = csv_parse_to(reader, record, "1,\"2,2\",3,\"4", 2);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "1");
+        _field_check(&record->fields[1], "2,2");
+
+        unsigned rows = csv_reader_row_count(reader);
+        ck_assert_uint_eq(rows, 4);
+}
+END_TEST
+
+START_TEST(test_parse_zerocopy)
+{
+        int ret = 0;
+        const char* line = "\"abc\",\"d,ef\",\"g\"\"h\"";
+        ret = csv_parse(reader, record, line);
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "abc");
+        _field_check(&record->fields[1], "d,ef");
+        _field_check(&record->fields[2], "g\"h");
+
+        /* no escaped quotes means no copy */
+        ck_assert_ptr_eq(record->fields[0].data, line + 1);
+        ck_assert_ptr_eq(record->fields[1].data, line + 7);
+        ck_assert_ptr_ne(record->fields[2].data, line + 14);
+
+        /* same for the scalar parser */
+        csv_reader_set_delim(reader, "::");
+        line = "\"a::b\"::\"c\"\"d\"::\"e\"f";
+        ret = csv_parse(reader, record, line);
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "a::b");
+        _field_check(&record->fields[1], "c\"d");
+        _field_check(&record->fields[2], "ef");
+        ck_assert_ptr_eq(record->fields[0].data, line + 1);
+
+        unsigned rows = csv_reader_row_count(reader);
+        ck_assert_uint_eq(rows, 2);
+}
+END_TEST
+
+START_TEST(test_parse_modes)
+{
+        /* Mode changes between records take effect immediately */
+        const char* line = " a ;; \"b;;c\" ;;d";
+        csv_reader_set_delim(reader, ";;");
+
+        csv_parse(reader, record, line);
+        ck_assert_uint_eq(record->size, 4);
+        _field_check(&record->fields[0], " a ");
+        _field_check(&record->fields[1], " \"b");
+        _field_check(&record->fields[2], "c\" ");
+
+        reader->trim = true;
+        csv_parse(reader, record, line);
+        ck_assert_uint_eq(record->size, 4);
+        _field_check(&record->fields[0], "a");
+        _field_check(&record->fields[1], "\"b");
+        _field_check(&record->fields[2], "c\"");
+
+        csv_reader_set_delim(reader, ";");
+        reader->trim = false;
+        csv_parse(reader, record, "a;\"b;c\";d");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[1], "b;c");
+
+        reader->quotes = QUOTE_NONE;
+        csv_parse(reader, record, "a;\"b;c\";d");
+        ck_assert_uint_eq(record->size, 4);
+        _field_check(&record->fields[1], "\"b");
+
+        reader->quotes = QUOTE_RFC4180;
+        csv_parse(reader, record, "a;\"b;c\";d");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[1], "b;c");
+}
+END_TEST
+
+START_TEST(test_parse_columns)
+{
+        int ret = 0;
+        unsigned columns[] = {3, 0, 3};
+        csv_reader_set_columns(reader, columns, 3);
+
+        ret = csv_parse(reader, record, "a,\"b\"\"c\",d,\"e,f\",g");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "e,f");
+        _field_check(&record->fields[1], "a");
+        _field_check(&record->fields[2], "e,f");
+
+        /* missing columns are empty */
+        ret = csv_parse(reader, record, "a,b");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "");
+        _field_check(&record->fields[1], "a");
+        _field_check(&record->fields[2], "");
+
+        ret = csv_parse_to(reader, record, "a,b,c,d", 2);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "d");
+        _field_check(&record->fields[1], "a");
+
+        /* scalar parser */
+        reader->trim = true;
+        ret = csv_parse(reader, record, " a ,\" b\"\"c \", d ,\" e\"\"f \"");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "e\"f");
+        _field_check(&record->fields[1], "a");
+
+        reader->trim = false;
+        reader->quotes = QUOTE_WEAK;
+        ret = csv_parse(reader, record, "a,\"b\"c\",d,\"e\"f\"");
+        ck_assert_uint_eq(record->size, 3);
+        _field_check(&record->fields[0], "e\"f");
+        _field_check(&record->fields[1], "a");
+
+        csv_reader_set_columns(reader, NULL, 0);
+        ret = csv_parse(reader, record, "a,b");
+        ck_assert_uint_eq(record->size, 2);
+}
+END_TEST
+
 Suite* parse_suite(void)
 {
         Suite* s;
@@ -321,6 +469,22 @@ Suite* parse_suite(void)
         tcase_add_test(tc_parse_ldnone, test_parse_ldnone);
         suite_add_tcase(s, tc_parse_ldnone);
 
+        TCase* tc_parse_wide = tcase_create("wide");
+        tcase_add_checked_fixture(tc_parse_wide, parse_setup, parse_teardown);
+        tcase_add_test(tc_parse_wide, test_parse_wide);
+        suite_add_tcase(s, tc_parse_wide);
+
+        TCase* tc_parse_columns = tcase_create("columns");
+        tcase_add_checked_fixture(tc_parse_columns, parse_setup, parse_teardown);
+        tcase_add_test(tc_parse_columns, test_parse_columns);
+        tcase_add_test(tc_parse_columns, test_parse_modes);
+        suite_add_tcase(s, tc_parse_columns);
+
+        TCase* tc_parse_zerocopy = tcase_create("zerocopy");
+        tcase_add_checked_fixture(tc_parse_zerocopy, parse_setup, parse_teardown);
+        tcase_add_test(tc_parse_zerocopy, test_parse_zerocopy);
+        suite_add_tcase(s, tc_parse_zerocopy);
+
         return s;
 }
 
@@ -1,6 +1,9 @@
 #include <check.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include "config.h"
 #include "csv.h"
+#include "check_tmp.h"
 
 struct csv_reader* reader = NULL;
 struct csv_record* record = NULL;
@@ -28,6 +31,18 @@ void _field_check(struct csv_field* field, const char* s1)
 	free(s0);
 }
 
+char* _slurp(const char* file_name, long* len)
+{
+        FILE* f = fopen(file_name, "r");
+        fseek(f, 0, SEEK_END);
+        *len = ftell(f);
+        rewind(f);
+        char* data = malloc(*len);
+        ck_assert_int_eq(fread(data, 1, *len, f), *len);
+        fclose(f);
+        return data;
+}
+
 void file_setup(void)
 {
         parse_setup();
@@ -216,6 +231,121 @@ START_TEST(test_realloc_append)
 }
 
 
+START_TEST(test_record_arena)
+{
+        /* Every field is unescaped into the arena, which
+         * has to grow several times within the record.
+         * In the third record, the record and the arena
+         * both move, in turns.
+         */
+        csv_reader_open(reader, "test_arena.txt");
+        int i = 0;
+
+        ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+        ck_assert_int_eq(record->size, 66);
+        char expected[128];
+        for (i = 0; i < 64; ++i) {
+                sprintf(expected, "%d\"%0*d", i, i + 1, 0);
+                _field_check(&record->fields[i], expected);
+        }
+        _field_check(&record->fields[64], "a\nb");
+        _field_check(&record->fields[65], "plain");
+
+        /* A clone keeps its own copies */
+        struct csv_record* clone = csv_record_clone(record);
+        ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+        _field_check(&record->fields[0], "next");
+        _field_check(&record->fields[1], "\"x");
+        _field_check(&clone->fields[63], "63\"0000000000000000000000000000000000000000000000000000000000000000");
+        _field_check(&clone->fields[64], "a\nb");
+
+        ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+        ck_assert_int_eq(record->size, 32);
+        for (i = 0; i < 32; ++i) {
+                sprintf(expected, "%d\"\n%0*d", i, 2 * i + 1, 0);
+                _field_check(&record->fields[i], expected);
+        }
+
+        int n = clone->size;
+        struct csv_field* fields = csv_record_release_data(clone);
+        _field_check(&fields[1], "1\"00");
+        for (i = 0; i < n; ++i) {
+                free((char*)fields[i].data);
+        }
+        free(fields);
+}
+END_TEST
+
+
+START_TEST(test_record_freeze)
+{
+        csv_reader_open(reader, "test_freeze.txt");
+
+        ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+        struct csv_frozen* frozen = csv_record_freeze(record);
+        ck_assert_uint_eq(frozen->size, 4);
+
+        /* Still good after moving it and reading on */
+        struct csv_frozen* moved = malloc(frozen->bytes);
+        memcpy(moved, frozen, frozen->bytes);
+        free(frozen);
+        ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+
+        struct csv_field field = csv_frozen_get(moved, 0);
+        _field_check(&field, "a");
+        field = csv_frozen_get(moved, 1);
+        _field_check(&field, "b\"c");
+        ck_assert_str_eq(field.data, "b\"c");
+        field = csv_frozen_get(moved, 2);
+        _field_check(&field, "");
+        field = csv_frozen_get(moved, 3);
+        _field_check(&field, "d\ne");
+        free(moved);
+}
+END_TEST
+
+START_TEST(test_long_quoted_field)
+{
+        /* 100 lines in one field, past CSV_MAX_NEWLINES */
+        int i = 0;
+        char expected[1024] = "";
+        for (i = 0; i < 100; ++i) {
+                sprintf(expected + strlen(expected), "%d\n", i);
+        }
+        strcat(expected, "end");
+
+        int mode = 0;
+        for (; mode < 2; ++mode) {
+                csv_reader_set_max_newlines(reader, 0);
+                if (mode) {
+                        csv_reader_open_mmap(reader, "test_long_field.txt");
+                } else {
+                        csv_reader_open(reader, "test_long_field.txt");
+                }
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                ck_assert_int_eq(record->size, 3);
+                _field_check(&record->fields[0], "a");
+                _field_check(&record->fields[1], expected);
+                _field_check(&record->fields[2], "b");
+
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                ck_assert_int_eq(record->size, 3);
+                _field_check(&record->fields[0], "c");
+                _field_check(&record->fields[1], "x\ny\nz");
+                _field_check(&record->fields[2], "");
+                ck_assert_int_eq(csv_get_record(reader, record), EOF);
+                ck_assert_uint_eq(csv_reader_embedded_breaks(reader), 102);
+
+                parse_teardown();
+                parse_setup();
+        }
+
+        /* The default limit gives up on the quote */
+        csv_reader_open(reader, "test_long_field.txt");
+        ck_assert_int_ne(csv_get_record(reader, record), CSV_GOOD);
+}
+END_TEST
+
 START_TEST(test_fs_eof)
 {
         int ret = 0;
@@ -279,7 +409,892 @@ START_TEST(test_fs_weak)
         _field_check(&record->fields[2], "ghi");
 }
 
+/* A reset while writing a second file into the same output
+ * drops only what that file wrote.
+ */
+START_TEST(test_fs_mark)
+{
+        const char* files[] = {"test_lf.txt", "test_fs_weak.txt"};
+        char path[PATH_MAX];
+        long len = 0;
+        int ret = 0;
+
+        reader->failsafe_mode = 1;
+
+        fclose(tmp_open(path));
+        struct csv_writer* writer = csv_writer_new();
+        ck_assert_int_eq(csv_writer_open(writer, path), CSV_GOOD);
+        int i = 0;
+        for (; i < 2; ++i) {
+                csv_reader_open(reader, files[i]);
+                ck_assert_int_eq(csv_writer_mark(writer), CSV_GOOD);
+                while ((ret = csv_get_record(reader, record)) != EOF) {
+                        if (ret == CSV_RESET) {
+                                ck_assert_int_eq(csv_writer_reset(writer), CSV_GOOD);
+                        } else {
+                                csv_write_record(writer, record);
+                        }
+                }
+        }
+        ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+        csv_writer_free(writer);
+
+        /* All of the first file but its blank line, then the
+         * second as read again.
+         */
+        long lf_len = 0;
+        char* lf = _slurp(files[0], &lf_len);
+        const char* weak = "abc,\"de\"\"f\",ghi\n";
+        char* out = _slurp(path, &len);
+        ck_assert_int_eq(len, lf_len - 1 + strlen(weak));
+        ck_assert(!memcmp(out, lf, lf_len - 1));
+        ck_assert(!memcmp(out + lf_len - 1, weak, strlen(weak)));
+        free(lf);
+        free(out);
+        remove(path);
+}
+
+
+START_TEST(test_file_columns)
+{
+        int ret = 0;
+        unsigned columns[] = {2, 0};
+        csv_reader_set_columns(reader, columns, 2);
+
+        ret = csv_get_record(reader, record);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "789");
+        _field_check(&record->fields[1], "123");
+
+        ret = csv_get_record(reader, record);
+        _field_check(&record->fields[0], "ghi");
+        _field_check(&record->fields[1], "abc");
+
+        /* skipped, but the line break still counts */
+        ret = csv_get_record(reader, record);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "ghi");
+        _field_check(&record->fields[1], "abc");
+
+        ret = csv_get_record(reader, record);
+        _field_check(&record->fields[0], "ghi");
+        _field_check(&record->fields[1], "abc");
+
+        ret = csv_get_record(reader, record);
+        ck_assert_int_eq(ret, EOF);
+
+        ck_assert_uint_eq(csv_reader_row_count(reader), 4);
+        ck_assert_uint_eq(csv_reader_embedded_breaks(reader), 1);
+}
+END_TEST
+
+START_TEST(test_file_first_column)
+{
+        int ret = 0;
+        unsigned columns[] = {0};
+        csv_reader_set_columns(reader, columns, 1);
+
+        /* line breaks after the last selected column
+         * still belong to the record
+         */
+        while ((ret = csv_get_record(reader, record)) == CSV_GOOD) {
+                ck_assert_uint_eq(record->size, 1);
+        }
+        _field_check(&record->fields[0], "abc");
+
+        ck_assert_uint_eq(csv_reader_row_count(reader), 4);
+        ck_assert_uint_eq(csv_reader_embedded_breaks(reader), 1);
+}
+END_TEST
+
+void _batch_check(struct csv_batch* batch, unsigned row, unsigned col, const char* s1)
+{
+        struct csv_field field = {
+                batch->data + batch->offsets[col][row],
+                batch->lengths[col][row],
+        };
+        _field_check(&field, s1);
+}
+
+START_TEST(test_file_batch)
+{
+        struct csv_batch* batch = csv_batch_new(3);
+
+        int ret = csv_get_batch(reader, batch);
+        ck_assert_int_eq(ret, 3);
+        ck_assert_uint_eq(batch->rows, 3);
+        ck_assert_uint_eq(batch->columns, 3);
+        _batch_check(batch, 0, 0, "123");
+        _batch_check(batch, 1, 0, "abc");
+        _batch_check(batch, 2, 0, "abc");
+        _batch_check(batch, 0, 1, "456");
+        _batch_check(batch, 1, 1, "d|ef");
+        _batch_check(batch, 2, 1, "de\nf");
+        _batch_check(batch, 2, 2, "ghi");
+
+        ret = csv_get_batch(reader, batch);
+        ck_assert_int_eq(ret, 1);
+        _batch_check(batch, 0, 0, "abc");
+        _batch_check(batch, 0, 1, "de\"f");
+        _batch_check(batch, 0, 2, "ghi");
+
+        ret = csv_get_batch(reader, batch);
+        ck_assert_int_eq(ret, EOF);
+        ck_assert_uint_eq(batch->rows, 0);
+
+        csv_batch_free(batch);
+}
+END_TEST
+
+START_TEST(test_ragged_batch)
+{
+        csv_reader_open(reader, "test_ragged_batch.txt");
+
+        struct csv_batch* batch = csv_batch_new(8);
+        int ret = csv_get_batch(reader, batch);
+        ck_assert_int_eq(ret, 3);
+        ck_assert_uint_eq(batch->columns, 3);
+
+        /* missing fields are empty */
+        _batch_check(batch, 0, 0, "a");
+        _batch_check(batch, 0, 1, "b");
+        _batch_check(batch, 0, 2, "");
+        _batch_check(batch, 1, 0, "c");
+        _batch_check(batch, 1, 1, "");
+        _batch_check(batch, 1, 2, "");
+        _batch_check(batch, 2, 0, "d");
+        _batch_check(batch, 2, 1, "e");
+        _batch_check(batch, 2, 2, "f");
+
+        csv_batch_free(batch);
+}
+END_TEST
+
+enum csv_conv _int64_of(const char* s, int64_t* value)
+{
+        struct csv_field field = {s, strlen(s)};
+        return csv_field_int64(&field, value);
+}
+
+enum csv_conv _double_of(const char* s, double* value)
+{
+        struct csv_field field = {s, strlen(s)};
+        return csv_field_double(&field, value);
+}
+
+START_TEST(test_convert_fields)
+{
+        int64_t i = 0;
+        ck_assert_int_eq(_int64_of("0", &i), CSV_CONV_GOOD);
+        ck_assert_int_eq(i, 0);
+        ck_assert_int_eq(_int64_of("-1234567890123", &i), CSV_CONV_GOOD);
+        ck_assert(i == -1234567890123);
+        ck_assert_int_eq(_int64_of("+000000000000000000000042", &i), CSV_CONV_GOOD);
+        ck_assert(i == 42);
+        ck_assert_int_eq(_int64_of("9223372036854775807", &i), CSV_CONV_GOOD);
+        ck_assert(i == INT64_MAX);
+        ck_assert_int_eq(_int64_of("-9223372036854775808", &i), CSV_CONV_GOOD);
+        ck_assert(i == INT64_MIN);
+        ck_assert_int_eq(_int64_of("9223372036854775808", &i), CSV_CONV_RANGE);
+        ck_assert(i == INT64_MAX);
+        ck_assert_int_eq(_int64_of("-123456789012345678901", &i), CSV_CONV_RANGE);
+        ck_assert(i == INT64_MIN);
+        ck_assert_int_eq(_int64_of("", &i), CSV_CONV_EMPTY);
+        ck_assert_int_eq(_int64_of("-", &i), CSV_CONV_INVALID);
+        ck_assert_int_eq(_int64_of(" 1", &i), CSV_CONV_INVALID);
+        ck_assert_int_eq(_int64_of("12345678x", &i), CSV_CONV_INVALID);
+        ck_assert_int_eq(_int64_of("1234567890123456789012x", &i), CSV_CONV_INVALID);
+
+        /* Not NUL-terminated */
+        struct csv_field field = {"12345678901,2", 5};
+        ck_assert_int_eq(csv_field_int64(&field, &i), CSV_CONV_GOOD);
+        ck_assert(i == 12345);
+
+        double d = 0;
+        ck_assert_int_eq(_double_of("1.5", &d), CSV_CONV_GOOD);
+        ck_assert(d == 1.5);
+        ck_assert_int_eq(_double_of("-0.000123e-2", &d), CSV_CONV_GOOD);
+        ck_assert(d == -0.000123e-2);
+        ck_assert_int_eq(_double_of("12345678901234567890.5", &d), CSV_CONV_GOOD);
+        ck_assert(d == 12345678901234567890.5);
+        ck_assert_int_eq(_double_of("1e-320", &d), CSV_CONV_RANGE);
+        ck_assert_int_eq(_double_of("1e999", &d), CSV_CONV_RANGE);
+        ck_assert_int_eq(_double_of(".", &d), CSV_CONV_INVALID);
+        ck_assert_int_eq(_double_of("1e", &d), CSV_CONV_INVALID);
+        ck_assert_int_eq(_double_of(" 1", &d), CSV_CONV_INVALID);
+        field = (struct csv_field) {"2.25e1x", 6};
+        ck_assert_int_eq(csv_field_double(&field, &d), CSV_CONV_GOOD);
+        ck_assert(d == 22.5);
+
+        bool b = false;
+        field = (struct csv_field) {"YES", 3};
+        ck_assert_int_eq(csv_field_bool(&field, &b), CSV_CONV_GOOD);
+        ck_assert(b);
+        field = (struct csv_field) {"f", 1};
+        ck_assert_int_eq(csv_field_bool(&field, &b), CSV_CONV_GOOD);
+        ck_assert(!b);
+        field = (struct csv_field) {"truth", 5};
+        ck_assert_int_eq(csv_field_bool(&field, &b), CSV_CONV_INVALID);
+}
+END_TEST
+
+START_TEST(test_typed_batch)
+{
+        csv_reader_open(reader, "test_typed_batch.txt");
+
+        struct csv_batch* batch = csv_batch_new(8);
+        csv_batch_set_type(batch, 0, CSV_INT64);
+        csv_batch_set_type(batch, 1, CSV_DOUBLE);
+        csv_batch_set_type(batch, 2, CSV_BOOL);
+        int ret = csv_get_batch(reader, batch);
+        ck_assert_int_eq(ret, 3);
+        ck_assert_uint_eq(batch->columns, 4);
+        ck_assert_ptr_eq(batch->values[3], NULL);
+        ck_assert_ptr_eq(batch->status[3], NULL);
+
+        const int64_t* ints = batch->values[0];
+        ck_assert(ints[0] == 1 && ints[1] == 0 && ints[2] == -7);
+        ck_assert_int_eq(batch->status[0][0], CSV_CONV_GOOD);
+        ck_assert_int_eq(batch->status[0][1], CSV_CONV_INVALID);
+        ck_assert_int_eq(batch->status[0][2], CSV_CONV_GOOD);
+
+        const double* doubles = batch->values[1];
+        ck_assert(doubles[0] == 2.5);
+        ck_assert_int_eq(batch->status[1][0], CSV_CONV_GOOD);
+        ck_assert_int_eq(batch->status[1][1], CSV_CONV_EMPTY);
+        ck_assert_int_eq(batch->status[1][2], CSV_CONV_RANGE);
+
+        /* missing fields are empty */
+        const bool* bools = batch->values[2];
+        ck_assert(bools[0] && !bools[1]);
+        ck_assert_int_eq(batch->status[2][1], CSV_CONV_GOOD);
+        ck_assert_int_eq(batch->status[2][2], CSV_CONV_EMPTY);
+
+        /* the text is still there */
+        _batch_check(batch, 1, 0, "x");
+        _batch_check(batch, 0, 3, "a");
+
+        csv_batch_free(batch);
+}
+END_TEST
+
+void _fs_incremental_check(void)
+{
+        int ret = 0;
+
+        reader->failsafe_mode = 1;
+        csv_reader_set_failsafe_incremental(reader, true);
+
+        ret = csv_get_record(reader, record);
+        ck_assert_int_eq(ret, CSV_GOOD);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "a");
+        _field_check(&record->fields[1], "b,c");
+
+        /* only this record is read with weak quotes */
+        ret = csv_get_record(reader, record);
+        ck_assert_int_eq(ret, CSV_GOOD);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "d\"e");
+        _field_check(&record->fields[1], "f");
+        ck_assert_int_eq(reader->quotes, QUOTE_RFC4180);
+
+        ret = csv_get_record(reader, record);
+        ck_assert_int_eq(ret, CSV_GOOD);
+        ck_assert_uint_eq(record->size, 2);
+        _field_check(&record->fields[0], "g\"h");
+        _field_check(&record->fields[1], "i");
+
+        ret = csv_get_record(reader, record);
+        ck_assert_int_eq(ret, EOF);
+
+        ck_assert_uint_eq(csv_reader_row_count(reader), 3);
+        ck_assert_uint_eq(csv_reader_embedded_breaks(reader), 0);
+}
+
+START_TEST(test_fs_incremental)
+{
+        csv_reader_open(reader, "test_fs_incremental.txt");
+        _fs_incremental_check();
+        csv_reader_free(reader);
+
+        reader = csv_reader_new();
+        csv_reader_open_mmap(reader, "test_fs_incremental.txt");
+        _fs_incremental_check();
+}
+END_TEST
+
+void _row_index_check(void)
+{
+        unsigned rows[] = {0, 1, 6, 7, 8, 50, 99, 13, 0};
+        unsigned i = 0;
+        char id[16];
+        for (; i < sizeof(rows) / sizeof(rows[0]); ++i) {
+                unsigned row = rows[i];
+                ck_assert_int_eq(csv_reader_seek_row(reader, row), CSV_GOOD);
+                ck_assert_uint_eq(csv_reader_row_count(reader), row);
+                ck_assert_uint_eq(csv_reader_embedded_breaks(reader), (row + 3) / 4);
+
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                sprintf(id, "%u", row);
+                _field_check(&record->fields[0], id);
+                _field_check(&record->fields[1], (row % 4 == 0) ? "a\nb" : "c");
+        }
+
+        ck_assert_int_eq(csv_reader_seek_row(reader, 100), CSV_GOOD);
+        ck_assert_int_eq(csv_get_record(reader, record), EOF);
+        ck_assert_int_eq(csv_reader_seek_row(reader, 101), CSV_FAIL);
+}
+
+START_TEST(test_row_index)
+{
+        char idx[PATH_MAX];
+        fclose(tmp_open(idx));
+
+        csv_reader_open(reader, "test_row_index.txt");
+        ck_assert_int_eq(csv_reader_seek_row(reader, 0), CSV_FAIL);
+        ck_assert_int_eq(csv_reader_build_index(reader, 7), CSV_GOOD);
+        _row_index_check();
+        ck_assert_int_eq(csv_reader_save_index(reader, idx), CSV_GOOD);
+        csv_reader_free(reader);
+
+        reader = csv_reader_new();
+        csv_reader_open_mmap(reader, "test_row_index.txt");
+        ck_assert_int_eq(csv_reader_load_index(reader, idx), CSV_GOOD);
+        _row_index_check();
+        csv_reader_free(reader);
+
+        /* The same file with a row added */
+        reader = csv_reader_new();
+        csv_reader_open(reader, "test_row_index_stale.txt");
+        ck_assert_int_eq(csv_reader_load_index(reader, idx), CSV_FAIL);
+        csv_reader_close(reader);
+
+        remove(idx);
+}
+END_TEST
+
+void _feed_collect(struct csv_record* rec, void* data)
+{
+        char* out = data;
+        int i = 0;
+        for (; i < rec->size; ++i) {
+                strncat(out, rec->fields[i].data, rec->fields[i].len);
+                strcat(out, (i + 1 < rec->size) ? "|" : ";");
+        }
+}
+
+START_TEST(test_spool)
+{
+        const char* data = "a,b\n\"c\nd\",e\n";
+        size_t len = strlen(data);
+
+        /* memfd, mmapped memfd and O_TMPFILE */
+        int mode = 0;
+        for (; mode < 3; ++mode) {
+                int fds[2];
+                ck_assert_int_eq(pipe(fds), 0);
+                ck_assert_int_eq(write(fds[1], data, len), len);
+                close(fds[1]);
+                int ret = 0;
+                if (mode == 0) {
+                        ret = csv_reader_spool(reader, fds[0], NULL);
+                } else if (mode == 1) {
+                        ret = csv_reader_spool_mmap(reader, fds[0], NULL);
+                } else {
+                        ret = csv_reader_spool(reader, fds[0], ".");
+                }
+                close(fds[0]);
+                ck_assert_int_eq(ret, CSV_GOOD);
+                ck_assert_uint_eq(csv_reader_get_file_size(reader), len);
+
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                _field_check(&record->fields[1], "b");
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                _field_check(&record->fields[0], "c\nd");
+
+                /* Seekable like a file */
+                ck_assert_int_eq(csv_reader_reset(reader), CSV_GOOD);
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                _field_check(&record->fields[0], "a");
+
+                parse_teardown();
+                parse_setup();
+        }
+}
+END_TEST
+
+#ifdef HAVE_ZLIB
+START_TEST(test_gzip)
+{
+        /* a,b\n"c\nd",e\n once and twice */
+        const char* files[] = {"test_gzip.gz", "test_gzip_members.gz"};
+        int mode = 0;
+        for (; mode < 2; ++mode) {
+                ck_assert_int_eq(csv_reader_open(reader, files[mode]), CSV_GOOD);
+
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                _field_check(&record->fields[1], "b");
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                _field_check(&record->fields[0], "c\nd");
+                ck_assert_int_eq(csv_get_record(reader, record), (mode) ? CSV_GOOD : EOF);
+
+                /* Starts decompressing over */
+                ck_assert_int_eq(csv_reader_reset(reader), CSV_GOOD);
+                size_t count = 0;
+                ck_assert_int_eq(csv_count_records(reader, &count), CSV_GOOD);
+                ck_assert_uint_eq(count, (mode) ? 4 : 2);
+
+                parse_teardown();
+                parse_setup();
+        }
+
+        /* Cut short, which is a failed read and not the end */
+        ck_assert_int_eq(csv_reader_open(reader, "test_gzip_cut.gz"), CSV_GOOD);
+        int ret = 0;
+        while ((ret = csv_get_record(reader, record)) == CSV_GOOD)
+                ;
+        ck_assert_int_eq(ret, CSV_FAIL);
+}
+END_TEST
+
+START_TEST(test_gzip_writer)
+{
+        /* Enough for several members */
+        char path[PATH_MAX];
+        char gz[PATH_MAX];
+        FILE* f = tmp_open(path);
+        int i = 0;
+        for (; i < 100000; ++i) {
+                fprintf(f, "%d,\"x\ny\",%d\n", i, i * 7);
+        }
+        fclose(f);
+        fclose(tmp_open(gz));
+
+        struct csv_writer* writer = csv_writer_new();
+        ck_assert_int_eq(csv_writer_set_compression(writer, CSV_COMPRESS_GZIP, 1), CSV_GOOD);
+        csv_writer_set_threads(writer, 2);
+        ck_assert_int_eq(csv_writer_open(writer, gz), CSV_GOOD);
+        csv_reader_open(reader, path);
+        while (csv_get_record(reader, record) == CSV_GOOD) {
+                csv_write_record(writer, record);
+        }
+        ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+        csv_writer_free(writer);
+
+        /* Read back in parallel */
+        parse_teardown();
+        parse_setup();
+        csv_reader_set_threads(reader, 2);
+        ck_assert_int_eq(csv_reader_open(reader, gz), CSV_GOOD);
+        for (i = 0; i < 100000; ++i) {
+                char num[16];
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                ck_assert_int_eq(record->size, 3);
+                snprintf(num, sizeof(num), "%d", i);
+                _field_check(&record->fields[0], num);
+                _field_check(&record->fields[1], "x\ny");
+                snprintf(num, sizeof(num), "%d", i * 7);
+                _field_check(&record->fields[2], num);
+        }
+        ck_assert_int_eq(csv_get_record(reader, record), EOF);
+
+        remove(path);
+        remove(gz);
+}
+END_TEST
+#endif /* HAVE_ZLIB */
+
+START_TEST(test_feed_split)
+{
+        const char* input = "a,\"b\r\nc\"\r\nd,\"e\"\"f\"\rg,h";
+        const char* expected = "a|b\nc;d|e\"f;g|h;";
+        size_t len = strlen(input);
+
+        /* Split inside quotes, between \r and \n and everywhere else */
+        size_t split = 0;
+        for (; split <= len; ++split) {
+                char out[64] = "";
+                csv_reader_free(reader);
+                reader = csv_reader_new();
+                csv_reader_set_callback(reader, _feed_collect, out);
+
+                char* chunk = strndup(input, split);
+                ck_assert_int_eq(csv_feed(reader, chunk, split), CSV_GOOD);
+                free(chunk);
+                chunk = strdup(input + split);
+                ck_assert_int_eq(csv_feed(reader, chunk, len - split), CSV_GOOD);
+                free(chunk);
+                ck_assert_int_eq(csv_feed_end(reader), CSV_GOOD);
+
+                ck_assert_str_eq(out, expected);
+                ck_assert_uint_eq(csv_reader_row_count(reader), 3);
+        }
+
+        /* One byte at a time */
+        char out[64] = "";
+        csv_reader_free(reader);
+        reader = csv_reader_new();
+        csv_reader_set_callback(reader, _feed_collect, out);
+        for (split = 0; split < len; ++split) {
+                ck_assert_int_eq(csv_feed(reader, input + split, 1), CSV_GOOD);
+        }
+        ck_assert_int_eq(csv_feed_end(reader), CSV_GOOD);
+        ck_assert_str_eq(out, expected);
+}
+END_TEST
+
+void _count_check(const char* file_name, size_t expected, unsigned breaks)
+{
+        int mmap = 0;
+        for (; mmap < 2; ++mmap) {
+                csv_reader_free(reader);
+                reader = csv_reader_new();
+                if (mmap) {
+                        csv_reader_open_mmap(reader, file_name);
+                        csv_reader_set_threads(reader, 3);
+                } else {
+                        csv_reader_open(reader, file_name);
+                }
+
+                /* Count what is left after the header */
+                size_t count = 0;
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                ck_assert_int_eq(csv_count_records(reader, &count), CSV_GOOD);
+                ck_assert_uint_eq(count, expected);
+                ck_assert_uint_eq(csv_reader_row_count(reader), expected + 1);
+                ck_assert_uint_eq(csv_reader_embedded_breaks(reader), breaks);
+                ck_assert_int_eq(csv_get_record(reader, record), EOF);
+        }
+}
+
+START_TEST(test_count_records)
+{
+        _count_check("test_count_header.txt", 0, 0);
+        _count_check("test_count_notrail.txt", 2, 0);
+        _count_check("test_count_crlf.txt", 2, 2);
+        _count_check("test_count_blank.txt", 2, 1);
+
+        /* Quote in the middle of a field. Left to the parser. */
+        _count_check("test_count_weak.txt", 2, 1);
+}
+END_TEST
+
+void _write_check(enum quote_style quotes, const char* delim,
+                  const char* data, const char* expected)
+{
+        char* out = NULL;
+        size_t len = 0;
+        FILE* f = open_memstream(&out, &len);
+        struct csv_writer* writer = csv_writer_new();
+        csv_writer_set_file(writer, f);
+        csv_writer_set_delim(writer, delim);
+        writer->quotes = quotes;
+
+        struct csv_field field = {data, strlen(data)};
+        ck_assert_int_eq(csv_write_field(writer, &field), strlen(expected));
+        fclose(f);
+        ck_assert_str_eq(out, expected);
+
+        csv_writer_set_file(writer, stdout);
+        csv_writer_free(writer);
+        free(out);
+}
+
+START_TEST(test_write_field)
+{
+        _write_check(QUOTE_RFC4180, ",", "", "");
+        _write_check(QUOTE_RFC4180, ",", "abc", "abc");
+        _write_check(QUOTE_RFC4180, ",", "a,b", "\"a,b\"");
+        _write_check(QUOTE_RFC4180, ",", "a\rb", "\"a\rb\"");
+        _write_check(QUOTE_RFC4180, ",", "a\nb", "\"a\nb\"");
+        _write_check(QUOTE_RFC4180, ",", "\"a\"\"b\"", "\"\"\"a\"\"\"\"b\"\"\"");
+        _write_check(QUOTE_RFC4180, "|", "a,b", "a,b");
+        _write_check(QUOTE_WEAK, ",", "a\"b", "\"a\"b\"");
+        _write_check(QUOTE_ALL, ",", "abc", "\"abc\"");
+        _write_check(QUOTE_NONE, ",", "a,\"b", "a,\"b");
+
+        /* Past the first 64 bytes, and a delimiter across them */
+        const char* pad = "0123456789012345678901234567890123456789012345678901234567890";
+        char in[128];
+        char expected[128];
+        snprintf(in, sizeof(in), "%s<>x", pad);
+        snprintf(expected, sizeof(expected), "\"%s<>x\"", pad);
+        _write_check(QUOTE_RFC4180, "<>", in, expected);
+        _write_check(QUOTE_RFC4180, "<|", in, in);
+        snprintf(in, sizeof(in), "%s<>\"x", pad);
+        snprintf(expected, sizeof(expected), "\"%s<>\"\"x\"", pad);
+        _write_check(QUOTE_RFC4180, "<>", in, expected);
+}
+END_TEST
+
+size_t _pipeline_run(const char* in_name, int mmap, unsigned threads, const char* out_name)
+{
+        csv_reader_free(reader);
+        reader = csv_reader_new();
+        csv_reader_set_failsafe_incremental(reader, true);
+        if (mmap) {
+                csv_reader_open_mmap(reader, in_name);
+        } else {
+                csv_reader_open(reader, in_name);
+        }
+
+        struct csv_writer* writer = csv_writer_new();
+        ck_assert_int_eq(csv_writer_open(writer, out_name), CSV_GOOD);
+        ck_assert_int_eq(csv_pipeline(reader, writer, threads), EOF);
+        ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+        csv_writer_free(writer);
+
+        return csv_reader_row_count(reader);
+}
+
+START_TEST(test_write_buffer)
+{
+        struct csv_field fields[] = {
+                {"a", 1},
+                {"b,c", 3},
+                {"longer than the threshold", 25},
+        };
+        struct csv_record rec = {.fields = fields, .size = 3};
+        const char* line = "a,\"b,c\",longer than the threshold\n";
+        char expected[256] = "";
+        int i = 0;
+        for (; i < 3; ++i) {
+                strcat(expected, line);
+        }
+
+        /* write(2) to a file, with the last field written as is */
+        char path[PATH_MAX];
+        fclose(tmp_open(path));
+        struct csv_writer* writer = csv_writer_new();
+        ck_assert_int_eq(csv_writer_open(writer, path), CSV_GOOD);
+        csv_writer_set_buffer(writer, 16);
+        for (i = 0; i < 3; ++i) {
+                ck_assert_int_eq(csv_write_record(writer, &rec), strlen(line));
+        }
+        ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+        csv_writer_free(writer);
+
+        long len = 0;
+        char* out = _slurp(path, &len);
+        ck_assert_int_eq(len, strlen(expected));
+        ck_assert(!memcmp(out, expected, len));
+        free(out);
+        remove(path);
+
+        /* No descriptor. Nothing is written until a flush. */
+        size_t mem_len = 0;
+        FILE* f = open_memstream(&out, &mem_len);
+        writer = csv_writer_new();
+        csv_writer_set_file(writer, f);
+        csv_writer_set_buffer(writer, 1 << 20);
+        for (i = 0; i < 3; ++i) {
+                csv_write_record(writer, &rec);
+        }
+        fflush(f);
+        ck_assert_uint_eq(mem_len, 0);
+        ck_assert_int_eq(csv_writer_flush(writer), CSV_GOOD);
+        fclose(f);
+        ck_assert_str_eq(out, expected);
+        free(out);
+
+        csv_writer_set_file(writer, stdout);
+        csv_writer_free(writer);
+}
+END_TEST
+
+START_TEST(test_writer_sync)
+{
+        struct csv_field fields[] = {{"a", 1}, {"b", 1}};
+        struct csv_record rec = {.fields = fields, .size = 2};
+        char path[PATH_MAX];
+        long len = 0;
+        char* out = NULL;
+
+        /* The renamed files are the same whichever policy */
+        int i = 0;
+        for (; i < 2; ++i) {
+                fclose(tmp_open(path));
+                struct csv_writer* writer = csv_writer_new();
+                csv_writer_set_sync(writer, (i) ? CSV_SYNC_BATCH : CSV_SYNC_CLOSE);
+                ck_assert_int_eq(csv_writer_open(writer, path), CSV_GOOD);
+                csv_write_record(writer, &rec);
+                ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+                ck_assert_int_eq(csv_writer_sync(writer), CSV_GOOD);
+                csv_writer_free(writer);
+
+                out = _slurp(path, &len);
+                ck_assert_int_eq(len, 4);
+                ck_assert(!memcmp(out, "a,b\n", 4));
+                free(out);
+                remove(path);
+        }
+
+        /* A temp file for stdout is copied after what
+         * stdout already had.
+         */
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        FILE* f = tmp_open(path);
+        dup2(fileno(f), STDOUT_FILENO);
+        fclose(f);
+
+        fputs("x\n", stdout);
+        struct csv_writer* writer = csv_writer_new();
+        ck_assert_int_eq(csv_writer_mktmp(writer), CSV_GOOD);
+        for (i = 0; i < 1000; ++i) {
+                csv_write_record(writer, &rec);
+        }
+        ck_assert_int_eq(csv_writer_close(writer), CSV_GOOD);
+        csv_writer_free(writer);
+
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+
+        out = _slurp(path, &len);
+        ck_assert_int_eq(len, 2 + 4 * 1000);
+        ck_assert(!memcmp(out, "x\na,b\n", 6));
+        ck_assert(!memcmp(out + len - 4, "a,b\n", 4));
+        free(out);
+        remove(path);
+}
+END_TEST
+
+START_TEST(test_new_like)
+{
+        char path[PATH_MAX];
+        FILE* f = tmp_open(path);
+        fputs(" a ;b|c\n", f);
+        fclose(f);
+
+        struct csv_reader* orig = csv_reader_new();
+        csv_reader_set_delim(orig, ";");
+        orig->trim = true;
+        struct csv_reader* like = csv_reader_new_like(orig);
+        csv_reader_free(orig);
+        struct csv_record* rec = csv_record_new();
+        ck_assert_int_eq(csv_reader_open(like, path), CSV_GOOD);
+        ck_assert_int_eq(csv_get_record(like, rec), CSV_GOOD);
+        ck_assert_uint_eq(rec->size, 2);
+        _field_check(&rec->fields[0], "a");
+        _field_check(&rec->fields[1], "b|c");
+
+        /* Formatted the same, but not compressed */
+        struct csv_writer* worig = csv_writer_new();
+        csv_writer_set_delim(worig, "|");
+        csv_writer_set_line_ending(worig, "\r\n");
+        worig->quotes = QUOTE_ALL;
+#ifdef HAVE_ZLIB
+        ck_assert_int_eq(csv_writer_set_compression(worig, CSV_COMPRESS_GZIP, 0), CSV_GOOD);
+#endif
+        struct csv_writer* wlike = csv_writer_new_like(worig);
+        csv_writer_free(worig);
+        char* out = NULL;
+        size_t len = 0;
+        f = open_memstream(&out, &len);
+        csv_writer_set_file(wlike, f);
+        csv_write_record(wlike, rec);
+        ck_assert_int_eq(csv_writer_flush(wlike), CSV_GOOD);
+        fclose(f);
+        ck_assert_str_eq(out, "\"a\"|\"b|c\"\r\n");
+        free(out);
+
+        csv_writer_set_file(wlike, stdout);
+        csv_writer_free(wlike);
+        csv_record_free(rec);
+        csv_reader_free(like);
+        remove(path);
+}
+END_TEST
+
+START_TEST(test_pipeline)
+{
+        /* Several blocks of multi-line fields, mixed line
+         * endings, blank lines and a record the workers
+         * cannot parse.
+         */
+        char path[PATH_MAX];
+        char serial_path[PATH_MAX];
+        char out_path[PATH_MAX];
+        FILE* f = tmp_open(path);
+        fputs("id,text,n\r\n", f);
+        int i = 0;
+        for (; i < 60000; ++i) {
+                if (i % 997 == 0) {
+                        fputs("\r\n\n", f);
+                }
+                if (i == 31337) {
+                        fputs("1,\"a\"b\",2\n", f);
+                }
+                fprintf(f, "%d,\"x\r\ny, \"\"z\"\"\",%d%s", i, i * 7, (i % 3) ? "\n" : "\r\n");
+        }
+        fputs("last,\"\r\n\"", f);
+        fclose(f);
+        fclose(tmp_open(serial_path));
+        fclose(tmp_open(out_path));
+
+        long len = 0;
+        long serial_len = 0;
+        size_t rows = _pipeline_run(path, 0, 1, serial_path);
+        char* serial = _slurp(serial_path, &serial_len);
+
+        int mmap = 0;
+        for (; mmap < 2; ++mmap) {
+                ck_assert_uint_eq(_pipeline_run(path, mmap, 3, out_path), rows);
+                char* out = _slurp(out_path, &len);
+                ck_assert_int_eq(len, serial_len);
+                ck_assert(!memcmp(out, serial, len));
+                free(out);
+        }
+
+        free(serial);
+        remove(path);
+        remove(serial_path);
+        remove(out_path);
+}
+END_TEST
+
+void _sniff_check(const char* file_name, const char* delim, enum quote_style quotes,
+                  unsigned field_count, const char* line_ending)
+{
+        int mmap = 0;
+        for (; mmap < 2; ++mmap) {
+                csv_reader_free(reader);
+                reader = csv_reader_new();
+                if (mmap) {
+                        csv_reader_open_mmap(reader, file_name);
+                } else {
+                        csv_reader_open(reader, file_name);
+                }
+
+                struct csv_dialect dialect;
+                ck_assert_int_eq(csv_reader_sniff(reader, &dialect), CSV_GOOD);
+                ck_assert_str_eq(dialect.delim, delim);
+                ck_assert_int_eq(dialect.quotes, quotes);
+                ck_assert_uint_eq(dialect.field_count, field_count);
+                ck_assert_str_eq(dialect.line_ending, line_ending);
+                ck_assert(dialect.confidence > 0.9);
+
+                /* The reader has not moved */
+                ck_assert_int_eq(csv_get_record(reader, record), CSV_GOOD);
+                ck_assert_uint_eq(csv_reader_row_count(reader), 1);
+        }
+}
+
+START_TEST(test_sniff)
+{
+        _sniff_check("test_sniff_rfc.txt", ",", QUOTE_RFC4180, 3, "\n");
+        _sniff_check("test_sniff_crlf.txt", "|", QUOTE_RFC4180, 2, "\r\n");
+        _sniff_check("test_sniff_weak.txt", ";", QUOTE_WEAK, 3, "\n");
+        _sniff_check("test_sniff_none.txt", "\t", QUOTE_NONE, 3, "\n");
 
+        /* Nothing to sample from stdin */
+        struct csv_dialect dialect;
+        csv_reader_free(reader);
+        reader = csv_reader_new();
+        ck_assert_int_eq(csv_reader_sniff(reader, &dialect), CSV_FAIL);
+}
+END_TEST
 
 Suite* read_suite(void)
 {
@@ -291,6 +1306,24 @@ Suite* read_suite(void)
         tcase_add_test(tc_file_rfc, test_file_rfc);
         suite_add_tcase(s, tc_file_rfc);
 
+        TCase* tc_file_columns = tcase_create("columns");
+        tcase_add_checked_fixture(tc_file_columns, file_setup, parse_teardown);
+        tcase_add_test(tc_file_columns, test_file_columns);
+        tcase_add_test(tc_file_columns, test_file_first_column);
+        suite_add_tcase(s, tc_file_columns);
+
+        TCase* tc_file_batch = tcase_create("batch");
+        tcase_add_checked_fixture(tc_file_batch, file_setup, parse_teardown);
+        tcase_add_test(tc_file_batch, test_file_batch);
+        suite_add_tcase(s, tc_file_batch);
+
+        TCase* tc_ragged_batch = tcase_create("ragged_batch");
+        tcase_add_checked_fixture(tc_ragged_batch, parse_setup, parse_teardown);
+        tcase_add_test(tc_ragged_batch, test_ragged_batch);
+        tcase_add_test(tc_ragged_batch, test_typed_batch);
+        tcase_add_test(tc_ragged_batch, test_convert_fields);
+        suite_add_tcase(s, tc_ragged_batch);
+
         TCase* tc_file_weak = tcase_create("weak");
         tcase_add_checked_fixture(tc_file_weak, file_setup, parse_teardown);
         tcase_add_test(tc_file_weak, test_file_weak);
@@ -309,6 +1342,9 @@ Suite* read_suite(void)
         TCase* tc_realloc_append = tcase_create("realloc_append");
         tcase_add_checked_fixture(tc_realloc_append, parse_setup, parse_teardown);
         tcase_add_test(tc_realloc_append, test_realloc_append);
+        tcase_add_test(tc_realloc_append, test_record_arena);
+        tcase_add_test(tc_realloc_append, test_record_freeze);
+        tcase_add_test(tc_realloc_append, test_long_quoted_field);
         suite_add_tcase(s, tc_realloc_append);
 
         TCase* tc_failsafe_eof = tcase_create("failsafe_eof");
@@ -324,8 +1360,51 @@ Suite* read_suite(void)
         TCase* tc_failsafe_weak = tcase_create("failsafe_weak");
         tcase_add_checked_fixture(tc_failsafe_weak, parse_setup, parse_teardown);
         tcase_add_test(tc_failsafe_weak, test_fs_weak);
+        tcase_add_test(tc_failsafe_weak, test_fs_mark);
         suite_add_tcase(s, tc_failsafe_weak);
 
+        TCase* tc_failsafe_incremental = tcase_create("failsafe_incremental");
+        tcase_add_checked_fixture(tc_failsafe_incremental, parse_setup, parse_teardown);
+        tcase_add_test(tc_failsafe_incremental, test_fs_incremental);
+        suite_add_tcase(s, tc_failsafe_incremental);
+
+        TCase* tc_row_index = tcase_create("row_index");
+        tcase_add_checked_fixture(tc_row_index, parse_setup, parse_teardown);
+        tcase_add_test(tc_row_index, test_row_index);
+        tcase_add_test(tc_row_index, test_spool);
+#ifdef HAVE_ZLIB
+        tcase_add_test(tc_row_index, test_gzip);
+        tcase_add_test(tc_row_index, test_gzip_writer);
+#endif
+        suite_add_tcase(s, tc_row_index);
+
+        TCase* tc_feed = tcase_create("feed");
+        tcase_add_checked_fixture(tc_feed, parse_setup, parse_teardown);
+        tcase_add_test(tc_feed, test_feed_split);
+        suite_add_tcase(s, tc_feed);
+
+        TCase* tc_count = tcase_create("count");
+        tcase_add_checked_fixture(tc_count, parse_setup, parse_teardown);
+        tcase_add_test(tc_count, test_count_records);
+        suite_add_tcase(s, tc_count);
+
+        TCase* tc_sniff = tcase_create("sniff");
+        tcase_add_checked_fixture(tc_sniff, parse_setup, parse_teardown);
+        tcase_add_test(tc_sniff, test_sniff);
+        suite_add_tcase(s, tc_sniff);
+
+        TCase* tc_write = tcase_create("write");
+        tcase_add_test(tc_write, test_write_field);
+        tcase_add_test(tc_write, test_write_buffer);
+        tcase_add_test(tc_write, test_writer_sync);
+        tcase_add_test(tc_write, test_new_like);
+        suite_add_tcase(s, tc_write);
+
+        TCase* tc_pipeline = tcase_create("pipeline");
+        tcase_add_checked_fixture(tc_pipeline, parse_setup, parse_teardown);
+        tcase_add_test(tc_pipeline, test_pipeline);
+        suite_add_tcase(s, tc_pipeline);
+
         //TCase* tc_weak_trailing = tcase_create("failsafe_weak");
         //tcase_add_checked_fixture(tc_weak_trailing, parse_setup, parse_teardown);
         //tcase_add_test(tc_weak_trailing, test_weak_trailing);
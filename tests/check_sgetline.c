@@ -1,5 +1,7 @@
 #include <check.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "csv.h"
 #include "safegetline.h"
 #include "misc.h"
@@ -111,6 +113,76 @@ START_TEST(test_safegetline_long)
 }
 END_TEST
 
+struct blockbuf block;
+
+void block_setup(void)
+{
+        blockbuf_construct(&block, -1);
+}
+
+void block_teardown(void)
+{
+        close(block.fd);
+        blockbuf_destroy(&block);
+}
+
+void test_getline_block(const char* file_name, size_t next_offset)
+{
+        block.fd = open(file_name, O_RDONLY);
+        if (block.fd == -1) {
+                perror(file_name);
+                exit(EXIT_FAILURE);
+        }
+
+        char* line = NULL;
+        size_t len = 0;
+        int ret = sgetline_block(&block, &line, &len);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_uint_eq(len, 11);
+        ck_assert(!strncmp(line, "123,456,789", len));
+        ck_assert_uint_eq(blockbuf_offset(&block), next_offset);
+
+        /* the first line ending becomes '\n' */
+        ret = sappline_block(&block, &line, &len);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_uint_eq(len, 11 + 1 + 126);
+        ck_assert(!strncmp(line, "123,456,789\n0123456789", 22));
+
+        ret = sgetline_block(&block, &line, &len);
+        ck_assert_int_eq(ret, EOF);
+
+        /* start over */
+        lseek(block.fd, 4, SEEK_SET);
+        blockbuf_reset(&block, 4);
+        ret = sgetline_block(&block, &line, &len);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_uint_eq(len, 7);
+        ck_assert(!strncmp(line, "456,789", len));
+}
+
+START_TEST(test_block_lf)
+{
+        test_getline_block("test_lf.txt", 12);
+}
+END_TEST
+
+START_TEST(test_block_cr)
+{
+        test_getline_block("test_cr.txt", 12);
+}
+END_TEST
+
+START_TEST(test_block_crlf)
+{
+        test_getline_block("test_crlf.txt", 13);
+}
+END_TEST
+
+START_TEST(test_block_notrail)
+{
+        test_getline_block("test_notrail.txt", 12);
+}
+END_TEST
 
 Suite* sgetline_suite(void)
 {
@@ -126,6 +198,14 @@ Suite* sgetline_suite(void)
         tcase_add_test(tc_sgl, test_safegetline_long);
         suite_add_tcase(s, tc_sgl);
 
+        TCase* tc_block = tcase_create("block");
+        tcase_add_checked_fixture(tc_block, block_setup, block_teardown);
+        tcase_add_test(tc_block, test_block_lf);
+        tcase_add_test(tc_block, test_block_cr);
+        tcase_add_test(tc_block, test_block_crlf);
+        tcase_add_test(tc_block, test_block_notrail);
+        suite_add_tcase(s, tc_block);
+
         return s;
 }
 int main(void)
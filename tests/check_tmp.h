@@ -0,0 +1,26 @@
+#ifndef CHECK_TMP_H
+#define CHECK_TMP_H
+
+#include <check.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Open a new file for input that is too large to commit
+ * as a fixture, or for what a test writes. `path' gets
+ * its name, made by mkstemp under TMPDIR so that a test
+ * that fails before removing it leaves nothing in tests/.
+ */
+static inline FILE* tmp_open(char path[PATH_MAX])
+{
+	const char* dir = getenv("TMPDIR");
+	snprintf(path, PATH_MAX, "%s/libcsv_check_XXXXXX", (dir && *dir) ? dir : "/tmp");
+	int fd = mkstemp(path);
+	ck_assert_int_ne(fd, -1);
+	FILE* f = fdopen(fd, "w");
+	ck_assert_ptr_nonnull(f);
+	return f;
+}
+
+#endif /* CHECK_TMP_H */